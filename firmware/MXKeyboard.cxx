@@ -3,25 +3,51 @@
 #include <usb/core.hxx>
 #include "MXKeyboard.hxx"
 #include "interrupts.hxx"
+#include "led.hxx"
+#include "keyMatrix.hxx"
+#include "nvm.hxx"
+#include "scanTimer.hxx"
+#include "timing.hxx"
 #include "usb/hid.hxx"
 
 void run()
 {
 	__builtin_avr_cli();
 	oscInit();
+	mxKeyboard::timing::timingInit();
 	//ps2Init();
 	dmaInit();
+	mxKeyboard::timing::timeCopies();
 	ledInit();
 	keyInit();
 	usb::core::init();
 	usb::hid::registerHandlers(1, 0, 1);
 	usb::core::attach();
+	// Deliver start-of-frame events to usbBusEvtIRQ for the scan timer's use
+	USB.INTCTRLA |= USB_SOFIE_bm;
 	PMIC.CTRL = 0x87;
+	// Profile Flash page writes halt the CPU, so hold them back until nobody is typing
+	mxKeyboard::nvm::flashWriteGate(mxKeyboard::keyMatrix::idle);
 	__builtin_avr_sei();
 
+	// keyIRQ only samples and debounces the matrix, everything that follows from a key changing happens here
 	while (true)
-		continue;
+	{
+		mxKeyboard::keyMatrix::dispatchKeyEvents();
+		usb::hid::handleReport();
+		// A slice of any profile save's page preparation
+		mxKeyboard::nvm::serviceWrites();
+	}
 }
 
-void usbBusEvtIRQ() noexcept { usb::core::handleIRQ(); }
+void usbBusEvtIRQ() noexcept
+{
+	if (USB.INTFLAGSACLR & USB_SOFIF_bm)
+	{
+		USB.INTFLAGSACLR = USB_SOFIF_bm;
+		mxKeyboard::scanTimer::startOfFrame();
+		ledStartOfFrame();
+	}
+	usb::core::handleIRQ();
+}
 void usbIOCompIRQ() noexcept { usb::core::handleIRQ(); }
@@ -0,0 +1,62 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <cstdint>
+#include <avr/io.h>
+#include "nvm.hxx"
+
+namespace mxKeyboard::nvm
+{
+	static void crcSetup(const crc_t type, const CRC_SOURCE_t source) noexcept
+	{
+		const uint8_t width{type == crc_t::crc32 ? CRC_CRC32_bm : uint8_t(0U)};
+		// The width can only be changed with the module disabled
+		CRC.CTRL = CRC_SOURCE_DISABLE_gc;
+		CRC.CTRL = width | CRC_RESET_RESET1_gc;
+		CRC.CTRL = width | source;
+	}
+
+	static uint32_t crcChecksum() noexcept
+	{
+		const uint32_t result{CRC.CHECKSUM0 | (uint32_t(CRC.CHECKSUM1) << 8U) |
+			(uint32_t(CRC.CHECKSUM2) << 16U) | (uint32_t(CRC.CHECKSUM3) << 24U)};
+		CRC.CTRL = CRC_SOURCE_DISABLE_gc;
+		return result;
+	}
+
+	void crcStart(const crc_t type) noexcept
+		{ crcSetup(type, CRC_SOURCE_IO_gc); }
+
+	void crcUpdate(const uint8_t *const data, const uint16_t count) noexcept
+	{
+		for (uint16_t i{0}; i < count; ++i)
+			CRC.DATAIN = data[i];
+	}
+
+	uint32_t crcResult() noexcept
+	{
+		// Writing BUSY ends an I/O sourced checksum
+		CRC.STATUS = CRC_BUSY_bm;
+		return crcChecksum();
+	}
+
+	uint32_t flashRangeCRC(const uint32_t flashAddr, const uint16_t count) noexcept
+	{
+		// The NVM controller feeds the range through the module, which has to be listening to the Flash
+		crcSetup(crc_t::crc32, CRC_SOURCE_FLASH_gc);
+		// The range is given as its first and last byte addresses
+		const auto lastAddr{flashAddr + count - 1U};
+		NVM.ADDR0 = flashAddr & 0xFFU;
+		NVM.ADDR1 = (flashAddr >> 8U) & 0xFFU;
+		NVM.ADDR2 = (flashAddr >> 16U) & 0xFFU;
+		NVM.DATA0 = lastAddr & 0xFFU;
+		NVM.DATA1 = (lastAddr >> 8U) & 0xFFU;
+		NVM.DATA2 = (lastAddr >> 16U) & 0xFFU;
+		NVM.CMD = NVM_CMD_FLASH_RANGE_CRC_gc;
+		CCP = CCP_IOREG_gc;
+		NVM.CTRLA = NVM_CMDEX_bm;
+		while (NVM.STATUS & NVM_NVMBUSY_bm)
+			continue;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+		// The checksum is complete once the command is, without having to end it through BUSY
+		return crcChecksum();
+	}
+} // namespace mxKeyboard::nvm
@@ -1,11 +1,19 @@
 // SPDX-License-Identifier: BSD-3-Clause
 #include <cstdint>
+#include <avr/builtins.h>
 #include "MXKeyboard.hxx"
+#include "interrupts.hxx"
+#include "memory.hxx"
+
+// The LED chain uses channels 0-2, leaving channel 3 for copying between buffers
+static volatile bool copyActive{false};
+static dmaCopyDone_t copyDone{nullptr};
 
 void dmaInit()
 {
 	// Enable DMA controller, no double buffering, round robin
-	DMA.CTRL = 0x80 | DMA_DBUFMODE_CH01CH23_gc | DMA_PRIMODE_RR0123_gc;
+	// (the hardware pairs CH0 with CH1 and CH2 with CH3, which doesn't fit one channel per colour)
+	DMA.CTRL = 0x80 | DMA_DBUFMODE_DISABLED_gc | DMA_PRIMODE_RR0123_gc;
 }
 
 void dmaInit(DMA_CH_t &channel, const DMA_CH_TRIGSRC_t triggerSource)
@@ -46,8 +54,77 @@ void dmaTransferDest(DMA_CH_t &channel, const void *const address)
 void dmaTransferDest(DMA_CH_t &channel, const volatile void *const address)
 	{ dmaTransferDest(channel, reinterpret_cast<std::uint32_t>(address)); }
 
-void dmaInterruptEnable(DMA_CH_t &channel)
-	{ channel.CTRLB = DMA_CH_TRNINTLVL_HI_gc; }
+void dmaInterruptEnable(DMA_CH_t &channel, const DMA_CH_TRNINTLVL_t level)
+	{ channel.CTRLB = level; }
 
 void dmaTrigger(DMA_CH_t &channel)
 	{ channel.CTRLA |= 0x80; }
+
+void dmaCopy(void *const dest, const void *const src, const uint16_t length, const dmaCopyDone_t done) noexcept
+{
+	dmaWaitForCopy();
+	// Blocks must be a whole number of 8-byte bursts, so the CPU copies whatever's left over
+	const auto blockLength{uint16_t(length & ~7U)};
+	mxKeyboard::memory::copy(static_cast<uint8_t *>(dest) + blockLength,
+		static_cast<const uint8_t *>(src) + blockLength, length - blockLength);
+	if (!blockLength)
+	{
+		if (done)
+			done();
+		return;
+	}
+
+	auto &channel{DMA.CH3};
+	copyDone = done;
+	copyActive = true;
+	channel.ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc |
+		DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_INC_gc;
+	channel.TRIGSRC = DMA_CH_TRIGSRC_OFF_gc;
+	channel.REPCNT = 0;
+	dmaTransferSource(channel, src);
+	dmaTransferDest(channel, dest);
+	dmaTransferLength(channel, blockLength);
+	// Clear any flags left from the last copy, and hear about this one finishing however it ends
+	channel.CTRLB = DMA_CH_ERRIF_bm | DMA_CH_TRNIF_bm | DMA_CH_ERRINTLVL_LO_gc | DMA_CH_TRNINTLVL_LO_gc;
+	channel.CTRLA = DMA_CH_ENABLE_bm | DMA_CH_BURSTLEN_8BYTE_gc;
+	// With no trigger source, a software request moves the whole block
+	channel.CTRLA |= DMA_CH_TRFREQ_bm;
+}
+
+bool dmaCopyBusy() noexcept { return copyActive; }
+
+// Retires the finished copy, returning its callback for the caller to run
+static dmaCopyDone_t copyComplete() noexcept
+{
+	DMA.CH3.CTRLB |= DMA_CH_ERRIF_bm | DMA_CH_TRNIF_bm;
+	copyActive = false;
+	return copyDone;
+}
+
+void dmaWaitForCopy() noexcept
+{
+	while (true)
+	{
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		if (!copyActive)
+		{
+			SREG = sreg;
+			return;
+		}
+		// Poll rather than wait on the interrupt, so this also works with interrupts off
+		const auto done{(DMA.CH3.CTRLB & (DMA_CH_ERRIF_bm | DMA_CH_TRNIF_bm)) ? copyComplete() : nullptr};
+		const bool finished{!copyActive};
+		SREG = sreg;
+		if (finished && done)
+			done();
+	}
+}
+
+void dmaChannel3IRQ() noexcept
+{
+	if (!copyActive)
+		return;
+	if (const auto done{copyComplete()}; done)
+		done();
+}
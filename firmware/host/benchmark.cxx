@@ -0,0 +1,722 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <utility>
+#include "MXKeyboard.hxx"
+#include "interrupts.hxx"
+#include "keyMatrix.hxx"
+#include "../led.hxx"
+#include "usb/hid.hxx"
+#include "ledEffects.hxx"
+#include "profile.hxx"
+#include "memory.hxx"
+#include "nvm.hxx"
+#include "usb/hidTypes.hxx"
+#include "host.hxx"
+
+/*!
+ * Host benchmarks for the firmware's hot paths. These time the code as compiled
+ * for the host, so absolute numbers say nothing about the AVR - compare runs
+ * against each other to spot regressions.
+ */
+
+using benchmarkClock_t = std::chrono::steady_clock;
+using usb::hid::scancode_t;
+
+static std::size_t iterations{200000U};
+// The first usage past the end of the NKRO report, so it never collides with the held keys
+constexpr static auto f13{static_cast<scancode_t>(uint8_t(scancode_t::keypadEquals) + 1U)};
+
+// Returns the time each call took, in nanoseconds
+template<typename function_t> static double benchmark(const char *const name, function_t &&function) noexcept
+{
+	// Warm up caches and branch predictors before timing (callers counting calls must include these)
+	for (std::size_t i{0}; i < iterations / 10U; ++i)
+		function(i);
+
+	const auto start{benchmarkClock_t::now()};
+	for (std::size_t i{0}; i < iterations; ++i)
+		function(i);
+	const auto end{benchmarkClock_t::now()};
+
+	const std::chrono::duration<double, std::nano> elapsed{end - start};
+	const auto perCall{elapsed.count() / double(iterations)};
+	std::printf("%-40s %12.2f ns/op\n", name, perCall);
+	return perCall;
+}
+
+// Vendor requests, host to device and device to host, addressed to interface 0
+constexpr static usb::types::setupPacket::requestType_t vendorOutType{0x41U};
+constexpr static usb::types::setupPacket::requestType_t vendorInType{0xC1U};
+
+static usb::types::answer_t vendorRequest(const usb::types::setupPacket::requestType_t type,
+	const usb::hid::vendorRequest_t request, const uint16_t value, const uint16_t length) noexcept
+	{ return host::usbSetup({type, static_cast<usb::types::request_t>(request), {value}, 0U, length}); }
+
+// Cheap deterministic PRNG so runs are comparable with each other
+static uint32_t xorshift(uint32_t &state) noexcept
+{
+	state ^= state << 13U;
+	state ^= state >> 17U;
+	state ^= state << 5U;
+	return state;
+}
+
+// One scan of the matrix followed by a pass of the main loop and an IN poll from the host
+static void scan() noexcept
+{
+	using mxKeyboard::scanTimer::microsecondsPerTimestampTick;
+	// Move the timestamp timer on by a scan period, as it would have counted on the keyboard
+	TCD1.CNT = uint16_t(TCD1.CNT +
+		(1000U / microsecondsPerTimestampTick) / mxKeyboard::scanTimer::scansPerMillisecond());
+	keyIRQ();
+	mxKeyboard::keyMatrix::dispatchKeyEvents();
+	usb::hid::handleReport();
+	host::usbCompleteIn(1);
+}
+
+static void releaseAll() noexcept
+{
+	host::matrix.fill(0U);
+	// Give the debounce logic enough scans to settle everything back to released
+	for (std::size_t i{0}; i < 64U; ++i)
+	{
+		scan();
+	}
+}
+
+/*!
+ * Like benchmark(), but also reports how many matrix columns the scans were able to skip and
+ * the rest of the scan stats, read back (and cleared) with the getScanStats vendor request
+ */
+template<typename function_t> static void benchmarkKeyIRQ(const char *const name, function_t &&function) noexcept
+{
+	using mxKeyboard::keyMatrix::scanStats_t;
+	vendorRequest(vendorInType, usb::hid::vendorRequest_t::getScanStats, 1U, sizeof(scanStats_t));
+	benchmark(name, function);
+	const auto answer{vendorRequest(vendorInType, usb::hid::vendorRequest_t::getScanStats, 1U, sizeof(scanStats_t))};
+	scanStats_t stats{};
+	if (answer.response == usb::types::response_t::data)
+		std::memcpy(&stats, answer.data, sizeof(stats));
+	else
+		std::printf("Failed to read the scan stats\n");
+	const uint32_t skipped{stats.columnsSkipped};
+	const uint32_t processed{stats.columnsProcessed};
+	const auto total{double(skipped) + double(processed)};
+	std::printf("    columns skipped: %u, processed: %u (%.1f%% skipped)\n", skipped, processed,
+		total ? (double(skipped) * 100.0) / total : 0.0);
+	std::printf("    scan rate: %u Hz, overruns: %u, events deferred: %u\n", stats.achievedRate, stats.overruns,
+		stats.eventsDeferred);
+}
+
+static void benchmarkScan() noexcept
+{
+	using mxKeyboard::keyMatrix::keyCount;
+	// Host padding makes keyState_t a byte larger than on the AVR
+	std::printf("Key state RAM: %zu bytes scanned by keyIRQ + %zu bytes read on edges\n",
+		sizeof(mxKeyboard::keyMatrix::keyState_t) * keyCount, sizeof(mxKeyboard::keyMatrix::keyInfo_t) * keyCount);
+
+	releaseAll();
+	benchmarkKeyIRQ("keyIRQ (idle)", [](std::size_t) noexcept
+	{
+		scan();
+	});
+
+	benchmarkKeyIRQ("keyIRQ (single key tapping)", [](const std::size_t i) noexcept
+	{
+		// Toggle the 'A' key (column 1, row 3) every 8 scans
+		host::matrix[1] = (i & 8U) ? 0x08U : 0x00U;
+		scan();
+	});
+	releaseAll();
+
+	benchmarkKeyIRQ("keyIRQ (20-key chord held)", [](const std::size_t i) noexcept
+	{
+		// Alternate between pressing and releasing the number and top letter rows of columns 1-10
+		const uint8_t rows{(i & 64U) ? uint8_t{0x06U} : uint8_t{0x00U}};
+		for (std::size_t column{1}; column < 11U; ++column)
+			host::matrix[column] = rows;
+		scan();
+	});
+	releaseAll();
+
+	uint32_t state{0x12345678U};
+	benchmarkKeyIRQ("keyIRQ (full matrix chatter)", [&](std::size_t) noexcept
+	{
+		for (auto &column : host::matrix)
+			column = uint8_t(xorshift(state) & 0x3FU);
+		scan();
+	});
+	releaseAll();
+}
+
+// Reads the boot report back with GET_REPORT and checks it holds the expected keys in order
+static void checkBootReport(const char *const what, const std::array<uint8_t, 6> &keys) noexcept
+{
+	// Class request, device to host, addressed to interface 0, for input report 0
+	constexpr usb::types::setupPacket::requestType_t getReportType{0xA1U};
+	const auto answer{host::usbSetup({getReportType, static_cast<usb::types::request_t>(usb::hid::types::request_t::getReport),
+		{0x0100U}, 0U, 8U})};
+	const std::array<uint8_t, 8> expected{{0U, 0U, keys[0], keys[1], keys[2], keys[3], keys[4], keys[5]}};
+	if (answer.response != usb::types::response_t::data || answer.length != expected.size() ||
+		std::memcmp(answer.data, expected.data(), expected.size()))
+		std::printf("Boot report wrong with %s\n", what);
+}
+
+static void benchmarkHID() noexcept
+{
+	// Class request, host to device, addressed to interface 0
+	constexpr usb::types::setupPacket::requestType_t setProtocolType{0x21U};
+	// Start from no keys held, as after SET_CONFIGURATION, whatever the scan benchmarks left behind
+	host::usbConfigure(1);
+	if (host::usbSetup({setProtocolType, static_cast<usb::types::request_t>(usb::hid::types::request_t::setProtocol),
+		{uint16_t(usb::hid::protocol_t::boot)}, 0U, 0U}).response != usb::types::response_t::zeroLength)
+		std::printf("Failed to switch to the boot protocol\n");
+	const auto a{uint8_t(scancode_t::a)};
+	usb::hid::keyPress(scancode_t::a);
+	usb::hid::keyPress(scancode_t::b);
+	checkBootReport("a and b held", {{a, uint8_t(a + 1U), 0U, 0U, 0U, 0U}});
+	// Past six keys the report rolls over, and letting go of one of the first six brings the seventh in
+	for (uint8_t key{2}; key < 7U; ++key)
+		usb::hid::keyPress(static_cast<scancode_t>(a + key));
+	constexpr auto rollOver{uint8_t(scancode_t::errorRollOver)};
+	checkBootReport("a through g held", {{rollOver, rollOver, rollOver, rollOver, rollOver, rollOver}});
+	usb::hid::keyRelease(scancode_t::b);
+	checkBootReport("b let go of", {{a, uint8_t(a + 2U), uint8_t(a + 3U), uint8_t(a + 4U), uint8_t(a + 5U),
+		uint8_t(a + 6U)}});
+	for (uint8_t key{0}; key < 7U; ++key)
+		usb::hid::keyRelease(static_cast<scancode_t>(a + key));
+	checkBootReport("nothing held", {});
+	// The key brought in is the next to have been pressed, not the lowest usage left over
+	const auto z{uint8_t(scancode_t::z)};
+	for (uint8_t key{0}; key < 8U; ++key)
+		usb::hid::keyPress(static_cast<scancode_t>(z - key));
+	usb::hid::keyRelease(scancode_t::z);
+	usb::hid::keyRelease(scancode_t::x);
+	checkBootReport("z through s pressed in reverse, z and x let go of", {{uint8_t(z - 1U), uint8_t(z - 3U),
+		uint8_t(z - 4U), uint8_t(z - 5U), uint8_t(z - 6U), uint8_t(z - 7U)}});
+	for (uint8_t key{0}; key < 8U; ++key)
+		usb::hid::keyRelease(static_cast<scancode_t>(z - key));
+	checkBootReport("nothing held", {});
+	usb::hid::handleReport();
+	while (host::usbCompleteIn(1))
+		continue;
+
+	// Hold down a set of other keys (a, b, c.. through to keypadEquals) and time a tap of F13 on top
+	for (const std::size_t held : {1U, 6U, 20U, 100U})
+	{
+		for (std::size_t key{0}; key < held; ++key)
+			usb::hid::keyPress(static_cast<scancode_t>(uint8_t(scancode_t::a) + key));
+
+		std::array<char, 64> name{};
+		std::snprintf(name.data(), name.size(), "keyPress + keyRelease (%zu keys held)", held);
+		benchmark(name.data(), [](std::size_t) noexcept
+		{
+			usb::hid::keyPress(f13);
+			usb::hid::keyRelease(f13);
+		});
+		std::snprintf(name.data(), name.size(), "handleReport (boot, %zu keys held)", held);
+		benchmark(name.data(), [](std::size_t) noexcept
+		{
+			usb::hid::keyPress(f13);
+			usb::hid::handleReport();
+			host::usbCompleteIn(1);
+			usb::hid::keyRelease(f13);
+			usb::hid::handleReport();
+			host::usbCompleteIn(1);
+		});
+
+		for (std::size_t key{0}; key < held; ++key)
+			usb::hid::keyRelease(static_cast<scancode_t>(uint8_t(scancode_t::a) + key));
+	}
+
+	host::usbSetup({setProtocolType, static_cast<usb::types::request_t>(usb::hid::types::request_t::setProtocol),
+		{uint16_t(usb::hid::protocol_t::report)}, 0U, 0U});
+
+	benchmark("keyPress + keyRelease (modifier)", [](std::size_t) noexcept
+	{
+		usb::hid::keyPress(scancode_t::leftShift);
+		usb::hid::keyRelease(scancode_t::leftShift);
+	});
+
+	benchmark("handleReport (stale)", [](std::size_t) noexcept
+	{
+		usb::hid::keyPress(scancode_t::a);
+		usb::hid::handleReport();
+		host::usbCompleteIn(1);
+		usb::hid::keyRelease(scancode_t::a);
+		usb::hid::handleReport();
+		host::usbCompleteIn(1);
+	});
+
+	// A press and release landing between two IN polls must both still reach the host
+	std::size_t reportsSent{0};
+	usb::hid::resetReportStats();
+	benchmark("handleReport (tap between two polls)", [&](std::size_t) noexcept
+	{
+		usb::hid::keyPress(scancode_t::a);
+		usb::hid::handleReport();
+		usb::hid::keyRelease(scancode_t::a);
+		usb::hid::handleReport();
+		while (host::usbCompleteIn(1))
+			++reportsSent;
+	});
+	const auto stats{usb::hid::reportStats()};
+	std::printf("    reports sent per tap: %.2f, queue overflows: %u, max depth: %u\n",
+		double(reportsSent) / double(iterations + (iterations / 10U)), stats.overflows, stats.maxDepth);
+}
+
+// Taps a key with the host's IN token coming the lead time after each scan, as SOF sync arranges
+static void benchmarkLatency() noexcept
+{
+	using mxKeyboard::scanTimer::latencyHistogram_t;
+	using mxKeyboard::scanTimer::microsecondsPerTimestampTick;
+	using mxKeyboard::scanTimer::latencyBucketWidth;
+	constexpr uint16_t leadTime{500U};
+	if (vendorRequest(vendorOutType, usb::hid::vendorRequest_t::setSOFSync, 1U, 0U).response !=
+		usb::types::response_t::zeroLength ||
+		vendorRequest(vendorOutType, usb::hid::vendorRequest_t::setLeadTime, leadTime, 0U).response !=
+		usb::types::response_t::zeroLength)
+		std::printf("Failed to set up start of frame sync\n");
+	const auto sync{vendorRequest(vendorInType, usb::hid::vendorRequest_t::getScanSync, 0U, sizeof(usb::hid::scanSync_t))};
+	usb::hid::scanSync_t syncState{};
+	if (sync.response == usb::types::response_t::data)
+		std::memcpy(&syncState, sync.data, sizeof(syncState));
+	if (sync.response != usb::types::response_t::data || !syncState.sofSync || syncState.leadTime != leadTime)
+		std::printf("Start of frame sync read back wrong\n");
+
+	releaseAll();
+	// Read with wValue 1 to start from an empty histogram
+	vendorRequest(vendorInType, usb::hid::vendorRequest_t::getLatency, 1U, sizeof(latencyHistogram_t));
+	for (std::size_t i{0}; i < 256U; ++i)
+	{
+		host::matrix[1] = (i & 8U) ? 0x08U : 0x00U;
+		keyIRQ();
+		mxKeyboard::keyMatrix::dispatchKeyEvents();
+		usb::hid::handleReport();
+		TCD1.CNT = uint16_t(TCD1.CNT + (leadTime / microsecondsPerTimestampTick));
+		host::usbCompleteIn(1);
+	}
+	releaseAll();
+
+	const auto answer{vendorRequest(vendorInType, usb::hid::vendorRequest_t::getLatency, 1U,
+		sizeof(latencyHistogram_t))};
+	latencyHistogram_t histogram{};
+	if (answer.response == usb::types::response_t::data)
+		std::memcpy(&histogram, answer.data, sizeof(histogram));
+	std::printf("Key to host latency with SOF sync and a %uus lead:", syncState.leadTime);
+	for (std::size_t bucket{0}; bucket < histogram.buckets.size(); ++bucket)
+	{
+		if (histogram.buckets[bucket])
+			std::printf(" %zu-%zuus: %u", bucket * latencyBucketWidth * microsecondsPerTimestampTick,
+				(bucket + 1U) * latencyBucketWidth * microsecondsPerTimestampTick, histogram.buckets[bucket]);
+	}
+	std::printf("\n");
+
+	// A stamp whose key change left the report as it was mustn't go with the next change, say a
+	// profile switch letting go of a key, which has none
+	usb::hid::keyPress(scancode_t::a);
+	usb::hid::handleReport();
+	while (host::usbCompleteIn(1))
+		continue;
+	vendorRequest(vendorInType, usb::hid::vendorRequest_t::getLatency, 1U, sizeof(latencyHistogram_t));
+	usb::hid::keyEdge(uint16_t(TCD1.CNT - 0x1000U));
+	usb::hid::keyPress(scancode_t::a);
+	usb::hid::keyRelease(scancode_t::a);
+	usb::hid::handleReport();
+	while (host::usbCompleteIn(1))
+		continue;
+	const auto stale{vendorRequest(vendorInType, usb::hid::vendorRequest_t::getLatency, 1U,
+		sizeof(latencyHistogram_t))};
+	if (stale.response != usb::types::response_t::data)
+		std::printf("Failed to read the latency histogram\n");
+	else
+	{
+		std::memcpy(&histogram, stale.data, sizeof(histogram));
+		if (std::any_of(histogram.buckets.begin(), histogram.buckets.end(), [](const uint16_t count) noexcept
+			{ return count != 0U; }))
+			std::printf("Latency wrongly recorded from a stale edge stamp\n");
+	}
+
+	vendorRequest(vendorOutType, usb::hid::vendorRequest_t::setSOFSync, 0U, 0U);
+}
+
+static void benchmarkLEDs() noexcept
+{
+	benchmark("ledSetValue", [](const std::size_t i) noexcept
+	{
+		const auto value{uint8_t(i)};
+		ledSetValue(i % 109U, value, uint8_t(~value), uint8_t(value ^ 0x5AU));
+	});
+	// The same key highlight and restore updateKey() does, from colours packed at profile load
+	benchmark("ledSetValue (rgb, highlight + restore)", [](const std::size_t i) noexcept
+	{
+		ledSetValue(i % 109U, 0x00U, 0xFFU, 0x00U);
+		ledSetValue(i % 109U, 0x12U, 0x34U, 0x56U);
+	});
+	for (std::size_t led{0}; led < 109U; ++led)
+		ledCacheColour(led, 0x12U, 0x34U, 0x56U);
+	ledHighlightColour(0x00U, 0xFFU, 0x00U);
+	benchmark("ledHighlight + ledRestoreColour (cached)", [](const std::size_t i) noexcept
+	{
+		ledHighlight(i % 109U);
+		ledRestoreColour(i % 109U);
+	});
+
+	// The host supplies a start-of-frame every millisecond while the bus is awake, which the LED governor relies on
+	benchmark("tcc0OverflowIRQ", [](std::size_t) noexcept
+	{
+		ledStartOfFrame();
+		tcc0OverflowIRQ();
+	});
+	// The accent LEDs change every few frames, and only those frames get swapped in and sent
+	const auto framesBefore{host::dmaTriggers[2]};
+	benchmark("tcc0OverflowIRQ + dmaChannel2IRQ", [](std::size_t) noexcept
+	{
+		ledStartOfFrame();
+		tcc0OverflowIRQ();
+		dmaChannel2IRQ();
+	});
+	std::printf("    frames sent per period: %.2f\n",
+		double(host::dmaTriggers[2] - framesBefore) / double(iterations + (iterations / 10U)));
+
+	using mxKeyboard::ledEffects::effect_t;
+	using mxKeyboard::ledEffects::frameStats_t;
+	for (const auto &[effect, name] : {std::pair{effect_t::breathing, "ledEffects::render (breathing)"},
+		std::pair{effect_t::hueWave, "ledEffects::render (hue wave)"},
+		std::pair{effect_t::ripple, "ledEffects::render (ripple)"},
+		std::pair{effect_t::staticColour, "ledEffects::render (static)"}})
+	{
+		mxKeyboard::ledEffects::effect(effect);
+		const auto render{[](const std::size_t i) noexcept
+		{
+			// Keep a few ripples going
+			if (!(i & 15U))
+			{
+				mxKeyboard::ledEffects::keyPressed(uint8_t(i % 101U), true);
+				mxKeyboard::ledEffects::keyPressed(uint8_t(i % 101U), false);
+			}
+			mxKeyboard::ledEffects::render();
+		}};
+		benchmark(name, render);
+
+		// Then time the renders themselves, as the frame stats would on the keyboard
+		host::ledTimerFollowsClock(true);
+		vendorRequest(vendorInType, usb::hid::vendorRequest_t::getFrameStats, 1U, sizeof(frameStats_t));
+		for (std::size_t i{0}; i < 1000U; ++i)
+			render(i);
+		host::ledTimerFollowsClock(false);
+		const auto answer{vendorRequest(vendorInType, usb::hid::vendorRequest_t::getFrameStats, 1U,
+			sizeof(frameStats_t))};
+		frameStats_t stats{};
+		if (answer.response == usb::types::response_t::data)
+			std::memcpy(&stats, answer.data, sizeof(stats));
+		else
+			std::printf("Failed to read the frame stats\n");
+		// TCC0 ticks are 250ns
+		std::printf("    longest render: %.2fus, last frame: %.2fus, split frames: %u\n",
+			double(stats.maxRenderTicks) / 4.0, double(stats.frameTicks) / 4.0, stats.splitFrames);
+	}
+
+	// Full white on every LED asks for far more than the budget, so every frame sent gets scaled back
+	for (std::size_t led{0}; led < ledCount; ++led)
+		ledSetValue(led, 0xFFU, 0xFFU, 0xFFU);
+	benchmark("tcc0 + dmaChannel2IRQ (governed)", [](std::size_t) noexcept
+	{
+		ledStartOfFrame();
+		tcc0OverflowIRQ();
+		dmaChannel2IRQ();
+	});
+	const auto current{ledCurrent()};
+	std::printf("    LED current demand: %umA, delivered: %umA\n", current.demand, current.delivered);
+}
+
+static void benchmarkProfiles() noexcept
+{
+	using mxKeyboard::profile::profile_t;
+	// Tweaking one key's colour at a time, as someone adjusting their lighting would
+	auto profile{profile_t::read(0)};
+	const auto flashWritesBefore{host::flashPageWrites};
+	const auto eepromWritesBefore{host::eepromPageWrites};
+	benchmark("profile_t::write (one key colour)", [&](const std::size_t i) noexcept
+	{
+		// Profiles hold 16 distinct colours, so stick to those
+		const auto value{uint8_t((i % 15U) * 17U)};
+		profile.keyColour(uint8_t(i % mxKeyboard::keyMatrix::keyCount), {value, uint8_t(~value), 0x5AU});
+		if (!profile.write())
+			std::printf("    Profile write failed\n");
+	});
+	const auto writes{double(iterations + (iterations / 10U))};
+	std::printf("    Flash page writes per write: %.3f, EEPROM page writes per write: %.3f\n",
+		double(host::flashPageWrites - flashWritesBefore) / writes,
+		double(host::eepromPageWrites - eepromWritesBefore) / writes);
+
+	// Compaction is put together in slices from the main loop, the interrupts only retiring page writes
+	profile_t::waitForSave();
+	std::chrono::duration<double, std::nano> longestSlice{};
+	for (std::size_t i{0}; i < 2000U; ++i)
+	{
+		const auto value{uint8_t(((i + 7U) % 15U) * 17U)};
+		profile.keyColour(uint8_t(i % mxKeyboard::keyMatrix::keyCount), {value, uint8_t(~value), 0x5AU});
+		if (!profile.write())
+			std::printf("    Profile write failed\n");
+		while (profile_t::saving())
+		{
+			nvmEEPROMReadyIRQ();
+			const auto start{benchmarkClock_t::now()};
+			mxKeyboard::nvm::serviceWrites();
+			longestSlice = std::max<decltype(longestSlice)>(longestSlice, benchmarkClock_t::now() - start);
+		}
+	}
+	std::printf("    Longest main loop slice of a save: %.2f ns\n", longestSlice.count());
+
+	// Flash page writes halt the CPU, so with the main loop's gate in place they wait for the keys to go idle
+	mxKeyboard::nvm::flashWriteGate(mxKeyboard::keyMatrix::idle);
+	host::matrix[1] = 0x08U;
+	for (std::size_t i{0}; i < 8U; ++i)
+		scan();
+	const auto heldFlashWrites{host::flashPageWrites};
+	bool heldBack{false};
+	for (std::size_t i{0}; i < 200U && !heldBack; ++i)
+	{
+		const auto value{uint8_t(((i + 3U) % 15U) * 17U)};
+		profile.keyColour(uint8_t(i % mxKeyboard::keyMatrix::keyCount), {value, uint8_t(~value), 0x5AU});
+		if (!profile.write())
+			std::printf("    Profile write failed\n");
+		for (std::size_t step{0}; step < 1000U && profile_t::saving(); ++step)
+		{
+			nvmEEPROMReadyIRQ();
+			mxKeyboard::nvm::serviceWrites();
+		}
+		heldBack = profile_t::saving();
+	}
+	if (!heldBack || host::flashPageWrites != heldFlashWrites)
+		std::printf("    Flash pages were written while a key was held\n");
+	releaseAll();
+	while (profile_t::saving())
+	{
+		nvmEEPROMReadyIRQ();
+		mxKeyboard::nvm::serviceWrites();
+	}
+	if (host::flashPageWrites == heldFlashWrites)
+		std::printf("    Flash pages held back weren't written once the keys were let go of\n");
+	mxKeyboard::nvm::flashWriteGate(nullptr);
+
+	profile_t::waitForSave();
+	benchmark("profile_t::read (decode)", [](const std::size_t) noexcept
+	{
+		const auto decoded{profile_t::read(0)};
+		static_cast<void>(decoded);
+	});
+
+	const auto stored{profile_t::read(0)};
+	for (std::size_t key{0}; key < mxKeyboard::keyMatrix::keyCount; ++key)
+	{
+		// Keys without an LED don't keep a colour
+		if (mxKeyboard::layout::matrix[key].ledIndex == mxKeyboard::layout::noLED)
+			continue;
+		const auto a{profile.keyColour(uint8_t(key))};
+		const auto b{stored.keyColour(uint8_t(key))};
+		if (a.r != b.r || a.g != b.g || a.b != b.b)
+		{
+			std::printf("    Profile read back does not match what was written\n");
+			break;
+		}
+	}
+
+	// More colours than the palette holds must be refused rather than stored as others
+	auto overflowing{stored};
+	for (uint8_t key{0}; key < mxKeyboard::keyMatrix::keyCount; ++key)
+		overflowing.keyColour(key, {key, key, key});
+	if (overflowing.write())
+		std::printf("    Profile with too many colours was written\n");
+
+	// Every key remapped with its own timings is as big as a profile gets, and still has to fit
+	auto remapped{stored};
+	remapped.number(3U);
+	for (uint8_t key{0}; key < mxKeyboard::keyMatrix::keyCount; ++key)
+	{
+		remapped.scancode(key, static_cast<mxKeyboard::profile::usbScancode_t>(
+			uint8_t(mxKeyboard::layout::matrix[key].usbScancode) ^ 0x40U));
+		remapped.timePress(key, key);
+		remapped.timeRelease(key, uint8_t(key & 0x3FU));
+	}
+	// Release times too long to store clamp rather than wrap
+	auto clamped{remapped};
+	clamped.timeRelease(0U, 200U);
+	if (clamped.timeRelease(0U) != mxKeyboard::profile::maxTimeRelease)
+		std::printf("    Release time of 200ms was stored as %ums\n", clamped.timeRelease(0U));
+	if (!remapped.write())
+		std::printf("    Profile with every key remapped was not written\n");
+	const auto remappedStored{profile_t::read(3U)};
+	for (uint8_t key{0}; key < mxKeyboard::keyMatrix::keyCount; ++key)
+	{
+		if (mxKeyboard::layout::matrix[key].ledIndex == mxKeyboard::layout::noLED)
+			continue;
+		if (remappedStored.scancode(key) != remapped.scancode(key) ||
+			remappedStored.timePress(key) != remapped.timePress(key) ||
+			remappedStored.timeRelease(key) != remapped.timeRelease(key))
+		{
+			std::printf("    Profile with every key remapped read back wrong\n");
+			break;
+		}
+	}
+}
+
+static void benchmarkProfileSwitch() noexcept
+{
+	using mxKeyboard::profile::profile_t;
+	using mxKeyboard::keyMatrix::keyCount;
+	using mxKeyboard::scanTimer::scanRate_t;
+	// Profile 1 is profile 0 with a handful of keys recoloured, as per-application profiles tend to be
+	auto profile{profile_t::read(0)};
+	profile.number(1);
+	for (uint8_t key{0}; key < 8U; ++key)
+		profile.keyColour(uint8_t(key * 11U), {0xFFU, 0x00U, 0x00U});
+	if (!profile.write())
+		std::printf("Failed to write profile 1\n");
+	profile_t::waitForSave();
+	// Profile 2 differs in everything that can be switched
+	profile.number(2);
+	profile.debounce(uint8_t(profile.debounce() + 2U));
+	profile.effect(mxKeyboard::ledEffects::effect_t::breathing);
+	for (uint8_t key{0}; key < keyCount; ++key)
+	{
+		// As many colours as the palette holds
+		profile.keyColour(key, {uint8_t((key & 0x0FU) * 17U), 0x80U, uint8_t(~key & 0x0FU)});
+		profile.timePress(key, 2U);
+	}
+	if (!profile.write())
+		std::printf("Failed to write profile 2\n");
+	profile_t::waitForSave();
+
+	/*!
+	 * A switch is worked through a step per main loop pass, so runs passes until it lands, keeping
+	 * the shortest time seen for each step in steps. Returns how many passes it took.
+	 */
+	const auto switchTo
+	{
+		[](const uint8_t number, std::array<double, 256> &steps) noexcept
+		{
+			std::size_t passes{0};
+			while (mxKeyboard::keyMatrix::activeProfile() != number && passes < steps.size())
+			{
+				const auto start{benchmarkClock_t::now()};
+				mxKeyboard::keyMatrix::dispatchKeyEvents();
+				const std::chrono::duration<double, std::nano> elapsed{benchmarkClock_t::now() - start};
+				steps[passes] = std::min(steps[passes], elapsed.count());
+				++passes;
+			}
+			return passes;
+		}
+	};
+	std::array<double, 256> steps{};
+
+	if (vendorRequest(vendorOutType, usb::hid::vendorRequest_t::setProfile, 1U, 0U).response !=
+		usb::types::response_t::zeroLength)
+		std::printf("Failed to request a profile switch\n");
+	switchTo(1U, steps);
+	const auto answer{vendorRequest(vendorInType, usb::hid::vendorRequest_t::getProfile, 0U, 1U)};
+	if (answer.response != usb::types::response_t::data || *static_cast<const uint8_t *>(answer.data) != 1U)
+		std::printf("Profile switch did not take\n");
+	mxKeyboard::keyMatrix::selectProfile(0U);
+	switchTo(0U, steps);
+
+	/*
+	 * keyIRQ carries on underneath a switch, but its events and the USB reports wait on each step,
+	 * so the longest step has to leave most of a scan period for the rest of the main loop at every
+	 * scan rate. The host runs far faster than the AVR, so the share of the period taken here is a
+	 * floor rather than the AVR's figure - it's there to catch a step growing.
+	 */
+	releaseAll();
+	const auto rate{mxKeyboard::scanTimer::scanRate()};
+	for (const uint8_t other : {1U, 2U})
+	{
+		steps.fill(1e12);
+		std::size_t passes{0};
+		for (std::size_t i{0}; i < 200U; ++i)
+		{
+			mxKeyboard::keyMatrix::selectProfile(other);
+			passes = std::max(passes, switchTo(other, steps));
+			std::array<double, 256> back{};
+			mxKeyboard::keyMatrix::selectProfile(0U);
+			switchTo(0U, back);
+		}
+		if (mxKeyboard::keyMatrix::activeProfile() != 0U || passes == steps.size())
+			std::printf("Profile switch (0 -> %u) did not complete\n", other);
+		const auto longest{*std::max_element(steps.begin(), steps.begin() + passes)};
+		std::printf("profile switch (0 -> %u) %8zu passes, longest %8.2f ns\n", other, passes, longest);
+		for (const auto scanRate : {scanRate_t::rate1kHz, scanRate_t::rate2kHz, scanRate_t::rate4kHz, scanRate_t::rate8kHz})
+		{
+			mxKeyboard::scanTimer::scanRate(scanRate);
+			const auto scansPerMillisecond{mxKeyboard::scanTimer::scansPerMillisecond()};
+			const auto period{1000.0 / scansPerMillisecond};
+			std::printf("    at %ukHz, %.3f%% of the %.0f us scan period\n", scansPerMillisecond,
+				longest / (period * 10.0), period);
+		}
+		mxKeyboard::scanTimer::scanRate(rate);
+	}
+
+	// Booting again has to find every profile written still good against its CRCs
+	mxKeyboard::profile::checkProfiles();
+	for (const uint8_t number : {0U, 1U, 2U})
+	{
+		if (!mxKeyboard::profile::profileView_t{number}.valid())
+			std::printf("Profile %u failed its CRC check\n", number);
+	}
+}
+
+static void benchmarkMemory() noexcept
+{
+	static std::array<uint8_t, 4096U> source{};
+	static std::array<uint8_t, 4096U> destination{};
+	uint32_t state{0x1234567U};
+	for (auto &byte : source)
+		byte = uint8_t(xorshift(state));
+
+	for (const std::size_t count : {8U, 64U, 512U, 4096U})
+	{
+		std::array<char, 64> name{};
+		std::snprintf(name.data(), name.size(), "memory::copy (%zu bytes)", count);
+		benchmark(name.data(), [count](const std::size_t i) noexcept
+		{
+			// Start somewhere different each time so the copies aren't all word aligned
+			const auto offset{(count + (i & 7U)) <= source.size() ? (i & 7U) : 0U};
+			mxKeyboard::memory::copy(destination.data() + offset, source.data() + offset, count);
+		});
+		if (!std::equal(source.begin(), source.begin() + count, destination.begin()))
+			std::printf("    Copy does not match its source\n");
+
+		std::snprintf(name.data(), name.size(), "memory::fill (%zu bytes)", count);
+		benchmark(name.data(), [count](const std::size_t i) noexcept
+			{ mxKeyboard::memory::fill(destination.data(), uint8_t(i), count); });
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1)
+		iterations = std::strtoul(argv[1], nullptr, 10);
+	if (!iterations)
+		iterations = 1U;
+
+	ledInit();
+	keyInit();
+	usb::hid::registerHandlers(1, 0, 1);
+	host::usbConfigure(1);
+
+	std::printf("Running %zu iterations per benchmark\n", iterations);
+	benchmarkScan();
+	benchmarkHID();
+	benchmarkLatency();
+	benchmarkLEDs();
+	benchmarkProfiles();
+	benchmarkProfileSwitch();
+	benchmarkMemory();
+	return 0;
+}
@@ -0,0 +1,10 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_AVR_BUILTINS__H
+#define HOST_AVR_BUILTINS__H
+
+// The host harness is single threaded and "interrupts" are direct calls, so these have nothing to do
+inline void __builtin_avr_cli() noexcept { }
+inline void __builtin_avr_sei() noexcept { }
+inline void __builtin_avr_nop() noexcept { }
+
+#endif /*HOST_AVR_BUILTINS__H*/
@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_AVR_CPUFUNC__H
+#define HOST_AVR_CPUFUNC__H
+
+#define _NOP() do { } while (0)
+#define _MemoryBarrier() __asm__ __volatile__("" ::: "memory")
+
+#endif /*HOST_AVR_CPUFUNC__H*/
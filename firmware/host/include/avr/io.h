@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_AVR_IO__H
+#define HOST_AVR_IO__H
+
+/*!
+ * Host-side stand-in for <avr/io.h>
+ *
+ * Peripherals are modelled as plain global structures whose registers are
+ * simple storage. A register's reads can be redirected through a hook so
+ * the host harness can synthesise inputs (for example, PORTF.IN following
+ * the column selected on PORTA.OUT), and its writes through another so the
+ * harness can act on them as the peripheral would (for example, running an
+ * NVM command once NVM.CTRLA is written).
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+namespace host
+{
+	template<typename T> struct register_t final
+	{
+	public:
+		using readHook_t = T (*)() noexcept;
+		using writeHook_t = void (*)(T value) noexcept;
+
+	private:
+		T value_{};
+		readHook_t readHook_{nullptr};
+		writeHook_t writeHook_{nullptr};
+
+	public:
+		constexpr register_t() noexcept = default;
+		register_t(const register_t &) = delete;
+		register_t(register_t &&) = delete;
+
+		operator T() const noexcept { return readHook_ ? readHook_() : value_; }
+		register_t &operator =(const register_t &reg) noexcept { value_ = T(reg); return *this; }
+		register_t &operator =(register_t &&) = delete;
+		register_t &operator =(const T value) noexcept
+		{
+			value_ = value;
+			if (writeHook_)
+				writeHook_(value);
+			return *this;
+		}
+
+		register_t &operator |=(const T value) noexcept { return *this = T(T(*this) | value); }
+		register_t &operator &=(const T value) noexcept { return *this = T(T(*this) & value); }
+		register_t &operator ^=(const T value) noexcept { return *this = T(T(*this) ^ value); }
+		void readHook(const readHook_t hook) noexcept { readHook_ = hook; }
+		void writeHook(const writeHook_t hook) noexcept { writeHook_ = hook; }
+	};
+
+	using register8_t = register_t<uint8_t>;
+	using register16_t = register_t<uint16_t>;
+
+	extern std::array<uint8_t, 4096> mappedEEPROM;
+} // namespace host
+
+using host::register8_t;
+using host::register16_t;
+
+struct PORTCFG_t final
+{
+	register8_t MPCMASK;
+	register8_t VPCTRLA;
+	register8_t VPCTRLB;
+	register8_t CLKEVOUT;
+	register8_t EBIOUT;
+	register8_t EVCTRL;
+};
+
+struct PORT_t final
+{
+	register8_t DIR;
+	register8_t DIRSET;
+	register8_t DIRCLR;
+	register8_t DIRTGL;
+	register8_t OUT;
+	register8_t OUTSET;
+	register8_t OUTCLR;
+	register8_t OUTTGL;
+	register8_t IN;
+	register8_t INTCTRL;
+	register8_t INT0MASK;
+	register8_t INT1MASK;
+	register8_t INTFLAGS;
+	register8_t REMAP;
+	register8_t PIN0CTRL;
+	register8_t PIN1CTRL;
+	register8_t PIN2CTRL;
+	register8_t PIN3CTRL;
+	register8_t PIN4CTRL;
+	register8_t PIN5CTRL;
+	register8_t PIN6CTRL;
+	register8_t PIN7CTRL;
+};
+
+struct TC0_t final
+{
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t CTRLC;
+	register8_t CTRLD;
+	register8_t CTRLE;
+	register8_t INTCTRLA;
+	register8_t INTCTRLB;
+	register8_t CTRLFCLR;
+	register8_t CTRLFSET;
+	register8_t CTRLGCLR;
+	register8_t CTRLGSET;
+	register8_t INTFLAGS;
+	register16_t CNT;
+	register16_t PER;
+	register16_t CCA;
+	register16_t CCB;
+	register16_t CCC;
+	register16_t CCD;
+	register16_t PERBUF;
+	register16_t CCABUF;
+	register16_t CCBBUF;
+	register16_t CCCBUF;
+	register16_t CCDBUF;
+};
+
+struct TC1_t final
+{
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t CTRLC;
+	register8_t CTRLD;
+	register8_t CTRLE;
+	register8_t INTCTRLA;
+	register8_t INTCTRLB;
+	register8_t CTRLFCLR;
+	register8_t CTRLFSET;
+	register8_t CTRLGCLR;
+	register8_t CTRLGSET;
+	register8_t INTFLAGS;
+	register16_t CNT;
+	register16_t PER;
+	register16_t CCA;
+	register16_t CCB;
+	register16_t PERBUF;
+	register16_t CCABUF;
+	register16_t CCBBUF;
+};
+
+struct DMA_CH_t final
+{
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t ADDRCTRL;
+	register8_t TRIGSRC;
+	register16_t TRFCNT;
+	register8_t REPCNT;
+	register8_t SRCADDR0;
+	register8_t SRCADDR1;
+	register8_t SRCADDR2;
+	register8_t DESTADDR0;
+	register8_t DESTADDR1;
+	register8_t DESTADDR2;
+};
+
+struct DMA_t final
+{
+	register8_t CTRL;
+	register8_t INTFLAGS;
+	register8_t STATUS;
+	register16_t TEMP;
+	DMA_CH_t CH0;
+	DMA_CH_t CH1;
+	DMA_CH_t CH2;
+	DMA_CH_t CH3;
+};
+
+struct NVM_t final
+{
+	register8_t ADDR0;
+	register8_t ADDR1;
+	register8_t ADDR2;
+	register8_t DATA0;
+	register8_t DATA1;
+	register8_t DATA2;
+	register8_t CMD;
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t INTCTRL;
+	register8_t STATUS;
+	register8_t LOCKBITS;
+};
+
+struct CRC_t final
+{
+	register8_t CTRL;
+	register8_t STATUS;
+	register8_t reserved;
+	register8_t DATAIN;
+	register8_t CHECKSUM0;
+	register8_t CHECKSUM1;
+	register8_t CHECKSUM2;
+	register8_t CHECKSUM3;
+};
+
+struct USART_t final
+{
+	register8_t DATA;
+	register8_t STATUS;
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t CTRLC;
+	register8_t BAUDCTRLA;
+	register8_t BAUDCTRLB;
+};
+
+struct USB_t final
+{
+	register8_t CTRLA;
+	register8_t CTRLB;
+	register8_t STATUS;
+	register8_t ADDR;
+	register8_t FIFOWP;
+	register8_t FIFORP;
+	register16_t EPPTR;
+	register8_t INTCTRLA;
+	register8_t INTCTRLB;
+	register8_t INTFLAGSACLR;
+	register8_t INTFLAGSASET;
+	register8_t INTFLAGSBCLR;
+	register8_t INTFLAGSBSET;
+};
+
+struct PMIC_t final
+{
+	register8_t STATUS;
+	register8_t INTPRI;
+	register8_t CTRL;
+};
+
+extern PORTCFG_t PORTCFG;
+extern PORT_t PORTA;
+extern PORT_t PORTC;
+extern PORT_t PORTD;
+extern PORT_t PORTE;
+extern PORT_t PORTF;
+extern PORT_t PORTR;
+extern TC0_t TCC0;
+extern TC0_t TCD0;
+extern TC1_t TCD1;
+extern DMA_t DMA;
+extern NVM_t NVM;
+extern CRC_t CRC;
+extern USART_t USARTC0;
+extern USART_t USARTC1;
+extern USART_t USARTD0;
+extern USART_t USARTD1;
+extern USART_t USARTE0;
+extern USART_t USARTE1;
+extern USB_t USB;
+extern PMIC_t PMIC;
+
+extern register8_t CCP;
+extern register8_t RAMPD;
+extern register8_t RAMPX;
+extern register8_t RAMPY;
+extern register8_t RAMPZ;
+extern register8_t SREG;
+
+#define MAPPED_EEPROM_START (reinterpret_cast<std::uintptr_t>(host::mappedEEPROM.data()))
+
+enum PORT_OPC_t : uint8_t
+{
+	PORT_OPC_TOTEM_gc = 0x00U << 3U,
+	PORT_OPC_BUSKEEPER_gc = 0x01U << 3U,
+	PORT_OPC_PULLDOWN_gc = 0x02U << 3U,
+	PORT_OPC_PULLUP_gc = 0x03U << 3U,
+	PORT_OPC_WIREDOR_gc = 0x04U << 3U,
+	PORT_OPC_WIREDAND_gc = 0x05U << 3U,
+	PORT_OPC_WIREDORPULL_gc = 0x06U << 3U,
+	PORT_OPC_WIREDANDPULL_gc = 0x07U << 3U,
+};
+
+enum TC_CLKSEL_t : uint8_t
+{
+	TC_CLKSEL_OFF_gc = 0x00U,
+	TC_CLKSEL_DIV1_gc = 0x01U,
+	TC_CLKSEL_DIV2_gc = 0x02U,
+	TC_CLKSEL_DIV4_gc = 0x03U,
+	TC_CLKSEL_DIV8_gc = 0x04U,
+	TC_CLKSEL_DIV64_gc = 0x05U,
+	TC_CLKSEL_DIV256_gc = 0x06U,
+	TC_CLKSEL_DIV1024_gc = 0x07U,
+};
+
+enum TC_WGMODE_t : uint8_t { TC_WGMODE_NORMAL_gc = 0x00U };
+enum TC_BYTEM_t : uint8_t { TC_BYTEM_NORMAL_gc = 0x00U };
+
+enum TC_OVFINTLVL_t : uint8_t
+{
+	TC_OVFINTLVL_OFF_gc = 0x00U,
+	TC_OVFINTLVL_LO_gc = 0x01U,
+	TC_OVFINTLVL_MED_gc = 0x02U,
+	TC_OVFINTLVL_HI_gc = 0x03U,
+};
+
+enum TC_CMD_t : uint8_t
+{
+	TC_CMD_NONE_gc = 0x00U << 2U,
+	TC_CMD_UPDATE_gc = 0x01U << 2U,
+	TC_CMD_RESTART_gc = 0x02U << 2U,
+	TC_CMD_RESET_gc = 0x03U << 2U,
+};
+
+constexpr static uint8_t TC0_OVFIF_bm{0x01U};
+constexpr static uint8_t USB_SOFIE_bm{0x80U};
+constexpr static uint8_t USB_SOFIF_bm{0x80U};
+constexpr static uint8_t DMA_CH0BUSY_bm{0x10U};
+constexpr static uint8_t DMA_CH1BUSY_bm{0x20U};
+constexpr static uint8_t DMA_CH_TRNIF_bm{0x10U};
+
+enum DMA_DBUFMODE_t : uint8_t
+{
+	DMA_DBUFMODE_DISABLED_gc = 0x00U << 2U,
+	DMA_DBUFMODE_CH01_gc = 0x01U << 2U,
+	DMA_DBUFMODE_CH23_gc = 0x02U << 2U,
+	DMA_DBUFMODE_CH01CH23_gc = 0x03U << 2U,
+};
+
+enum DMA_PRIMODE_t : uint8_t
+{
+	DMA_PRIMODE_RR0123_gc = 0x00U,
+	DMA_PRIMODE_CH0RR123_gc = 0x01U,
+	DMA_PRIMODE_CH01RR23_gc = 0x02U,
+	DMA_PRIMODE_CH0123_gc = 0x03U,
+};
+
+enum DMA_CH_BURSTLEN_t : uint8_t { DMA_CH_BURSTLEN_1BYTE_gc = 0x00U };
+
+enum DMA_CH_ADDRCTRL_t : uint8_t
+{
+	DMA_CH_SRCRELOAD_NONE_gc = 0x00U << 6U,
+	DMA_CH_SRCRELOAD_TRANSACTION_gc = 0x03U << 6U,
+	DMA_CH_SRCDIR_FIXED_gc = 0x00U << 4U,
+	DMA_CH_SRCDIR_INC_gc = 0x01U << 4U,
+	DMA_CH_DESTRELOAD_NONE_gc = 0x00U << 2U,
+	DMA_CH_DESTRELOAD_TRANSACTION_gc = 0x03U << 2U,
+	DMA_CH_DESTDIR_FIXED_gc = 0x00U,
+	DMA_CH_DESTDIR_INC_gc = 0x01U,
+};
+
+enum DMA_CH_TRNINTLVL_t : uint8_t
+{
+	DMA_CH_TRNINTLVL_OFF_gc = 0x00U,
+	DMA_CH_TRNINTLVL_LO_gc = 0x01U,
+	DMA_CH_TRNINTLVL_MED_gc = 0x02U,
+	DMA_CH_TRNINTLVL_HI_gc = 0x03U,
+};
+
+enum DMA_CH_TRIGSRC_t : uint8_t
+{
+	DMA_CH_TRIGSRC_OFF_gc = 0x00U,
+	DMA_CH_TRIGSRC_USARTC0_DRE_gc = 0x4CU,
+	DMA_CH_TRIGSRC_USARTC1_DRE_gc = 0x4FU,
+	DMA_CH_TRIGSRC_USARTD0_DRE_gc = 0x6CU,
+	DMA_CH_TRIGSRC_USARTD1_DRE_gc = 0x6FU,
+};
+
+enum NVM_CMD_t : uint8_t
+{
+	NVM_CMD_NO_OPERATION_gc = 0x00U,
+	NVM_CMD_LOAD_FLASH_BUFFER_gc = 0x23U,
+	NVM_CMD_ERASE_FLASH_BUFFER_gc = 0x26U,
+	NVM_CMD_ERASE_WRITE_FLASH_PAGE_gc = 0x2FU,
+	NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc = 0x35U,
+	NVM_CMD_FLASH_RANGE_CRC_gc = 0x3AU,
+};
+
+enum NVM_SPMLVL_t : uint8_t
+{
+	NVM_SPMLVL_OFF_gc = 0x00U << 2U,
+	NVM_SPMLVL_LO_gc = 0x01U << 2U,
+	NVM_SPMLVL_MED_gc = 0x02U << 2U,
+	NVM_SPMLVL_HI_gc = 0x03U << 2U,
+};
+
+enum NVM_EELVL_t : uint8_t
+{
+	NVM_EELVL_OFF_gc = 0x00U,
+	NVM_EELVL_LO_gc = 0x01U,
+	NVM_EELVL_MED_gc = 0x02U,
+	NVM_EELVL_HI_gc = 0x03U,
+};
+
+constexpr static uint8_t NVM_CMDEX_bm{0x01U};
+constexpr static uint8_t NVM_EEMAPEN_bm{0x08U};
+constexpr static uint8_t NVM_NVMBUSY_bm{0x80U};
+
+enum CRC_RESET_t : uint8_t
+{
+	CRC_RESET_NO_gc = 0x00U << 6U,
+	CRC_RESET_RESET0_gc = 0x02U << 6U,
+	CRC_RESET_RESET1_gc = 0x03U << 6U,
+};
+
+enum CRC_SOURCE_t : uint8_t
+{
+	CRC_SOURCE_DISABLE_gc = 0x00U,
+	CRC_SOURCE_IO_gc = 0x01U,
+	CRC_SOURCE_FLASH_gc = 0x02U,
+	CRC_SOURCE_DMAC0_gc = 0x04U,
+};
+
+constexpr static uint8_t CRC_RESET_gm{0xC0U};
+constexpr static uint8_t CRC_CRC32_bm{0x20U};
+constexpr static uint8_t CRC_SOURCE_gm{0x0FU};
+constexpr static uint8_t CRC_BUSY_bm{0x01U};
+
+enum CCP_t : uint8_t
+{
+	CCP_SPM_gc = 0x9DU,
+	CCP_IOREG_gc = 0xD8U,
+};
+
+#endif /*HOST_AVR_IO__H*/
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_FLASH__HXX
+#define HOST_FLASH__HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+
+/*!
+ * Host-side stand-in for dragonAVR's flash_t.
+ * On the host there is only one address space, so this simply holds the value.
+ */
+template<typename T> struct flash_t final
+{
+private:
+	T value_;
+
+public:
+	constexpr flash_t() noexcept : value_{} { }
+	constexpr flash_t(const T value) noexcept : value_{value} { }
+
+	constexpr operator T() const noexcept { return value_; }
+	constexpr T operator *() const noexcept { return value_; }
+};
+
+#endif /*HOST_FLASH__HXX*/
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST__HXX
+#define HOST__HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <usb/device.hxx>
+
+/*!
+ * Controls for the host harness that the firmware itself never sees.
+ */
+namespace host
+{
+	constexpr static std::size_t matrixColumns{21U};
+
+	// The row bits (1 = switch closed) PORTF.IN reports for each column selected via PORTA.OUT
+	extern std::array<uint8_t, matrixColumns> matrix;
+	// How many times each DMA channel has been triggered
+	extern std::array<uint32_t, 4> dmaTriggers;
+
+	// How many Flash and EEPROM page writes (erase + write, or write only) the firmware has performed
+	extern uint32_t flashPageWrites;
+	extern uint32_t eepromPageWrites;
+
+	// Puts the emulated EEPROM and .profile Flash back to their erased/zeroed states
+	extern void resetNVM() noexcept;
+	// Runs the init handlers registered for the given configuration, as SET_CONFIGURATION would
+	extern void usbConfigure(uint8_t config) noexcept;
+	// Hands a SETUP packet to the registered interface handler, as the control endpoint would
+	extern usb::types::answer_t usbSetup(const usb::types::setupPacket_t &packet) noexcept;
+	// Completes any transfer armed on the given IN endpoint, as an IN token from the host would
+	extern bool usbCompleteIn(uint8_t endpoint) noexcept;
+	/*!
+	 * Has TCC0 count at its 4MHz with the host's own clock, so LED render times are real ones.
+	 * Off by default as reading the clock costs more than the rendering it would time.
+	 */
+	extern void ledTimerFollowsClock(bool follow) noexcept;
+} // namespace host
+
+#endif /*HOST__HXX*/
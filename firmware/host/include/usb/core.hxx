@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_USB_CORE__HXX
+#define HOST_USB_CORE__HXX
+
+/*!
+ * Host-side stand-in for dragonUSB's core endpoint layer.
+ * Endpoint transfers complete only when the harness says so (see host.hxx).
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include "usb/types.hxx"
+
+namespace usb::core
+{
+	using namespace usb::types;
+	using descriptors::usbMultiPartTable_t;
+
+	template<typename buffer_t> struct usbEPStatus_t final
+	{
+	private:
+		uint8_t flags{};
+
+		void flag(const uint8_t mask, const bool value) noexcept
+		{
+			if (value)
+				flags |= mask;
+			else
+				flags &= uint8_t(~mask);
+		}
+
+	public:
+		buffer_t *memBuffer{nullptr};
+		usbMultiPartTable_t partsData{};
+		uint16_t transferCount{};
+		uint8_t partNumber{};
+		memory_t memory{memory_t::sram};
+
+		bool stall() const noexcept { return flags & 0x01U; }
+		void stall(const bool value) noexcept { flag(0x01U, value); }
+		bool needsArming() const noexcept { return flags & 0x02U; }
+		void needsArming(const bool value) noexcept { flag(0x02U, value); }
+		bool isMultiPart() const noexcept { return flags & 0x04U; }
+		void isMultiPart(const bool value) noexcept { flag(0x04U, value); }
+		bool transferring() const noexcept { return flags & 0x08U; }
+		void transferring(const bool value) noexcept { flag(0x08U, value); }
+		memory_t memoryType() const noexcept { return memory; }
+		void memoryType(const memory_t type) noexcept { memory = type; }
+	};
+
+	struct handler_t final
+	{
+		void (*init)(uint8_t endpoint);
+		void (*handleControllerIn)(uint8_t endpoint);
+		void (*handleControllerOut)(uint8_t endpoint);
+	};
+
+	extern std::array<usbEPStatus_t<const void>, endpointCount + 1U> epStatusControllerIn;
+	extern std::array<usbEPStatus_t<void>, endpointCount + 1U> epStatusControllerOut;
+
+	extern void init() noexcept;
+	extern void attach() noexcept;
+	extern void handleIRQ() noexcept;
+	extern void pauseWriteEP(uint8_t endpoint) noexcept;
+	extern void writeEP(uint8_t endpoint) noexcept;
+	extern void registerHandler(endpoint_t endpoint, uint8_t config, handler_t handler) noexcept;
+} // namespace usb::core
+
+#endif /*HOST_USB_CORE__HXX*/
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_USB_DEVICE__HXX
+#define HOST_USB_DEVICE__HXX
+
+/*!
+ * Host-side stand-in for dragonUSB's control endpoint (device) layer.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include "usb/types.hxx"
+
+namespace usb::types
+{
+	namespace setupPacket
+	{
+		enum class recipient_t : uint8_t
+		{
+			device = 0U,
+			interface = 1U,
+			endpoint = 2U,
+			other = 3U
+		};
+
+		enum class request_t : uint8_t
+		{
+			typeStandard = 0U,
+			typeClass = 1U,
+			typeVendor = 2U
+		};
+
+		enum class reportType_t : uint8_t
+		{
+			input = 1U,
+			output = 2U,
+			feature = 3U
+		};
+
+		struct requestType_t final
+		{
+			uint8_t value;
+
+			constexpr recipient_t recipient() const noexcept { return static_cast<recipient_t>(value & 0x1FU); }
+			constexpr request_t type() const noexcept { return static_cast<request_t>((value >> 5U) & 0x03U); }
+			constexpr endpointDir_t dir() const noexcept { return static_cast<endpointDir_t>(value & 0x80U); }
+		};
+
+		struct descriptor_t final
+		{
+			uint8_t index;
+			descriptors::usbDescriptor_t type;
+		};
+
+		struct report_t final
+		{
+			uint8_t index;
+			reportType_t type;
+		};
+
+		struct value_t final
+		{
+			uint16_t value;
+
+			constexpr descriptor_t asDescriptor() const noexcept
+				{ return {uint8_t(value), static_cast<descriptors::usbDescriptor_t>(value >> 8U)}; }
+			constexpr report_t asReport() const noexcept
+				{ return {uint8_t(value), static_cast<reportType_t>(value >> 8U)}; }
+			constexpr operator uint16_t() const noexcept { return value; }
+		};
+	} // namespace setupPacket
+
+	struct setupPacket_t final
+	{
+		setupPacket::requestType_t requestType;
+		request_t request;
+		setupPacket::value_t value;
+		uint16_t index;
+		uint16_t length;
+	};
+} // namespace usb::types
+
+namespace usb::device
+{
+	using setupHandler_t = types::answer_t (*)(std::size_t interface);
+	using setupCallback_t = void (*)();
+
+	extern types::setupPacket_t packet;
+	extern setupCallback_t setupCallback;
+
+	extern void registerHandler(uint8_t interface, uint8_t config, setupHandler_t handler) noexcept;
+} // namespace usb::device
+
+#endif /*HOST_USB_DEVICE__HXX*/
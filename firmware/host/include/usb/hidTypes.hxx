@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_USB_HID_TYPES__HXX
+#define HOST_USB_HID_TYPES__HXX
+
+/*!
+ * Host-side stand-in for dragonUSB's HID report descriptor and request types.
+ * Values follow the HID 1.11 specification and HID Usage Tables.
+ */
+
+#include <cstdint>
+#include "usb/types.hxx"
+
+namespace usb::descriptors::hid
+{
+	constexpr inline uint8_t descriptorSize(const uint8_t size) noexcept
+		{ return size == 4U ? 3U : size; }
+
+	namespace items
+	{
+		enum class main_t : uint8_t
+		{
+			input = 0x80U,
+			output = 0x90U,
+			collection = 0xA0U,
+			feature = 0xB0U,
+			endCollection = 0xC0U
+		};
+
+		enum class global_t : uint8_t
+		{
+			usagePage = 0x04U,
+			logicalMinimum = 0x14U,
+			logicalMaximum = 0x24U,
+			physicalMinimum = 0x34U,
+			physicalMaximum = 0x44U,
+			unitExponent = 0x54U,
+			unit = 0x64U,
+			reportSize = 0x74U,
+			reportID = 0x84U,
+			reportCount = 0x94U,
+			push = 0xA4U,
+			pop = 0xB4U
+		};
+
+		enum class local_t : uint8_t
+		{
+			usage = 0x08U,
+			usageMinimum = 0x18U,
+			usageMaximum = 0x28U
+		};
+
+		constexpr inline uint8_t operator |(const main_t item, const uint8_t size) noexcept
+			{ return uint8_t(uint8_t(item) | size); }
+		constexpr inline uint8_t operator |(const global_t item, const uint8_t size) noexcept
+			{ return uint8_t(uint8_t(item) | size); }
+		constexpr inline uint8_t operator |(const local_t item, const uint8_t size) noexcept
+			{ return uint8_t(uint8_t(item) | size); }
+	} // namespace items
+
+	struct main_t final
+	{
+		constexpr static uint8_t data{0x00U};
+		constexpr static uint8_t constant{0x01U};
+		constexpr static uint8_t array{0x00U};
+		constexpr static uint8_t variable{0x02U};
+		constexpr static uint8_t absolute{0x00U};
+		constexpr static uint8_t relative{0x04U};
+	};
+
+	enum class usagePage_t : uint8_t
+	{
+		genericDesktop = 0x01U,
+		keyboard = 0x07U,
+		led = 0x08U,
+		button = 0x09U,
+		consumer = 0x0CU
+	};
+
+	enum class systemUsage_t : uint8_t
+	{
+		pointer = 0x01U,
+		mouse = 0x02U,
+		joystick = 0x04U,
+		gamepad = 0x05U,
+		keyboard = 0x06U,
+		keypad = 0x07U
+	};
+
+	enum class collectionType_t : uint8_t
+	{
+		physical = 0x00U,
+		application = 0x01U,
+		logical = 0x02U
+	};
+
+	enum class led_t : uint8_t
+	{
+		numLock = 0x01U,
+		capsLock = 0x02U,
+		scrollLock = 0x03U,
+		compose = 0x04U,
+		kana = 0x05U
+	};
+} // namespace usb::descriptors::hid
+
+namespace usb::hid::types
+{
+	enum class request_t : uint8_t
+	{
+		getReport = 0x01U,
+		getIdle = 0x02U,
+		getProtocol = 0x03U,
+		setReport = 0x09U,
+		setIdle = 0x0AU,
+		setProtocol = 0x0BU
+	};
+} // namespace usb::hid::types
+
+#endif /*HOST_USB_HID_TYPES__HXX*/
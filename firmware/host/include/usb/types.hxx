@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef HOST_USB_TYPES__HXX
+#define HOST_USB_TYPES__HXX
+
+/*!
+ * Host-side stand-in for the subset of dragonUSB's types used by the firmware core.
+ * Values follow the USB 2.0 and HID 1.11 specifications.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <flash.hxx>
+
+namespace usb
+{
+	constexpr static uint8_t epBufferSize{64U};
+	constexpr static uint8_t endpointCount{1U};
+} // namespace usb
+
+namespace usb::types
+{
+	enum class endpointDir_t : uint8_t
+	{
+		controllerOut = 0x00U,
+		controllerIn = 0x80U
+	};
+
+	enum class memory_t : uint8_t
+	{
+		sram,
+		flash,
+		eeprom
+	};
+
+	enum class response_t : uint8_t
+	{
+		data,
+		zeroLength,
+		unhandled,
+		stall
+	};
+
+	enum class request_t : uint8_t
+	{
+		getStatus = 0U,
+		clearFeature = 1U,
+		setFeature = 3U,
+		setAddress = 5U,
+		getDescriptor = 6U,
+		setDescriptor = 7U,
+		getConfiguration = 8U,
+		setConfiguration = 9U,
+		getInterface = 10U,
+		setInterface = 11U,
+		syncFrame = 12U
+	};
+
+	struct endpoint_t final
+	{
+		uint8_t endpoint;
+		endpointDir_t dir;
+	};
+
+	struct answer_t final
+	{
+		response_t response;
+		const void *data;
+		uint16_t length;
+		memory_t memoryType{memory_t::sram};
+	};
+} // namespace usb::types
+
+namespace usb::descriptors
+{
+	enum class usbDescriptor_t : uint8_t
+	{
+		invalid = 0x00U,
+		device = 0x01U,
+		configuration = 0x02U,
+		string = 0x03U,
+		interface = 0x04U,
+		endpoint = 0x05U,
+		deviceQualifier = 0x06U,
+		otherSpeed = 0x07U,
+		interfacePower = 0x08U,
+		otg = 0x09U,
+		debug = 0x0AU,
+		interfaceAssociation = 0x0BU,
+		hid = 0x21U,
+		report = 0x22U,
+		physicalDesc = 0x23U
+	};
+
+	struct usbMultiPartDesc_t final
+	{
+		uint8_t length;
+		const void *descriptor;
+	};
+
+	struct usbMultiPartTable_t final
+	{
+	private:
+		const usbMultiPartDesc_t *begin_;
+		const usbMultiPartDesc_t *end_;
+
+	public:
+		constexpr usbMultiPartTable_t() noexcept : begin_{nullptr}, end_{nullptr} { }
+		constexpr usbMultiPartTable_t(const usbMultiPartDesc_t *const begin,
+			const usbMultiPartDesc_t *const end) noexcept : begin_{begin}, end_{end} { }
+
+		constexpr auto begin() const noexcept { return begin_; }
+		constexpr auto end() const noexcept { return end_; }
+		constexpr auto count() const noexcept { return end_ - begin_; }
+
+		constexpr uint16_t totalLength() const noexcept
+		{
+			uint16_t length{};
+			for (const auto *part{begin_}; part != end_; ++part)
+				length += part->length;
+			return length;
+		}
+	};
+} // namespace usb::descriptors
+
+namespace usb::descriptors::hid
+{
+	enum class countryCode_t : uint8_t
+	{
+		notSupported = 0U,
+		english = 32U,
+		us = 33U
+	};
+
+	struct [[gnu::packed]] hidDescriptor_t final
+	{
+		uint8_t length;
+		usbDescriptor_t descriptorType;
+		uint16_t hidVersion;
+		countryCode_t countryCode;
+		uint8_t numDescriptors;
+	};
+
+	struct [[gnu::packed]] reportDescriptor_t final
+	{
+		usbDescriptor_t descriptorType;
+		uint16_t length;
+	};
+
+	enum class scancode_t : uint8_t
+	{
+		reserved = 0x00U,
+		errorRollOver = 0x01U,
+		postFail = 0x02U,
+		errorUndefined = 0x03U,
+		a = 0x04U, b, c, d, e, f, g, h, i, j, k, l, m,
+		n, o, p, q, r, s, t, u, v, w, x, y, z,
+		_1 = 0x1EU, _2, _3, _4, _5, _6, _7, _8, _9, _0,
+		enter = 0x28U,
+		escape = 0x29U,
+		backspace = 0x2AU,
+		tab = 0x2BU,
+		space = 0x2CU,
+		dash = 0x2DU,
+		equals = 0x2EU,
+		leftBracket = 0x2FU,
+		rightBracket = 0x30U,
+		backSlash = 0x31U,
+		hash = 0x32U,
+		semiColon = 0x33U,
+		singleQuote = 0x34U,
+		graveAccent = 0x35U,
+		comma = 0x36U,
+		fullStop = 0x37U,
+		forwardSlash = 0x38U,
+		capsLock = 0x39U,
+		f1 = 0x3AU, f2, f3, f4, f5, f6, f7, f8, f9, f10, f11, f12,
+		printScreen = 0x46U,
+		scrollLock = 0x47U,
+		pause = 0x48U,
+		insert = 0x49U,
+		home = 0x4AU,
+		pageUp = 0x4BU,
+		_delete = 0x4CU,
+		end = 0x4DU,
+		pageDown = 0x4EU,
+		rightArrow = 0x4FU,
+		leftArrow = 0x50U,
+		downArrow = 0x51U,
+		upArrow = 0x52U,
+		numLock = 0x53U,
+		keypadDivide = 0x54U,
+		keypadMultiply = 0x55U,
+		keypadSubtract = 0x56U,
+		keypadAdd = 0x57U,
+		keypadEnter = 0x58U,
+		keypad1 = 0x59U, keypad2, keypad3, keypad4, keypad5, keypad6, keypad7, keypad8, keypad9, keypad0,
+		keypadPeriod = 0x63U,
+		intlBackSlash = 0x64U,
+		application = 0x65U,
+		power = 0x66U,
+		keypadEquals = 0x67U,
+		leftControl = 0xE0U,
+		leftShift = 0xE1U,
+		leftAlt = 0xE2U,
+		leftMeta = 0xE3U,
+		rightControl = 0xE4U,
+		rightShift = 0xE5U,
+		rightAlt = 0xE6U,
+		rightMeta = 0xE7U
+	};
+} // namespace usb::descriptors::hid
+
+#endif /*HOST_USB_TYPES__HXX*/
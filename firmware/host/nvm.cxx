@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <cstring>
+#include <array>
+#include <avr/io.h>
+#include "nvm.hxx"
+#include "host.hxx"
+
+/*!
+ * Emulates the EEPROM (as mapped into data space) and the .profile Flash region, along with their
+ * page buffers - the EEPROM's tracking which of its bytes have been loaded, as only those get written.
+ * Only the .profile region is backed as that is all the firmware core writes to.
+ * Page writes complete instantly, so NVM.STATUS never reads busy.
+ * The CRC module is modelled behind its registers, computing the same CRC-16 and CRC-32 as the
+ * hardware, and NVM.CTRLA runs the Flash range CRC command through it - but only if the module has
+ * been set up as the hardware needs, with CRC-32 selected and the Flash as its source.
+ */
+
+using namespace mxKeyboard::nvm;
+
+namespace host
+{
+	std::array<uint8_t, eepromSize> mappedEEPROM{};
+	uint32_t flashPageWrites{0};
+	uint32_t eepromPageWrites{0};
+	static std::array<uint8_t, profileFlashLength> profileFlash{};
+	static std::array<uint8_t, flashPageSize> flashPageBuffer{};
+	static std::array<uint8_t, eepromPageSize> eepromPageBuffer{};
+	// Which bytes of the EEPROM page buffer have been loaded, as only those get written
+	static uint32_t eepromBufferLoaded{0U};
+	static_assert(eepromPageSize <= 32U);
+
+	void resetNVM() noexcept
+	{
+		// Erased EEPROM reads back as all 1's, the .profile section is zero-initialised by the image
+		mappedEEPROM.fill(0xFFU);
+		profileFlash.fill(0x00U);
+		flashPageBuffer.fill(0xFFU);
+		eepromBufferLoaded = 0U;
+	}
+
+	static const bool nvmReset
+	{
+		[]() noexcept
+		{
+			resetNVM();
+			return true;
+		}()
+	};
+
+	static uint8_t *profileFlashAt(const uint32_t flashAddr, const std::size_t count) noexcept
+	{
+		if (flashAddr < profileFlashStart || flashAddr + count > profileFlashStart + profileFlashLength)
+			return nullptr;
+		return profileFlash.data() + (flashAddr - profileFlashStart);
+	}
+
+	static bool crc32{false};
+	static uint8_t crcSource{CRC_SOURCE_DISABLE_gc};
+	static bool crcBusy{false};
+	static uint32_t crcValue{};
+
+	static void crcFeed(const uint8_t data) noexcept
+	{
+		if (crc32)
+		{
+			crcValue ^= data;
+			for (uint8_t bit{0}; bit < 8U; ++bit)
+				crcValue = (crcValue >> 1U) ^ ((crcValue & 1U) ? 0xEDB88320U : 0U);
+		}
+		else
+		{
+			crcValue ^= uint32_t(data) << 8U;
+			for (uint8_t bit{0}; bit < 8U; ++bit)
+				crcValue = ((crcValue << 1U) ^ ((crcValue & 0x8000U) ? 0x1021U : 0U)) & 0xFFFFU;
+		}
+	}
+
+	static void crcControl(const uint8_t value) noexcept
+	{
+		const uint8_t source(value & CRC_SOURCE_gm);
+		// CRC32 is only taken while the module is disabled
+		if (crcSource == CRC_SOURCE_DISABLE_gc)
+			crc32 = value & CRC_CRC32_bm;
+		if ((value & CRC_RESET_gm) == CRC_RESET_RESET1_gc)
+			crcValue = crc32 ? 0xFFFFFFFFU : 0xFFFFU;
+		else if ((value & CRC_RESET_gm) == CRC_RESET_RESET0_gc)
+			crcValue = 0U;
+		if (source != crcSource)
+			crcBusy = source != CRC_SOURCE_DISABLE_gc;
+		crcSource = source;
+	}
+
+	static void crcData(const uint8_t value) noexcept
+	{
+		if (crcSource == CRC_SOURCE_IO_gc && crcBusy)
+			crcFeed(value);
+	}
+
+	static void crcStatus(const uint8_t value) noexcept
+	{
+		if (value & CRC_BUSY_bm)
+			crcBusy = false;
+	}
+
+	static uint32_t crcChecksum() noexcept
+		{ return crc32 && !crcBusy ? ~crcValue : crcValue; }
+
+	static void nvmExecute(const uint8_t value) noexcept
+	{
+		if (!(value & NVM_CMDEX_bm) || NVM.CMD != NVM_CMD_FLASH_RANGE_CRC_gc)
+			return;
+		// The hardware only feeds the range to the module when it's listening to the Flash
+		if (crcSource != CRC_SOURCE_FLASH_gc || !crcBusy)
+			return;
+		const uint32_t first{NVM.ADDR0 | (uint32_t(NVM.ADDR1) << 8U) | (uint32_t(NVM.ADDR2) << 16U)};
+		const uint32_t last{NVM.DATA0 | (uint32_t(NVM.DATA1) << 8U) | (uint32_t(NVM.DATA2) << 16U)};
+		for (auto flashAddr{first}; flashAddr <= last; ++flashAddr)
+		{
+			uint8_t data{};
+			readFlash(flashAddr, &data, 1U);
+			crcFeed(data);
+		}
+		crcBusy = false;
+	}
+
+	static const bool crcHooked
+	{
+		[]() noexcept
+		{
+			CRC.CTRL.writeHook(crcControl);
+			CRC.DATAIN.writeHook(crcData);
+			CRC.STATUS.writeHook(crcStatus);
+			CRC.CHECKSUM0.readHook([]() noexcept { return uint8_t(crcChecksum()); });
+			CRC.CHECKSUM1.readHook([]() noexcept { return uint8_t(crcChecksum() >> 8U); });
+			CRC.CHECKSUM2.readHook([]() noexcept { return uint8_t(crcChecksum() >> 16U); });
+			CRC.CHECKSUM3.readHook([]() noexcept { return uint8_t(crcChecksum() >> 24U); });
+			NVM.CTRLA.writeHook(nvmExecute);
+			return true;
+		}()
+	};
+} // namespace host
+
+namespace mxKeyboard::nvm
+{
+	void readFlash(const uint32_t flashAddr, void *const buffer, const uint16_t count) noexcept
+	{
+		if (const auto *const data{host::profileFlashAt(flashAddr, count)}; data)
+			std::memcpy(buffer, data, count);
+		else
+			std::memset(buffer, 0xFF, count);
+	}
+
+	void eraseFlashBuffer() noexcept
+		{ host::flashPageBuffer.fill(0xFFU); }
+
+	void loadFlashBuffer(const uint32_t flashAddr, const uint8_t *const buffer, const uint16_t count) noexcept
+		{ std::memcpy(host::flashPageBuffer.data() + (flashAddr & flashPageMask), buffer, count); }
+
+	void startFlashPageWrite(const uint32_t pageAddr) noexcept
+		{ writeFlashPage(pageAddr); }
+
+	void loadEEPROMBuffer(const uint16_t eepromAddr, const uint8_t *const buffer, const uint8_t count) noexcept
+	{
+		for (uint8_t i{0}; i < count; ++i)
+		{
+			const auto offset{uint8_t((eepromAddr + i) & eepromPageMask)};
+			host::eepromPageBuffer[offset] = buffer[i];
+			host::eepromBufferLoaded |= 1U << offset;
+		}
+	}
+
+	void eraseEEPROMBuffer() noexcept
+		{ host::eepromBufferLoaded = 0U; }
+
+	void startEEPROMPageWrite(const uint16_t pageAddr) noexcept
+		{ writeEEPROMPage(pageAddr); }
+
+	// Without the erase, writing can only take bits from 1 to 0
+	void startEEPROMPageWriteOnly(const uint16_t pageAddr) noexcept
+	{
+		auto *const page{host::mappedEEPROM.data() + (pageAddr & uint16_t(~eepromPageMask))};
+		for (uint8_t offset{0}; offset < eepromPageSize; ++offset)
+		{
+			if (host::eepromBufferLoaded & (1U << offset))
+				page[offset] &= host::eepromPageBuffer[offset];
+		}
+		host::eepromBufferLoaded = 0U;
+		++host::eepromPageWrites;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+
+	void writeFlashPage(const uint32_t pageAddr) noexcept
+	{
+		if (auto *const page{host::profileFlashAt(pageAddr & uint32_t(~flashPageMask), flashPageSize)}; page)
+			std::memcpy(page, host::flashPageBuffer.data(), flashPageSize);
+		++host::flashPageWrites;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+
+	// Only the bytes loaded are erased and written, and the page buffer is left empty afterwards
+	void writeEEPROMPage(const uint16_t pageAddr) noexcept
+	{
+		auto *const page{host::mappedEEPROM.data() + (pageAddr & uint16_t(~eepromPageMask))};
+		for (uint8_t offset{0}; offset < eepromPageSize; ++offset)
+		{
+			if (host::eepromBufferLoaded & (1U << offset))
+				page[offset] = host::eepromPageBuffer[offset];
+		}
+		host::eepromBufferLoaded = 0U;
+		++host::eepromPageWrites;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+} // namespace mxKeyboard::nvm
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <cstdint>
+#include <cstring>
+#include "MXKeyboard.hxx"
+#include "uart.hxx"
+#include "host.hxx"
+
+/*!
+ * Host versions of the peripheral set-up routines that live in
+ * dma.cxx, timer.cxx and uart.cxx on the target. They program the mock
+ * registers where that is cheap and otherwise only record what happened.
+ */
+
+namespace host
+{
+	std::array<uint32_t, 4> dmaTriggers{};
+
+	static std::size_t channelNumber(const DMA_CH_t &channel) noexcept
+	{
+		if (&channel == &DMA.CH0)
+			return 0U;
+		else if (&channel == &DMA.CH1)
+			return 1U;
+		else if (&channel == &DMA.CH2)
+			return 2U;
+		return 3U;
+	}
+} // namespace host
+
+void dmaInit()
+	{ DMA.CTRL = 0x80 | DMA_DBUFMODE_DISABLED_gc | DMA_PRIMODE_RR0123_gc; }
+
+void dmaInit(DMA_CH_t &channel, const DMA_CH_TRIGSRC_t triggerSource)
+{
+	channel.CTRLA = DMA_CH_BURSTLEN_1BYTE_gc;
+	channel.TRIGSRC = triggerSource;
+	channel.REPCNT = 0;
+}
+
+void dmaTransferLength(DMA_CH_t &channel, const uint16_t length)
+	{ channel.TRFCNT = length; }
+void dmaTransferSource(DMA_CH_t &, const void *) { }
+void dmaTransferSource(DMA_CH_t &, const volatile void *) { }
+void dmaTransferDest(DMA_CH_t &, const void *) { }
+void dmaTransferDest(DMA_CH_t &, const volatile void *) { }
+
+void dmaInterruptEnable(DMA_CH_t &channel, const DMA_CH_TRNINTLVL_t level)
+	{ channel.CTRLB = level; }
+
+void dmaTrigger(DMA_CH_t &channel)
+	{ ++host::dmaTriggers[host::channelNumber(channel)]; }
+
+// There's no DMA controller to hand the copy to, so it's done by the time dmaCopy() returns
+void dmaCopy(void *const dest, const void *const src, const uint16_t length, const dmaCopyDone_t done) noexcept
+{
+	std::memcpy(dest, src, length);
+	++host::dmaTriggers[3];
+	if (done)
+		done();
+}
+
+bool dmaCopyBusy() noexcept { return false; }
+void dmaWaitForCopy() noexcept { }
+
+void timerInit(TC0_t &timer)
+{
+	timer.CTRLA = TC_CLKSEL_DIV4_gc;
+	timer.PER = 33333;
+	timer.CNT = 0;
+}
+
+void uartInit() noexcept { }
+void uartWrite(USART_t &uart, const uint8_t data) { uart.DATA = data; }
+
+void uartWrite(USART_t &uart, std::flash_string_view str)
+{
+	for (const char c : str)
+		uartWrite(uart, c);
+}
+
+void uartWaitTXComplete(USART_t &) { }
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <chrono>
+#include <avr/io.h>
+#include "host.hxx"
+
+PORTCFG_t PORTCFG{};
+PORT_t PORTA{};
+PORT_t PORTC{};
+PORT_t PORTD{};
+PORT_t PORTE{};
+PORT_t PORTF{};
+PORT_t PORTR{};
+TC0_t TCC0{};
+TC0_t TCD0{};
+TC1_t TCD1{};
+DMA_t DMA{};
+NVM_t NVM{};
+CRC_t CRC{};
+USART_t USARTC0{};
+USART_t USARTC1{};
+USART_t USARTD0{};
+USART_t USARTD1{};
+USART_t USARTE0{};
+USART_t USARTE1{};
+USB_t USB{};
+PMIC_t PMIC{};
+
+register8_t CCP{};
+register8_t RAMPD{};
+register8_t RAMPX{};
+register8_t RAMPY{};
+register8_t RAMPZ{};
+register8_t SREG{};
+
+namespace host
+{
+	std::array<uint8_t, matrixColumns> matrix{};
+
+	static uint8_t readMatrix() noexcept
+	{
+		const uint8_t column{PORTA.OUT};
+		return column < matrix.size() ? matrix[column] : 0U;
+	}
+
+	static uint16_t ledTimerOffset{};
+
+	static uint16_t ledTimerTicks() noexcept
+	{
+		const auto now{std::chrono::steady_clock::now().time_since_epoch()};
+		return uint16_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() / 250);
+	}
+
+	static uint16_t readLEDTimer() noexcept { return uint16_t(ledTimerTicks() + ledTimerOffset); }
+	static void writeLEDTimer(const uint16_t value) noexcept { ledTimerOffset = uint16_t(value - ledTimerTicks()); }
+
+	void ledTimerFollowsClock(const bool follow) noexcept
+	{
+		if (follow)
+			writeLEDTimer(TCC0.CNT);
+		TCC0.CNT.readHook(follow ? readLEDTimer : nullptr);
+		TCC0.CNT.writeHook(follow ? writeLEDTimer : nullptr);
+	}
+
+	// Wire the row read-back up to the synthetic matrix before anything can scan it
+	static const bool matrixHooked
+	{
+		[]() noexcept
+		{
+			PORTF.IN.readHook(readMatrix);
+			return true;
+		}()
+	};
+} // namespace host
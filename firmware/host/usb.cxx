@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <array>
+#include <usb/core.hxx>
+#include <usb/device.hxx>
+#include "host.hxx"
+
+/*!
+ * Minimal model of dragonUSB's endpoint handling: handlers are recorded on
+ * registration, and armed IN transfers stay pending until the harness
+ * completes them, mirroring an IN token arriving from the host.
+ */
+
+namespace usb::core
+{
+	std::array<usbEPStatus_t<const void>, endpointCount + 1U> epStatusControllerIn{};
+	std::array<usbEPStatus_t<void>, endpointCount + 1U> epStatusControllerOut{};
+
+	struct registeredHandler_t final
+	{
+		endpoint_t endpoint;
+		uint8_t config;
+		handler_t handler;
+	};
+
+	static std::array<registeredHandler_t, endpointCount> handlers{};
+	static std::size_t handlerCount{};
+
+	void init() noexcept { handlerCount = 0; }
+	void attach() noexcept { }
+	void handleIRQ() noexcept { }
+
+	void pauseWriteEP(const uint8_t endpoint) noexcept
+		{ epStatusControllerIn[endpoint].transferring(false); }
+
+	void writeEP(const uint8_t endpoint) noexcept
+	{
+		auto &epStatus{epStatusControllerIn[endpoint]};
+		if (epStatus.needsArming())
+		{
+			epStatus.needsArming(false);
+			epStatus.transferring(true);
+		}
+	}
+
+	void registerHandler(const endpoint_t endpoint, const uint8_t config, const handler_t handler) noexcept
+	{
+		if (handlerCount < handlers.size())
+			handlers[handlerCount++] = {endpoint, config, handler};
+	}
+
+	static const handler_t *handlerFor(const uint8_t endpoint, const endpointDir_t dir) noexcept
+	{
+		for (std::size_t i{0}; i < handlerCount; ++i)
+		{
+			const auto &entry{handlers[i]};
+			if (entry.endpoint.endpoint == endpoint && entry.endpoint.dir == dir)
+				return &entry.handler;
+		}
+		return nullptr;
+	}
+} // namespace usb::core
+
+namespace usb::device
+{
+	types::setupPacket_t packet{};
+	setupCallback_t setupCallback{nullptr};
+
+	setupHandler_t setupHandler{nullptr};
+	static uint8_t setupInterface{};
+
+	void registerHandler(const uint8_t interface, const uint8_t, const setupHandler_t handler) noexcept
+	{
+		setupInterface = interface;
+		setupHandler = handler;
+	}
+} // namespace usb::device
+
+namespace host
+{
+	using namespace usb::core;
+
+	void usbConfigure(const uint8_t config) noexcept
+	{
+		for (std::size_t i{0}; i < handlerCount; ++i)
+		{
+			const auto &entry{handlers[i]};
+			if (entry.config == config && entry.handler.init)
+				entry.handler.init(entry.endpoint.endpoint);
+		}
+	}
+
+	usb::types::answer_t usbSetup(const usb::types::setupPacket_t &packet) noexcept
+	{
+		usb::device::packet = packet;
+		usb::device::setupCallback = nullptr;
+		if (!usb::device::setupHandler)
+			return {usb::types::response_t::unhandled, nullptr, 0};
+		return usb::device::setupHandler(usb::device::setupInterface);
+	}
+
+	bool usbCompleteIn(const uint8_t endpoint) noexcept
+	{
+		auto &epStatus{epStatusControllerIn[endpoint]};
+		if (!epStatus.transferring())
+			return false;
+		epStatus.transferring(false);
+		const auto *const handler{handlerFor(endpoint, endpointDir_t::controllerIn)};
+		if (handler && handler->handleControllerIn)
+			handler->handleControllerIn(endpoint);
+		return true;
+	}
+} // namespace host
@@ -23,7 +23,15 @@ extern void dmaTransferSource(DMA_CH_t &channel, const void *address);
 extern void dmaTransferSource(DMA_CH_t &channel, const volatile void *address);
 extern void dmaTransferDest(DMA_CH_t &channel, const void *address);
 extern void dmaTransferDest(DMA_CH_t &channel, const volatile void *address);
-extern void dmaInterruptEnable(DMA_CH_t &channel);
+extern void dmaInterruptEnable(DMA_CH_t &channel, DMA_CH_TRNINTLVL_t level);
 extern void dmaTrigger(DMA_CH_t &channel);
 
+// Called from dmaChannel3IRQ once a background copy has finished
+using dmaCopyDone_t = void (*)() noexcept;
+
+// Background SRAM to SRAM copies on DMA channel 3, one at a time
+extern void dmaCopy(void *dest, const void *src, uint16_t length, dmaCopyDone_t done = nullptr) noexcept;
+extern bool dmaCopyBusy() noexcept;
+extern void dmaWaitForCopy() noexcept;
+
 #endif /*MXKEYBOARD__HXX*/
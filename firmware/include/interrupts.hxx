@@ -2,7 +2,12 @@
 #ifndef INTERRUPTS__HXX
 #define INTERRUPTS__HXX
 
+#ifdef __AVR__
 #define INTERRUPT __attribute__((signal)) __attribute__((used))
+#else
+// When built for the host, interrupt handlers are called directly as normal functions
+#define INTERRUPT __attribute__((used))
+#endif
 
 extern "C"
 {
@@ -10,11 +15,14 @@ extern "C"
 	void dmaChannel0IRQ() INTERRUPT;
 	void dmaChannel1IRQ() INTERRUPT;
 	void dmaChannel2IRQ() INTERRUPT;
+	void dmaChannel3IRQ() noexcept INTERRUPT;
 	void tcc0OverflowIRQ() INTERRUPT;
 	void usbBusEvtIRQ() noexcept INTERRUPT;
 	void usbIOCompIRQ() noexcept INTERRUPT;
 	void ps2IRQ() noexcept INTERRUPT;
 	void keyIRQ() noexcept INTERRUPT;
+	void nvmEEPROMReadyIRQ() noexcept INTERRUPT;
+	void nvmSPMReadyIRQ() noexcept INTERRUPT;
 }
 
 #endif /*INTERRUPTS__HXX*/
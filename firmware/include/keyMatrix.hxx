@@ -2,13 +2,15 @@
 #ifndef KEY_MATRIX__HXX
 #define KEY_MATRIX__HXX
 
+#include <cstddef>
 #include <array>
 #include "flash.hxx"
 #include "usb/types.hxx"
+#include "layout.hxx"
 
 namespace mxKeyboard::keyMatrix
 {
-	constexpr static size_t keyCount{126};
+	constexpr static size_t keyCount{layout::matrixSize};
 
 	using usbScancode_t = usb::descriptors::hid::scancode_t;
 
@@ -19,11 +21,7 @@ namespace mxKeyboard::keyMatrix
 		uint8_t b;
 	};
 
-	struct key_t final
-	{
-		uint8_t ledIndex;
-		usbScancode_t usbScancode;
-	};
+	using layout::key_t;
 
 	enum struct keyType_t : uint8_t
 	{
@@ -31,6 +29,22 @@ namespace mxKeyboard::keyMatrix
 		latching = 0x08U
 	};
 
+	/*!
+	 * How a key's switch is debounced:
+	 * - deferred waits out the debounce count and press/release time before reporting either edge
+	 * - eagerPress reports a press on the first sample, then ignores the switch for the lockout
+	 *   window (debounce count + press time); releases remain deferred
+	 * - eagerBoth reports both edges on the first sample, each followed by a lockout window
+	 * profileDefault is only valid in a key's profile entry and defers to the profile-wide mode.
+	 */
+	enum struct debounceMode_t : uint8_t
+	{
+		profileDefault = 0x00U,
+		deferred = 0x01U,
+		eagerPress = 0x02U,
+		eagerBoth = 0x03U
+	};
+
 	struct state_t final
 	{
 	private:
@@ -66,172 +80,77 @@ namespace mxKeyboard::keyMatrix
 			value &= 0xF7;
 			value |= static_cast<uint8_t>(type);
 		}
+
+		debounceMode_t debounceMode() const noexcept { return static_cast<debounceMode_t>((value >> 4U) & 0x03U); }
+		void debounceMode(const debounceMode_t mode) noexcept
+		{
+			value &= 0xCFU;
+			value |= uint8_t((static_cast<uint8_t>(mode) & 0x03U) << 4U);
+		}
 	};
 
+	/*!
+	 * The per-key state keyIRQ works on every time it visits a key. The profile gives debounce and
+	 * press/release times in milliseconds, these count scans.
+	 *
+	 * What a key reports once it changes state lives apart from this in keyInfo_t, which only the
+	 * main loop reads, so the scan's working set stays small and one column's worth of keys is in
+	 * reach of a single pointer's ldd/std displacement on the AVR.
+	 */
 	struct keyState_t final
 	{
 		state_t state{};
-		uint8_t debounce{0};
-		uint8_t timePress{0};
-		uint8_t timeRelease{0};
-		uint8_t ledIndex{255};
-		rgb_t ledColour{};
+		uint16_t debounce{0};
+		uint16_t timePress{0};
+		uint16_t timeRelease{0};
+		uint16_t lockout{0};
+	};
+
+	struct keyInfo_t final
+	{
+		uint8_t ledIndex{layout::noLED};
 		usbScancode_t usbScancode{0};
 	};
 
-	extern void updateKey(usbScancode_t scancode, bool pressed);
+	static_assert(sizeof(state_t) == 1U && offsetof(keyState_t, state) == 0U,
+		"The key state flags must be reachable without a displacement");
+	static_assert(sizeof(keyState_t) <= sizeof(state_t) + (4U * sizeof(uint16_t)) + (alignof(uint16_t) - 1U),
+		"keyState_t must only hold what keyIRQ needs");
+	static_assert(layout::rowCount * sizeof(keyState_t) <= 64U,
+		"A column's keys must all be in reach of one pointer's ldd/std displacement");
+	static_assert(sizeof(keyInfo_t) == 2U, "keyInfo_t must stay a power of two in size for cheap indexing");
+
+	/*!
+	 * Counts of matrix columns the scan had to process vs could skip as nothing changed, of key
+	 * state changes that had to wait for space in the event queue to the main loop, and of scans
+	 * that overran into the next scan period. achievedRate is the measured scan rate in Hz.
+	 * Packed as the getScanStats vendor request hands it to the host as is.
+	 */
+	struct [[gnu::packed]] scanStats_t final
+	{
+		uint32_t columnsSkipped{0};
+		uint32_t columnsProcessed{0};
+		uint16_t eventsDeferred{0};
+		uint16_t overruns{0};
+		uint16_t achievedRate{0};
+	};
 
-	const std::array<flash_t<key_t>, keyCount> keys
-	{{
-		{{0, usbScancode_t::escape}},
-		{{1, usbScancode_t::graveAccent}}, // Actually backtick..
-		{{2, usbScancode_t::tab}},
-		{{3, usbScancode_t::capsLock}},
-		{{4, usbScancode_t::leftShift}},
-		{{5, usbScancode_t::leftControl}},
-
-		{{6, usbScancode_t::f1}},
-		{{7, usbScancode_t::_1}},
-		{{8, usbScancode_t::q}},
-		{{9, usbScancode_t::a}},
-		{{10, usbScancode_t::intlBackSlash}},
-		{{11, usbScancode_t::leftMeta}},
-
-		{{12, usbScancode_t::f2}},
-		{{13, usbScancode_t::_2}},
-		{{14, usbScancode_t::w}},
-		{{15, usbScancode_t::s}},
-		{{16, usbScancode_t::z}},
-		{{17, usbScancode_t::leftAlt}},
-
-		{{18, usbScancode_t::f3}},
-		{{19, usbScancode_t::_3}},
-		{{20, usbScancode_t::e}},
-		{{21, usbScancode_t::d}},
-		{{22, usbScancode_t::x}},
-		{{255, usbScancode_t::reserved}},
-
-		{{23, usbScancode_t::f4}},
-		{{24, usbScancode_t::_4}},
-		{{25, usbScancode_t::r}},
-		{{26, usbScancode_t::f}},
-		{{27, usbScancode_t::c}},
-		{{255, usbScancode_t::reserved}},
-
-		{{28, usbScancode_t::f5}},
-		{{29, usbScancode_t::_5}},
-		{{30, usbScancode_t::t}},
-		{{31, usbScancode_t::g}},
-		{{32, usbScancode_t::v}},
-		{{255, usbScancode_t::reserved}},
-
-		{{33, usbScancode_t::f6}},
-		{{34, usbScancode_t::_6}},
-		{{35, usbScancode_t::y}},
-		{{36, usbScancode_t::h}},
-		{{37, usbScancode_t::b}},
-		{{38, usbScancode_t::space}},
-
-		{{39, usbScancode_t::f7}},
-		{{40, usbScancode_t::_7}},
-		{{41, usbScancode_t::u}},
-		{{42, usbScancode_t::j}},
-		{{43, usbScancode_t::n}},
-		{{255, usbScancode_t::reserved}},
-
-		{{44, usbScancode_t::f8}},
-		{{45, usbScancode_t::_8}},
-		{{46, usbScancode_t::i}},
-		{{47, usbScancode_t::k}},
-		{{48, usbScancode_t::m}},
-		{{255, usbScancode_t::reserved}},
-
-		{{49, usbScancode_t::f9}},
-		{{50, usbScancode_t::_9}},
-		{{51, usbScancode_t::o}},
-		{{52, usbScancode_t::l}},
-		{{53, usbScancode_t::comma}},
-		{{54, usbScancode_t::rightAlt}},
-
-		{{55, usbScancode_t::f10}},
-		{{56, usbScancode_t::_0}},
-		{{57, usbScancode_t::p}},
-		{{58, usbScancode_t::semiColon}},
-		{{59, usbScancode_t::fullStop}},
-		{{60, usbScancode_t::rightMeta}},
-
-		{{61, usbScancode_t::f11}},
-		{{62, usbScancode_t::dash}},
-		{{63, usbScancode_t::leftBracket}},
-		{{64, usbScancode_t::singleQuote}},
-		{{65, usbScancode_t::forwardSlash}},
-		// This is the menu key.. rather than using the menu scancode,
-		// we apparently have to use the application scancode.. figures.
-		{{66, usbScancode_t::application}},
-
-		{{67, usbScancode_t::f12}},
-		{{68, usbScancode_t::equals}},
-		{{69, usbScancode_t::rightBracket}},
-		{{70, usbScancode_t::hash}},
-		{{71, usbScancode_t::rightShift}},
-		{{72, usbScancode_t::rightControl}},
-
-		{{255, usbScancode_t::reserved}},
-		{{73, usbScancode_t::backspace}},
-		{{255, usbScancode_t::reserved}},
-		{{74, usbScancode_t::enter}},
-		{{255, usbScancode_t::reserved}},
-		{{255, usbScancode_t::reserved}},
-
-		{{75, usbScancode_t::printScreen}},
-		{{76, usbScancode_t::insert}},
-		{{77, usbScancode_t::_delete}},
-		{{255, usbScancode_t::reserved}},
-		{{255, usbScancode_t::reserved}},
-		{{78, usbScancode_t::leftArrow}},
-
-		{{79, usbScancode_t::scrollLock}},
-		{{80, usbScancode_t::home}},
-		{{81, usbScancode_t::end}},
-		{{82, usbScancode_t::reserved}},
-		{{83, usbScancode_t::upArrow}},
-		{{84, usbScancode_t::downArrow}},
-
-		{{85, usbScancode_t::pause}},
-		{{86, usbScancode_t::pageUp}},
-		{{87, usbScancode_t::pageDown}},
-		{{255, usbScancode_t::reserved}},
-		{{255, usbScancode_t::reserved}},
-		{{88, usbScancode_t::rightArrow}},
-
-		{{255, usbScancode_t::reserved}},
-		{{89, usbScancode_t::numLock}},
-		{{90, usbScancode_t::keypad7}},
-		{{91, usbScancode_t::keypad4}},
-		{{92, usbScancode_t::keypad1}},
-		{{93, usbScancode_t::keypad0}},
-
-		{{255, usbScancode_t::reserved}},
-		{{94, usbScancode_t::keypadDivide}},
-		{{95, usbScancode_t::keypad8}},
-		{{96, usbScancode_t::keypad5}},
-		{{97, usbScancode_t::keypad2}},
-		{{255, usbScancode_t::reserved}},
-
-		{{255, usbScancode_t::reserved}},
-		{{98, usbScancode_t::keypadMultiply}},
-		{{99, usbScancode_t::keypad9}},
-		{{100, usbScancode_t::keypad6}},
-		{{101, usbScancode_t::keypad3}},
-		{{102, usbScancode_t::keypadPeriod}},
-
-		{{255, usbScancode_t::reserved}},
-		{{103, usbScancode_t::keypadSubtract}},
-		{{255, usbScancode_t::reserved}},
-		{{104, usbScancode_t::keypadAdd}},
-		{{255, usbScancode_t::reserved}},
-		{{105, usbScancode_t::keypadEnter}}
-	}};
+	extern void updateKey(usbScancode_t scancode, bool pressed);
+	// Applies the key state changes queued by keyIRQ to the LEDs and usb::hid, from the main loop
+	extern void dispatchKeyEvents() noexcept;
+	/*!
+	 * Asks the main loop to switch to another profile, which dispatchKeyEvents() does a bounded step
+	 * per call by applying just what differs from the active one. Safe to call from interrupts;
+	 * returns false if there can be no such profile. Holding Right Control + Menu and pressing 1-9
+	 * or 0 does the same.
+	 */
+	extern bool selectProfile(uint8_t profileNumber) noexcept;
+	// The profile in use, which only changes once a switch to another has been worked all the way through
+	extern uint8_t activeProfile() noexcept;
+	extern scanStats_t scanStats() noexcept;
+	// Whether no switch is closed or settling and no key events wait for dispatchKeyEvents()
+	extern bool idle() noexcept;
+	extern void resetScanStats() noexcept;
 } // namespace mxKeyboard::keyMatrix
 
 #endif /*KEY_MATRIX__HXX*/
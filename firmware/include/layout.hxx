@@ -0,0 +1,289 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef LAYOUT__HXX
+#define LAYOUT__HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <utility>
+#include "flash.hxx"
+#include "usb/types.hxx"
+
+/*!
+ * The keyboard's physical layout, and the tables the firmware needs generated from it at
+ * compile time. Everything about which switches exist, which LED sits under each and how
+ * the LEDs are chained is described here once, so an alternative layout only needs this
+ * file changing.
+ *
+ * The description is only used in constant expressions - tables needed at run time are
+ * generated into flash by toFlash() or are small enough to be worth keeping in RAM.
+ */
+
+namespace mxKeyboard::layout
+{
+	using usbScancode_t = usb::descriptors::hid::scancode_t;
+
+	constexpr static uint8_t columnCount{21U};
+	constexpr static uint8_t rowCount{6U};
+	constexpr static std::size_t matrixSize{columnCount * rowCount};
+	// The LEDs under keys are numbered from 0, with any after them lighting the case
+	constexpr static uint8_t keyLEDCount{106U};
+	constexpr static uint8_t ledCount{109U};
+	constexpr static uint8_t ledsPerChip{24U};
+	// Marks a matrix position with no switch fitted
+	constexpr static uint8_t noLED{255U};
+
+	struct key_t final
+	{
+		uint8_t ledIndex;
+		usbScancode_t usbScancode;
+	};
+
+	// One entry per matrix position, a column (of rowCount rows) at a time
+	constexpr static std::array<key_t, matrixSize> matrix
+	{{
+		{0, usbScancode_t::escape},
+		{1, usbScancode_t::graveAccent}, // Actually backtick..
+		{2, usbScancode_t::tab},
+		{3, usbScancode_t::capsLock},
+		{4, usbScancode_t::leftShift},
+		{5, usbScancode_t::leftControl},
+
+		{6, usbScancode_t::f1},
+		{7, usbScancode_t::_1},
+		{8, usbScancode_t::q},
+		{9, usbScancode_t::a},
+		{10, usbScancode_t::intlBackSlash},
+		{11, usbScancode_t::leftMeta},
+
+		{12, usbScancode_t::f2},
+		{13, usbScancode_t::_2},
+		{14, usbScancode_t::w},
+		{15, usbScancode_t::s},
+		{16, usbScancode_t::z},
+		{17, usbScancode_t::leftAlt},
+
+		{18, usbScancode_t::f3},
+		{19, usbScancode_t::_3},
+		{20, usbScancode_t::e},
+		{21, usbScancode_t::d},
+		{22, usbScancode_t::x},
+		{noLED, usbScancode_t::reserved},
+
+		{23, usbScancode_t::f4},
+		{24, usbScancode_t::_4},
+		{25, usbScancode_t::r},
+		{26, usbScancode_t::f},
+		{27, usbScancode_t::c},
+		{noLED, usbScancode_t::reserved},
+
+		{28, usbScancode_t::f5},
+		{29, usbScancode_t::_5},
+		{30, usbScancode_t::t},
+		{31, usbScancode_t::g},
+		{32, usbScancode_t::v},
+		{noLED, usbScancode_t::reserved},
+
+		{33, usbScancode_t::f6},
+		{34, usbScancode_t::_6},
+		{35, usbScancode_t::y},
+		{36, usbScancode_t::h},
+		{37, usbScancode_t::b},
+		{38, usbScancode_t::space},
+
+		{39, usbScancode_t::f7},
+		{40, usbScancode_t::_7},
+		{41, usbScancode_t::u},
+		{42, usbScancode_t::j},
+		{43, usbScancode_t::n},
+		{noLED, usbScancode_t::reserved},
+
+		{44, usbScancode_t::f8},
+		{45, usbScancode_t::_8},
+		{46, usbScancode_t::i},
+		{47, usbScancode_t::k},
+		{48, usbScancode_t::m},
+		{noLED, usbScancode_t::reserved},
+
+		{49, usbScancode_t::f9},
+		{50, usbScancode_t::_9},
+		{51, usbScancode_t::o},
+		{52, usbScancode_t::l},
+		{53, usbScancode_t::comma},
+		{54, usbScancode_t::rightAlt},
+
+		{55, usbScancode_t::f10},
+		{56, usbScancode_t::_0},
+		{57, usbScancode_t::p},
+		{58, usbScancode_t::semiColon},
+		{59, usbScancode_t::fullStop},
+		{60, usbScancode_t::rightMeta},
+
+		{61, usbScancode_t::f11},
+		{62, usbScancode_t::dash},
+		{63, usbScancode_t::leftBracket},
+		{64, usbScancode_t::singleQuote},
+		{65, usbScancode_t::forwardSlash},
+		// This is the menu key.. rather than using the menu scancode,
+		// we apparently have to use the application scancode.. figures.
+		{66, usbScancode_t::application},
+
+		{67, usbScancode_t::f12},
+		{68, usbScancode_t::equals},
+		{69, usbScancode_t::rightBracket},
+		{70, usbScancode_t::hash},
+		{71, usbScancode_t::rightShift},
+		{72, usbScancode_t::rightControl},
+
+		{noLED, usbScancode_t::reserved},
+		{73, usbScancode_t::backspace},
+		{noLED, usbScancode_t::reserved},
+		{74, usbScancode_t::enter},
+		{noLED, usbScancode_t::reserved},
+		{noLED, usbScancode_t::reserved},
+
+		{75, usbScancode_t::printScreen},
+		{76, usbScancode_t::insert},
+		{77, usbScancode_t::_delete},
+		{noLED, usbScancode_t::reserved},
+		{noLED, usbScancode_t::reserved},
+		{78, usbScancode_t::leftArrow},
+
+		{79, usbScancode_t::scrollLock},
+		{80, usbScancode_t::home},
+		{81, usbScancode_t::end},
+		{82, usbScancode_t::reserved},
+		{83, usbScancode_t::upArrow},
+		{84, usbScancode_t::downArrow},
+
+		{85, usbScancode_t::pause},
+		{86, usbScancode_t::pageUp},
+		{87, usbScancode_t::pageDown},
+		{noLED, usbScancode_t::reserved},
+		{noLED, usbScancode_t::reserved},
+		{88, usbScancode_t::rightArrow},
+
+		{noLED, usbScancode_t::reserved},
+		{89, usbScancode_t::numLock},
+		{90, usbScancode_t::keypad7},
+		{91, usbScancode_t::keypad4},
+		{92, usbScancode_t::keypad1},
+		{93, usbScancode_t::keypad0},
+
+		{noLED, usbScancode_t::reserved},
+		{94, usbScancode_t::keypadDivide},
+		{95, usbScancode_t::keypad8},
+		{96, usbScancode_t::keypad5},
+		{97, usbScancode_t::keypad2},
+		{noLED, usbScancode_t::reserved},
+
+		{noLED, usbScancode_t::reserved},
+		{98, usbScancode_t::keypadMultiply},
+		{99, usbScancode_t::keypad9},
+		{100, usbScancode_t::keypad6},
+		{101, usbScancode_t::keypad3},
+		{102, usbScancode_t::keypadPeriod},
+
+		{noLED, usbScancode_t::reserved},
+		{103, usbScancode_t::keypadSubtract},
+		{noLED, usbScancode_t::reserved},
+		{104, usbScancode_t::keypadAdd},
+		{noLED, usbScancode_t::reserved},
+		{105, usbScancode_t::keypadEnter}
+	}};
+
+	// The LED drivers are wired such that each chip's LEDs run backwards along the chain
+	constexpr inline uint8_t ledPosition(const uint8_t led) noexcept
+		{ return uint8_t(((led / ledsPerChip) * ledsPerChip) + (ledsPerChip - 1U) - (led % ledsPerChip)); }
+
+	constexpr inline bool populated(const std::size_t index) noexcept { return matrix[index].ledIndex != noLED; }
+
+	// Bit n of entry c is set if there's a switch at row n of column c
+	constexpr static auto populatedRows
+	{
+		[]() noexcept
+		{
+			std::array<uint8_t, columnCount> rows{};
+			for (std::size_t index{0}; index < matrixSize; ++index)
+			{
+				if (populated(index))
+					rows[index / rowCount] |= uint8_t(1U << (index % rowCount));
+			}
+			return rows;
+		}()
+	};
+
+	constexpr static uint8_t scanColumnCount
+	{
+		[]() noexcept
+		{
+			uint8_t count{0};
+			for (const auto rows : populatedRows)
+				count += rows ? 1U : 0U;
+			return count;
+		}()
+	};
+
+	// The columns with at least one switch, in the order they get scanned
+	constexpr static auto scanColumns
+	{
+		[]() noexcept
+		{
+			std::array<uint8_t, scanColumnCount> columns{};
+			uint8_t next{0};
+			for (uint8_t column{0}; column < columnCount; ++column)
+			{
+				if (populatedRows[column])
+					columns[next++] = column;
+			}
+			return columns;
+		}()
+	};
+
+	// Every key LED must be used exactly once, and every LED must land somewhere different on the chain
+	static_assert([]() noexcept
+	{
+		std::array<bool, keyLEDCount> used{};
+		for (const auto &key : matrix)
+		{
+			if (key.ledIndex == noLED)
+				continue;
+			if (key.ledIndex >= keyLEDCount || used[key.ledIndex])
+				return false;
+			used[key.ledIndex] = true;
+		}
+		for (const auto ledUsed : used)
+		{
+			if (!ledUsed)
+				return false;
+		}
+		return true;
+	}(), "Each key LED must sit under exactly one switch");
+
+	static_assert([]() noexcept
+	{
+		constexpr std::size_t chainLength{((ledCount + ledsPerChip - 1U) / ledsPerChip) * ledsPerChip};
+		std::array<bool, chainLength> used{};
+		for (uint8_t led{0}; led < ledCount; ++led)
+		{
+			const auto position{ledPosition(led)};
+			if (position >= chainLength || used[position])
+				return false;
+			used[position] = true;
+		}
+		return true;
+	}(), "LEDs must map to distinct positions on the chain");
+
+	template<typename T, std::size_t N, std::size_t... indices> constexpr std::array<flash_t<T>, N>
+		toFlash(const std::array<T, N> &table, std::index_sequence<indices...>) noexcept
+		{ return {{flash_t<T>{table[indices]}...}}; }
+
+	// Generates a flash copy of a table built from the description, for use at run time
+	template<typename T, std::size_t N> constexpr std::array<flash_t<T>, N> toFlash(const std::array<T, N> &table) noexcept
+		{ return toFlash(table, std::make_index_sequence<N>{}); }
+
+	// The one copy of the matrix kept for looking keys up at run time
+	inline constexpr auto flashMatrix{toFlash(matrix)};
+} // namespace mxKeyboard::layout
+
+#endif /*LAYOUT__HXX*/
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef LED_EFFECTS__HXX
+#define LED_EFFECTS__HXX
+
+#include <cstdint>
+#include "keyMatrix.hxx"
+
+/*!
+ * Per-key lighting effects, rendered from tcc0OverflowIRQ (so at medium priority, leaving
+ * keyIRQ free to pre-empt it). All colour maths is 8-bit fixed-point HSV.
+ *
+ * Rendering walks the LEDs in order and stops once the frame budget (in TCC0 ticks, 250ns
+ * each) is spent, picking up where it left off on the next LED frame. An effect frame that
+ * doesn't fit a single LED frame therefore just runs at a lower frame rate rather than
+ * eating into the time the main loop has. Keys held down keep their highlight from keyMatrix.
+ *
+ * The accent LEDs past the keys always show a slow hue cycle.
+ */
+
+namespace mxKeyboard::ledEffects
+{
+	using mxKeyboard::keyMatrix::rgb_t;
+
+	enum class effect_t : uint8_t
+	{
+		staticColour = 0U,
+		breathing = 1U,
+		hueWave = 2U,
+		ripple = 3U
+	};
+
+	struct hsv_t final
+	{
+		uint8_t hue;
+		uint8_t saturation;
+		uint8_t value;
+	};
+
+	/*!
+	 * renderTicks is how long the last call to render() ran for, and maxRenderTicks the longest.
+	 * frameTicks is the total render time of the last complete effect frame, and splitFrames
+	 * counts the effect frames that ran out of budget and had to be finished on a later LED frame.
+	 * The ticks are TCC0's, 250ns each. Read from the host with the getFrameStats vendor request.
+	 */
+	struct frameStats_t final
+	{
+		uint16_t renderTicks{0};
+		uint16_t maxRenderTicks{0};
+		uint16_t frameTicks{0};
+		uint16_t splitFrames{0};
+	};
+
+	extern rgb_t hsvToRGB(hsv_t colour) noexcept;
+
+	extern void keyLED(uint8_t led, uint8_t column, uint8_t row, rgb_t colour) noexcept;
+	extern rgb_t keyColour(uint8_t led) noexcept;
+	extern void keyPressed(uint8_t led, bool pressed) noexcept;
+	extern void effect(effect_t effect) noexcept;
+	extern effect_t effect() noexcept;
+	extern void frameBudget(uint16_t microseconds) noexcept;
+	extern uint16_t frameBudget() noexcept;
+	extern void render() noexcept;
+
+	extern frameStats_t frameStats() noexcept;
+	extern void resetFrameStats() noexcept;
+} // namespace mxKeyboard::ledEffects
+
+#endif /*LED_EFFECTS__HXX*/
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef MEMORY__HXX
+#define MEMORY__HXX
+
+#include <cstddef>
+#include <cstdint>
+
+/*!
+ * The firmware's memcpy and memset. On the target these move 8 bytes per pass of an
+ * unrolled loop using the X and Z pointers' post-increment addressing, which is what
+ * memory.cxx aliases std::memcpy and std::memset to. Y is left alone as it's the frame pointer.
+ *
+ * Copies big enough to be worth doing in the background can go to DMA channel 3 with
+ * dmaCopy() (see MXKeyboard.hxx) instead.
+ */
+
+namespace mxKeyboard::memory
+{
+	extern void *copy(void *dest, const void *src, std::size_t count) noexcept;
+	extern void *fill(void *dest, uint8_t value, std::size_t count) noexcept;
+} // namespace mxKeyboard::memory
+
+#endif /*MEMORY__HXX*/
@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef NVM__HXX
+#define NVM__HXX
+
+#include <cstdint>
+#include <cstddef>
+
+namespace mxKeyboard::nvm
+{
+	constexpr static uint16_t flashPageSize{512U};
+	constexpr static auto flashPageMask{flashPageSize - 1U};
+	constexpr static uint16_t eepromPageSize{32U};
+	constexpr static auto eepromPageMask{eepromPageSize - 1U};
+	constexpr static uint16_t eepromSize{4096U};
+
+	// These must match the profile region in atxmega256a3u.ld
+	constexpr static uint32_t profileFlashStart{0x041000U};
+	constexpr static uint16_t profileFlashLength{0x1000U};
+
+	// Copies count bytes starting at the given (full 24-bit) Flash address into RAM
+	extern void readFlash(uint32_t flashAddr, void *buffer, uint16_t count) noexcept;
+	extern void eraseFlashBuffer() noexcept;
+	// Loads count bytes (an even number) into the Flash page buffer, at flashAddr's offset into its page
+	extern void loadFlashBuffer(uint32_t flashAddr, const uint8_t *buffer, uint16_t count) noexcept;
+	// Loads count bytes into the EEPROM page buffer, at eepromAddr's offset into its page
+	extern void loadEEPROMBuffer(uint16_t eepromAddr, const uint8_t *buffer, uint8_t count) noexcept;
+	extern void eraseEEPROMBuffer() noexcept;
+	// Performs an atomic erase + write of the Flash page buffer into the given page
+	extern void writeFlashPage(uint32_t pageAddr) noexcept;
+	// Performs an atomic erase + write of the bytes loaded into the EEPROM page buffer into the given page
+	extern void writeEEPROMPage(uint16_t pageAddr) noexcept;
+	// As writeFlashPage() and writeEEPROMPage(), but returning as soon as the NVM controller has started
+	extern void startFlashPageWrite(uint32_t pageAddr) noexcept;
+	extern void startEEPROMPageWrite(uint16_t pageAddr) noexcept;
+	/*!
+	 * Writes the bytes loaded into the EEPROM page buffer into the given page without erasing them
+	 * first, so can only clear bits. Writing into erased bytes this way leaves the rest of the page
+	 * as it was even if the write doesn't complete, where an erase + write could lose it.
+	 */
+	extern void startEEPROMPageWriteOnly(uint16_t pageAddr) noexcept;
+
+	/*!
+	 * The CRC module, fed a byte at a time between crcStart() and crcResult(). CRC-16 is CRC-CCITT
+	 * and CRC-32 is IEEE 802.3 - the same as flashRangeCRC(), which has the NVM controller run a
+	 * range of Flash through the module itself rather than the CPU reading it out.
+	 */
+	enum class crc_t : uint8_t
+	{
+		crc16,
+		crc32
+	};
+
+	extern void crcStart(crc_t type) noexcept;
+	extern void crcUpdate(const uint8_t *data, uint16_t count) noexcept;
+	extern uint32_t crcResult() noexcept;
+	extern uint32_t flashRangeCRC(uint32_t flashAddr, uint16_t count) noexcept;
+
+	/*!
+	 * Asynchronous page writes. Pages are queued and written one after the other, so the rest of the
+	 * firmware keeps running while EEPROM pages erase and program. Flash pages are another matter:
+	 * the profile Flash is in the boot section (0x040000-0x041FFF), which is the no read-while-write
+	 * section, so the CPU is halted for the whole of each of its page erase + writes. Only
+	 * serviceWrites() starts them, and only once the flashWriteGate says the firmware can spare
+	 * the time - the main loop has it wait for the keyboard to be idle.
+	 *
+	 * The NVM EEPROM and SPM ready interrupts (at low priority) only retire the write that finished
+	 * and start the next if it is an EEPROM page with its contents already in RAM. Pages streamed
+	 * from a source are put together by serviceWrites() from the main loop instead, a chunk per
+	 * call, so building them never holds up the interrupts or the main loop for long. writesDone's
+	 * callback also runs from serviceWrites().
+	 *
+	 * Neither the EEPROM nor the profile Flash may be read while writes are queued, other than by
+	 * page sources, so readers must waitForWrites() first.
+	 */
+	enum class pageType_t : uint8_t
+	{
+		eeprom,
+		// An EEPROM page write that only fills in erased bytes (see startEEPROMPageWriteOnly())
+		eepromWriteOnly,
+		flash
+	};
+
+	constexpr static uint8_t pageChunkSize{32U};
+
+	// Produces count bytes of a page as it is streamed into the page buffer, starting offset bytes in
+	using pageSource_t = void (*)(uint32_t pageAddr, uint16_t offset, uint8_t *buffer, uint8_t count) noexcept;
+
+	/*!
+	 * A page write for the queue. The page's contents come either from data, which must be
+	 * left alone until the write completes, or if that's nullptr, from source a chunk at a time
+	 * once the write reaches the front of the queue. That spares holding a whole Flash page in RAM.
+	 * A page from a source that turns out to match what's stored isn't written.
+	 */
+	struct pageWrite_t final
+	{
+		pageType_t type;
+		uint32_t address;
+		const uint8_t *data;
+		pageSource_t source;
+	};
+
+	// Called from serviceWrites() once the queue has emptied, with the NVM idle
+	using writesDone_t = void (*)() noexcept;
+	// Asked by serviceWrites() before it starts on a Flash page, which waits while this returns false
+	using flashWriteGate_t = bool (*)() noexcept;
+
+	constexpr static uint8_t pageWriteQueueLength{8U};
+
+	// Returns false if the queue is full
+	extern bool queuePageWrite(const pageWrite_t &write) noexcept;
+	extern void writesDone(writesDone_t callback) noexcept;
+	extern void flashWriteGate(flashWriteGate_t gate) noexcept;
+	extern uint8_t pageWritesPending() noexcept;
+	// Does the next bit of the writes' main loop work, which waitForWrites() does all of
+	extern void serviceWrites() noexcept;
+	// Does all the queued writes, Flash pages included whatever the flashWriteGate says
+	extern void waitForWrites() noexcept;
+} // namespace mxKeyboard::nvm
+
+#endif /*NVM__HXX*/
@@ -5,70 +5,309 @@
 #include <cstdint>
 #include <array>
 #include "keyMatrix.hxx"
+#include "scanTimer.hxx"
+#include "ledEffects.hxx"
 
 namespace mxKeyboard::profile
 {
 	using usbScancode_t = usb::descriptors::hid::scancode_t;
 	using mxKeyboard::keyMatrix::keyCount;
 	using mxKeyboard::keyMatrix::rgb_t;
+	using mxKeyboard::keyMatrix::debounceMode_t;
+	using mxKeyboard::scanTimer::scanRate_t;
+	using mxKeyboard::ledEffects::effect_t;
 
-	constexpr static uint8_t profileCount{10U};
+	constexpr static uint8_t profileCount{56U};
+	// Bumped whenever the stored layout changes, so profiles stored in another format aren't valid
+	constexpr static uint8_t profileFormat{3U};
+	constexpr static uint8_t paletteSize{16U};
+
+	/*!
+	 * Profiles are stored in slotCount slots of slotLength bytes, shared between all of them, with
+	 * the first eepromPartLength bytes of each slot in the EEPROM and the rest in the .profile Flash
+	 * section. A profile takes one slot, plus up to extraSlotCount more if its key entries don't all
+	 * fit in the first, so profiles that haven't been written take no space and any one of them can
+	 * have every key set up differently.
+	 */
+	constexpr static uint8_t slotCount{56U};
+	constexpr static uint16_t slotLength{140U};
+	constexpr static uint16_t eepromPartLength{68U};
+	constexpr static uint16_t flashPartLength{slotLength - eepromPartLength};
+	constexpr static uint8_t extraSlotCount{4U};
+	constexpr static uint8_t noSlot{0xFFU};
 
 	constexpr static inline size_t bytesFor(const size_t bits) noexcept
 		{ return (bits / 8U) + ((bits & 7U) ? 1U : 0U); }
 
-	struct eepromPart_t final
+	// timeRelease gives up its top two bits to the key's debounceMode_t to keep a key to 3 bytes
+	struct [[gnu::packed]] key_t final
+	{
+		uint8_t timePress{0};
+		uint8_t timeRelease : 6;
+		uint8_t debounceMode : 2;
+		usbScancode_t scancode{};
+	};
+	static_assert(sizeof(key_t) == 3U);
+	// The longest release time the 6 bits leave room for, in milliseconds
+	constexpr static uint8_t maxTimeRelease{63U};
+
+	// Which profile a slot belongs to and where it comes in the profile's slots, the first being 0
+	struct [[gnu::packed]] slotHeader_t final
 	{
+		uint8_t format{profileFormat};
 		uint8_t profileNumber{0xFFU};
+		uint8_t sequence{0U};
+	};
+	static_assert(sizeof(slotHeader_t) == 3U);
+
+	// Checksums of the slot's EEPROM part and of the rest of its Flash part, filled in by write()
+	struct [[gnu::packed]] profileCRCs_t final
+	{
+		uint16_t eepromPart{};
+		uint32_t flashPart{};
+	};
+	static_assert(sizeof(profileCRCs_t) == 6U);
+
+	constexpr static uint16_t headKeyEntriesLength{slotLength - (sizeof(slotHeader_t) + extraSlotCount + 6U +
+		(sizeof(rgb_t) * paletteSize) + bytesFor(layout::keyLEDCount * 4U) + sizeof(profileCRCs_t))};
+	constexpr static uint16_t extraKeyEntriesLength{slotLength - (sizeof(slotHeader_t) + sizeof(profileCRCs_t))};
+
+	/*!
+	 * A profile's first slot. Key colours are 4-bit indices into a palette, one per key LED. Keys only
+	 * get an entry in keyEntries (see profile.cxx) where they differ from the profile's default timings
+	 * and the layout's scancodes and key types, so a typical profile's keys fit in this slot. The key
+	 * entries carry on through the slots in extraSlots, which ends at the first noSlot.
+	 */
+	struct storedProfile_t final
+	{
+		slotHeader_t header{};
+		std::array<uint8_t, extraSlotCount> extraSlots{};
 		uint8_t debounce{};
-		std::array<rgb_t, keyCount> keyColours{};
+		debounceMode_t debounceMode{};
+		scanRate_t scanRate{};
+		effect_t effect{};
+		uint8_t timePress{};
+		uint8_t timeRelease{};
+		std::array<rgb_t, paletteSize> palette{};
+		std::array<uint8_t, bytesFor(layout::keyLEDCount * 4U)> colourIndices{};
+		std::array<uint8_t, headKeyEntriesLength> keyEntries{};
+		profileCRCs_t crcs{};
 	};
 
-	struct [[gnu::packed]] key_t final
+	// One of a profile's extra slots, holding the next extraKeyEntriesLength bytes of its key entries
+	struct storedKeyEntries_t final
 	{
-		uint8_t timePress{0};
-		uint8_t timeRelease{0};
-		usbScancode_t scancode{};
+		slotHeader_t header{};
+		std::array<uint8_t, extraKeyEntriesLength> keyEntries{};
+		profileCRCs_t crcs{};
 	};
 
-	struct flashPart_t final
+	static_assert(sizeof(storedProfile_t) == slotLength && sizeof(storedKeyEntries_t) == slotLength);
+
+	// All of a profile's slots, in order
+	struct storedChain_t final
 	{
-		std::array<key_t, keyCount> keys{};
-		std::array<uint8_t, bytesFor(keyCount)> keyTypes{};
+		storedProfile_t profile{};
+		std::array<storedKeyEntries_t, extraSlotCount> extra{};
 	};
 
+	// Called from nvm::serviceWrites() once a profile has been saved
+	using saveDone_t = void (*)() noexcept;
+
+	/*!
+	 * A profile as held in RAM, decoded from its stored form. read() and write() go through the
+	 * profile journal (see profile.cxx), so write() only costs as much as what changed since the
+	 * profile was last written.
+	 *
+	 * write() encodes the profile, returning false if it can't be stored as it is: if its key
+	 * colours take more than paletteSize distinct colours, or if there aren't enough free slots for
+	 * it. The save is queued and write() returns without waiting for the NVM, calling done once it
+	 * has completed. Starting another save or reading a profile while one is in progress waits for
+	 * it to finish.
+	 *
+	 * Reading a profile that failed checkProfiles() gives a cleared profile, which isn't valid().
+	 */
 	struct profile_t final
 	{
 	private:
-		eepromPart_t eeprom{};
-		flashPart_t flash{};
+		uint8_t profileNumber_{0xFFU};
+		uint8_t debounce_{};
+		debounceMode_t debounceMode_{};
+		scanRate_t scanRate_{};
+		effect_t effect_{};
+		std::array<rgb_t, keyCount> keyColours_{};
+		std::array<key_t, keyCount> keys_{};
+		std::array<uint8_t, bytesFor(keyCount)> keyTypes_{};
+
+		// Returns how many slots the profile takes, or 0 if it can't be stored
+		uint8_t encode(storedChain_t &chain) const noexcept;
 
 	public:
 		profile_t() noexcept = default;
 		static profile_t read(uint8_t profileNumber) noexcept;
 		void clear() noexcept { *this = {}; }
-		void write() noexcept;
+		bool write(saveDone_t done = nullptr) noexcept;
+		static bool saving() noexcept;
+		static void waitForSave() noexcept;
 		bool valid(const uint8_t expectedNumber) const noexcept
-			{ return eeprom.profileNumber == expectedNumber; }
-
-		void number(const uint8_t profileNumber) noexcept { eeprom.profileNumber = profileNumber; }
-		uint8_t number() const noexcept { return eeprom.profileNumber; }
-		void debounce(const uint8_t debounce) noexcept { eeprom.debounce = debounce; }
-		uint8_t debounce() const noexcept { return eeprom.debounce; }
-		void keyColour(const uint8_t index, const rgb_t colour) noexcept { eeprom.keyColours[index] = colour; }
-		rgb_t keyColour(const uint8_t index) const noexcept { return eeprom.keyColours[index]; }
+			{ return profileNumber_ == expectedNumber; }
+
+		void number(const uint8_t profileNumber) noexcept { profileNumber_ = profileNumber; }
+		uint8_t number() const noexcept { return profileNumber_; }
+		void debounce(const uint8_t debounce) noexcept { debounce_ = debounce; }
+		uint8_t debounce() const noexcept { return debounce_; }
+		void debounceMode(const debounceMode_t mode) noexcept { debounceMode_ = mode; }
+		debounceMode_t debounceMode() const noexcept { return debounceMode_; }
+		void scanRate(const scanRate_t rate) noexcept { scanRate_ = rate; }
+		scanRate_t scanRate() const noexcept { return scanRate_; }
+		void effect(const effect_t effect) noexcept { effect_ = effect; }
+		effect_t effect() const noexcept { return effect_; }
+		void keyColour(const uint8_t index, const rgb_t colour) noexcept { keyColours_[index] = colour; }
+		rgb_t keyColour(const uint8_t index) const noexcept { return keyColours_[index]; }
 		void timePress(const uint8_t index, const uint8_t time) noexcept
-			{ flash.keys[index].timePress = time; }
-		uint8_t timePress(const uint8_t index) const noexcept { return flash.keys[index].timePress; }
+			{ keys_[index].timePress = time; }
+		uint8_t timePress(const uint8_t index) const noexcept { return keys_[index].timePress; }
+		// Release times too long to store are clamped to maxTimeRelease rather than wrapped
 		void timeRelease(const uint8_t index, const uint8_t time) noexcept
-			{ flash.keys[index].timeRelease = time; }
-		uint8_t timeRelease(const uint8_t index) const noexcept { return flash.keys[index].timeRelease; }
+			{ keys_[index].timeRelease = time < maxTimeRelease ? time : maxTimeRelease; }
+		uint8_t timeRelease(const uint8_t index) const noexcept { return keys_[index].timeRelease; }
 		void scancode(const uint8_t index, usbScancode_t scancode) noexcept
-			{ flash.keys[index].scancode = scancode; }
-		usbScancode_t scancode(const uint8_t index) const noexcept { return flash.keys[index].scancode; }
+			{ keys_[index].scancode = scancode; }
+		usbScancode_t scancode(const uint8_t index) const noexcept { return keys_[index].scancode; }
+		void debounceMode(const uint8_t index, const debounceMode_t mode) noexcept
+			{ keys_[index].debounceMode = uint8_t(mode) & 0x03U; }
+		debounceMode_t debounceMode(const uint8_t index) const noexcept
+			{ return static_cast<debounceMode_t>(keys_[index].debounceMode); }
 		void keyType(uint8_t index, keyMatrix::keyType_t type) noexcept;
 		bool keyType(const uint8_t index) const noexcept
-			{ return (flash.keyTypes[index >> 3U] >> (index & 7U)) & 1U; }
+			{ return (keyTypes_[index >> 3U] >> (index & 7U)) & 1U; }
+	};
+
+	/*!
+	 * Checks each stored profile's slots against their CRCs, falling back to the copy from before the
+	 * last save if that save didn't complete. Must be called at boot before any profile is read.
+	 */
+	extern void checkProfiles() noexcept;
+
+	/*!
+	 * The profile-wide settings of a profile whose keys all take the layout's scancodes and key
+	 * types, no press or release times and the one colour.
+	 */
+	struct defaultProfile_t final
+	{
+		uint8_t debounce;
+		debounceMode_t debounceMode;
+		scanRate_t scanRate;
+		effect_t effect;
+		rgb_t colour;
+	};
+
+	/*!
+	 * Stores such a profile, encoding it straight into the save rather than building a ~780 byte
+	 * profile_t first. Otherwise as profile_t::write().
+	 */
+	extern bool writeDefault(uint8_t profileNumber, const defaultProfile_t &profile, saveDone_t done = nullptr) noexcept;
+
+	// A key's settings as read from a stored profile
+	struct storedKey_t final
+	{
+		key_t key{};
+		rgb_t colour{};
+		bool latching{false};
+	};
+
+	/*!
+	 * Reads a stored profile's keys in index order straight out of the EEPROM and Flash, keeping no
+	 * more of it in RAM than its settings, palette and colour indices and a few bytes of key entries.
+	 * next() gives the next key, or returns false if more of the profile has to be read first, which
+	 * fill() does one journal replay's worth of at a time - so a profile can be worked through a
+	 * little per main loop pass. fill() reads nothing while a save is in progress, returning false,
+	 * and once any profile has been written the reader is stale() and has to be started over.
+	 *
+	 * A profile that isn't stored reads as cleared, like profile_t::read() gives.
+	 */
+	struct keyReader_t final
+	{
+	private:
+		constexpr static uint8_t entriesChunk{16U};
+
+		// The first slot's settings, palette and colour indices, laid out as in storedProfile_t
+		struct [[gnu::packed]] head_t final
+		{
+			std::array<uint8_t, extraSlotCount> extraSlots{};
+			uint8_t debounce{};
+			debounceMode_t debounceMode{};
+			scanRate_t scanRate{};
+			effect_t effect{};
+			uint8_t timePress{};
+			uint8_t timeRelease{};
+			std::array<rgb_t, paletteSize> palette{};
+			std::array<uint8_t, bytesFor(layout::keyLEDCount * 4U)> colourIndices{};
+		};
+
+		uint8_t profileNumber_;
+		uint8_t writes_;
+		uint8_t firstSlot_{0xFFU};
+		bool headRead_{false};
+		head_t head_{};
+		uint8_t index_{0};
+		// The key entry covering keys from entryFirst_ for entryCount_ indices, if any is left
+		uint8_t entryFirst_{0};
+		uint8_t entryCount_{0};
+		bool entryLatching_{false};
+		bool entryRemapped_{false};
+		bool entriesEnded_{false};
+		key_t entryKey_{};
+		// Key entries read ahead of being decoded, entries_[0] being entriesStart_ bytes into them
+		uint16_t entriesStart_{0};
+		uint8_t entriesRead_{0};
+		uint8_t entriesUsed_{0};
+		std::array<uint8_t, entriesChunk> entries_{};
+
+		bool nextEntry() noexcept;
+
+	public:
+		keyReader_t(uint8_t profileNumber) noexcept;
+		bool fill() noexcept;
+		bool next(storedKey_t &key) noexcept;
+		bool stale() const noexcept;
+		uint8_t number() const noexcept { return profileNumber_; }
+		// The index of the key next() gives next, keyCount once they've all been read
+		uint8_t index() const noexcept { return index_; }
+
+		// The profile's settings, which are there once fill() first succeeds
+		bool headRead() const noexcept { return headRead_; }
+		bool valid() const noexcept { return firstSlot_ != 0xFFU; }
+		uint8_t debounce() const noexcept { return head_.debounce; }
+		debounceMode_t debounceMode() const noexcept { return head_.debounceMode; }
+		scanRate_t scanRate() const noexcept { return head_.scanRate; }
+		effect_t effect() const noexcept { return head_.effect; }
+	};
+
+	/*!
+	 * Read-only access to a stored profile that decodes each field from the EEPROM and Flash as it
+	 * is asked for rather than holding a ~780 byte copy like profile_t. Accesses replay the profile's
+	 * journal records, so this is for setting up from a profile rather than for hot paths. Going
+	 * through a profile's keys is keyReader_t's job; key() and keyType() read up to the one key.
+	 */
+	struct profileView_t final
+	{
+	private:
+		uint8_t profileNumber_;
+
+	public:
+		constexpr profileView_t(const uint8_t profileNumber) noexcept : profileNumber_{profileNumber} { }
+
+		bool valid() const noexcept;
+		uint8_t number() const noexcept { return profileNumber_; }
+		uint8_t debounce() const noexcept;
+		debounceMode_t debounceMode() const noexcept;
+		scanRate_t scanRate() const noexcept;
+		effect_t effect() const noexcept;
+		rgb_t keyColour(uint8_t index) const noexcept;
+		// The key's press/release times, debounce mode and scancode in one go
+		key_t key(uint8_t index) const noexcept;
+		bool keyType(uint8_t index) const noexcept;
 	};
 } // namespace mxKeyboard::profile
 
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef RING_BUFFER__HXX
+#define RING_BUFFER__HXX
+
+#include <cstdint>
+#include <array>
+#include <avr/cpufunc.h>
+
+/*!
+ * Fixed size single-producer, single-consumer queue. Only the producer writes tail_
+ * and only the consumer writes head_, and as both are single bytes, the two sides may
+ * run at different interrupt levels (or one in the main loop) without locking.
+ * The indices free-run and are masked on use, so N must be a power of 2 no more than 128.
+ */
+template<typename T, uint8_t N> struct ringBuffer_t final
+{
+private:
+	static_assert(N && !(N & (N - 1U)), "ringBuffer_t size must be a power of 2");
+	static_assert(N <= 128U, "ringBuffer_t indices must be able to tell full from empty");
+	constexpr static uint8_t mask{N - 1U};
+
+	std::array<T, N> entries_{};
+	volatile uint8_t head_{0};
+	volatile uint8_t tail_{0};
+
+public:
+	constexpr static uint8_t capacity() noexcept { return N; }
+	uint8_t size() const noexcept { return uint8_t(tail_ - head_); }
+	bool empty() const noexcept { return head_ == tail_; }
+	bool full() const noexcept { return size() == N; }
+
+	// Producer side: returns false, leaving the queue untouched, if there is no space
+	bool push(const T &value) noexcept
+	{
+		const uint8_t tail{tail_};
+		if (uint8_t(tail - head_) == N)
+			return false;
+		entries_[tail & mask] = value;
+		// The entry must be complete before the consumer can see it
+		_MemoryBarrier();
+		tail_ = uint8_t(tail + 1U);
+		return true;
+	}
+
+	// Producer side: the most recently pushed entry, only valid when not empty
+	T &back() noexcept { return entries_[uint8_t(tail_ - 1U) & mask]; }
+
+	// Consumer side: the oldest entry, only valid when not empty
+	T &front() noexcept { return entries_[head_ & mask]; }
+	const T &front() const noexcept { return entries_[head_ & mask]; }
+
+	// Consumer side
+	void pop() noexcept
+	{
+		// Finish with the entry before handing its slot back to the producer
+		_MemoryBarrier();
+		head_ = uint8_t(head_ + 1U);
+	}
+
+	// Only safe while neither side can run, such as during (re)initialisation
+	void clear() noexcept
+	{
+		head_ = 0;
+		tail_ = 0;
+	}
+};
+
+#endif /*RING_BUFFER__HXX*/
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef SCAN_TIMER__HXX
+#define SCAN_TIMER__HXX
+
+#include <cstdint>
+#include <array>
+
+/*!
+ * Scheduling of the matrix scan (TCD0 → keyIRQ) and key-to-host latency measurement.
+ *
+ * TCD0 fires keyIRQ at 1, 2, 4 or 8kHz as selected by scanRate_t. Free-running, it has no
+ * relation to the host's 1ms frames.
+ * With start-of-frame sync enabled, each USB SOF re-phases TCD0 so the scan fires
+ * leadTime microseconds before the next SOF (with higher rates still scanning evenly through
+ * the frame), leaving the report freshly queued when the host's next IN token arrives.
+ *
+ * TCD1 free-runs from clkPER/64 (4us per tick) as a timestamp source. Edges are stamped
+ * with the start of the keyIRQ scan that finished debouncing them, and the time from there
+ * until the IN transfer carrying them completes is collected into latencyHistogram_t.
+ */
+
+namespace mxKeyboard::scanTimer
+{
+	constexpr static uint16_t microsecondsPerTimestampTick{4U};
+	constexpr static uint8_t latencyBucketWidth{32U}; // Timestamp ticks, so 128us
+	constexpr static uint8_t latencyBucketCount{32U};
+
+	// Scan rates as log2 of the number of scans per millisecond
+	enum class scanRate_t : uint8_t
+	{
+		rate1kHz = 0U,
+		rate2kHz = 1U,
+		rate4kHz = 2U,
+		rate8kHz = 3U
+	};
+
+	// The last bucket also counts every latency past the end of the histogram
+	struct latencyHistogram_t final
+	{
+		std::array<uint16_t, latencyBucketCount> buckets{};
+	};
+
+	extern void init() noexcept;
+	extern void scanRate(scanRate_t rate) noexcept;
+	extern scanRate_t scanRate() noexcept;
+	extern uint8_t scansPerMillisecond() noexcept;
+	extern bool scanOverrun() noexcept;
+	extern void sofSync(bool enable) noexcept;
+	extern bool sofSync() noexcept;
+	extern void leadTime(uint16_t microseconds) noexcept;
+	extern uint16_t leadTime() noexcept;
+	extern void startOfFrame() noexcept;
+
+	extern uint16_t timestamp() noexcept;
+	extern void recordLatency(uint16_t edgeTimestamp) noexcept;
+	extern latencyHistogram_t latencyHistogram() noexcept;
+	extern void resetLatencyHistogram() noexcept;
+} // namespace mxKeyboard::scanTimer
+
+#endif /*SCAN_TIMER__HXX*/
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#ifndef TIMING__HXX
+#define TIMING__HXX
+
+#include <cstdint>
+#include <array>
+#include <avr/io.h>
+
+/*!
+ * ISR cycle instrumentation for the simulator benchmark (meson -Disr_timing=true).
+ * No simulator models the ATxmega256A3U yet, so the same statistics are also handed to the
+ * host by the getISRTimings and getCopyTimings vendor requests, to be read from a keyboard.
+ *
+ * TCE0 free-runs from clkPER/1, which is the CPU clock, so the difference between
+ * two reads is a cycle count. The statistics and the synthetic matrix input have C
+ * linkage so scripts/isr_cycles.py can find them in the ELF and poke at them via GDB.
+ * Timings are inclusive: a tcc0OverflowIRQ pre-empted by keyIRQ includes its cycles.
+ * The matrix still reads through from PORTF too, so the keyboard keeps working on hardware.
+ *
+ * timeCopies() also times memory::copy(), memory::fill() and dmaCopy() once at start-up,
+ * with interrupts still off, for each of copySizes into copyTimings.
+ */
+
+namespace mxKeyboard::timing
+{
+	struct isrTiming_t final
+	{
+		uint16_t min{UINT16_MAX};
+		uint16_t max{0};
+		uint32_t total{0};
+		uint16_t count{0};
+
+		void record(const uint16_t cycles) noexcept
+		{
+			if (cycles < min)
+				min = cycles;
+			if (cycles > max)
+				max = cycles;
+			total += cycles;
+			++count;
+		}
+	};
+
+	constexpr static std::array<uint16_t, 4> copySizes{{8U, 64U, 512U, 4096U}};
+
+	// Cycles taken to copy or fill one of copySizes; dmaCopy runs from the request to the block completing
+	struct copyTiming_t final
+	{
+		uint16_t copy;
+		uint16_t fill;
+		uint16_t dmaCopy;
+	};
+
+	enum class isr_t : uint8_t
+	{
+		keyScan,
+		ledFrame
+	};
+
+	// The matrix is read from rows[] as well as PORTF. If chatter is set, each read
+	// is XOR'd with the next value of an LFSR; if toggle is set, rows[] are only
+	// presented for toggle scans out of every 2 * toggle, simulating repeated presses.
+	struct timingInput_t final
+	{
+		uint8_t chatter;
+		uint8_t toggle;
+		std::array<uint8_t, 21> rows;
+	};
+} // namespace mxKeyboard::timing
+
+#ifdef MXKEYBOARD_ISR_TIMING
+extern "C" std::array<mxKeyboard::timing::isrTiming_t, 2> isrTimings;
+extern "C" mxKeyboard::timing::timingInput_t timingInput;
+extern "C" std::array<mxKeyboard::timing::copyTiming_t, mxKeyboard::timing::copySizes.size()> copyTimings;
+
+namespace mxKeyboard::timing
+{
+	extern void timingInit() noexcept;
+	extern uint8_t sampleRows(uint8_t column) noexcept;
+	extern void scanComplete() noexcept;
+	extern void timeCopies() noexcept;
+
+	struct scope_t final
+	{
+	private:
+		isrTiming_t &timing_;
+		uint16_t start_;
+
+	public:
+		scope_t(const isr_t isr) noexcept : timing_{isrTimings[uint8_t(isr)]}, start_{TCE0.CNT} { }
+		~scope_t() noexcept { timing_.record(uint16_t(TCE0.CNT - start_)); }
+		scope_t(const scope_t &) = delete;
+		scope_t(scope_t &&) = delete;
+		scope_t &operator =(const scope_t &) = delete;
+		scope_t &operator =(scope_t &&) = delete;
+	};
+} // namespace mxKeyboard::timing
+#else
+namespace mxKeyboard::timing
+{
+	inline void timingInit() noexcept { }
+	inline uint8_t sampleRows(uint8_t) noexcept { return PORTF.IN; }
+	inline void scanComplete() noexcept { }
+	inline void timeCopies() noexcept { }
+
+	struct scope_t final
+	{
+		constexpr scope_t(isr_t) noexcept { }
+	};
+} // namespace mxKeyboard::timing
+#endif
+
+#endif /*TIMING__HXX*/
@@ -17,12 +17,81 @@ namespace usb::hid
 		std::array<scancode_t, 6> keyCodes{{}};
 	};
 
+	// The N-key rollover report covers every usage up to and including keypadEquals
+	constexpr static uint8_t nkroUsageCount{uint8_t(scancode_t::keypadEquals) + 1U};
+
+	struct nkroReport_t final
+	{
+		uint8_t modifier{};
+		std::array<uint8_t, nkroUsageCount / 8U> keys{{}};
+	};
+
+	static_assert(nkroUsageCount % 8U == 0U);
+	static_assert(sizeof(nkroReport_t) <= epBufferSize);
+
+	// Values for SET_PROTOCOL and GET_PROTOCOL from the HID 1.11 specification
+	enum class protocol_t : uint8_t
+	{
+		boot = 0U,
+		report = 1U
+	};
+
+	/*!
+	 * Vendor requests to the keyboard interface for configuring it from the host. getProfile
+	 * returns the active profile number in one byte, and setProfile switches to the profile
+	 * given in wValue, stalling if there can be no such profile.
+	 *
+	 * getLatency returns the key to host latency histogram (see scanTimer.hxx), clearing it
+	 * afterwards if wValue is 1. getScanSync returns whether scans are synced to the host's
+	 * start of frame in one byte followed by the lead time in microseconds, which setSOFSync
+	 * (wValue 0 or 1) and setLeadTime (wValue in microseconds) set. getScanStats returns the
+	 * keyMatrix::scanStats_t counters, clearing them afterwards if wValue is 1. In isr_timing
+	 * builds, getISRTimings returns the isrTimings cycle counts (see timing.hxx), clearing them
+	 * afterwards if wValue is 1, and getCopyTimings the copyTimings. getFrameStats returns the
+	 * ledEffects::frameStats_t render timings, clearing them afterwards if wValue is 1. Requests for data stall
+	 * unless wLength is exactly the size of the reply.
+	 */
+	enum class vendorRequest_t : uint8_t
+	{
+		getProfile = 0x01U,
+		setProfile = 0x02U,
+		getLatency = 0x03U,
+		getScanSync = 0x04U,
+		setSOFSync = 0x05U,
+		setLeadTime = 0x06U,
+		getScanStats = 0x07U,
+		getISRTimings = 0x08U,
+		getCopyTimings = 0x09U,
+		getFrameStats = 0x0AU
+	};
+
+	struct [[gnu::packed]] scanSync_t final
+	{
+		uint8_t sofSync{0};
+		uint16_t leadTime{0};
+	};
+
+	// How far the queue of reports waiting to go to the host got, and how often it overflowed
+	struct reportStats_t final
+	{
+		uint16_t overflows{0};
+		uint8_t maxDepth{0};
+	};
+
 	extern const hidDescriptor_t usbKeyboardDesc;
 	extern const std::array<reportDescriptor_t, hidReportDescriptorCount> usbKeyboardReportDesc;
 
 	extern void keyPress(scancode_t key) noexcept;
 	extern void keyRelease(scancode_t key) noexcept;
 	extern void handleReport() noexcept;
+	/*!
+	 * Notes when the key change about to be applied by the next keyPress() or keyRelease() was
+	 * detected, for latency measurement. The stamp only goes with that one call, and only counts
+	 * if the call changes the report.
+	 */
+	extern void keyEdge(uint16_t timestamp) noexcept;
+	extern reportStats_t reportStats() noexcept;
+	extern void resetReportStats() noexcept;
 
 	extern void registerHandlers(uint8_t inEP, uint8_t interface, uint8_t config) noexcept;
 } // namespace usb::hid
@@ -1,8 +1,9 @@
 // SPDX-License-Identifier: BSD-3-Clause
 #include <cstdint>
 #include <array>
-#include <substrate/indexed_iterator>
+#include <algorithm>
 #include <substrate/index_sequence>
+#include <avr/builtins.h>
 #include <avr/cpufunc.h>
 #include "MXKeyboard.hxx"
 #include "interrupts.hxx"
@@ -10,6 +11,10 @@
 #include "mask.hxx"
 #include "led.hxx"
 #include "profile.hxx"
+#include "ledEffects.hxx"
+#include "ringBuffer.hxx"
+#include "scanTimer.hxx"
+#include "timing.hxx"
 #include "usb/hid.hxx"
 
 /*!
@@ -19,16 +24,152 @@
 
 using namespace mxKeyboard::keyMatrix;
 using mxKeyboard::profile::profile_t;
+using mxKeyboard::profile::profileView_t;
+using mxKeyboard::profile::keyReader_t;
+using mxKeyboard::profile::storedKey_t;
+using mxKeyboard::profile::profileCount;
+using mxKeyboard::scanTimer::scanRate_t;
 
 constexpr static const auto columnMask{genMask<std::uint8_t, 0U, 5U>()};
 constexpr static const auto rowMask{genMask<std::uint8_t, 0U, 6U>()};
 
-static profile_t profile{};
+#ifdef MXKEYBOARD_VERTICAL_DEBOUNCE
+constexpr static bool verticalDebounce{true};
+#else
+constexpr static bool verticalDebounce{false};
+#endif
+
+using mxKeyboard::layout::columnCount;
+using mxKeyboard::layout::rowCount;
+using mxKeyboard::layout::noLED;
+using mxKeyboard::layout::populatedRows;
+using mxKeyboard::layout::scanColumns;
+
+constexpr static uint8_t noKey{0xFFU};
+constexpr static uint8_t noProfile{0xFFU};
+// How many keys one step of a profile switch brings over, keeping each step well inside a scan period
+constexpr static uint8_t switchBatch{8U};
+
+constexpr static const auto &keys{mxKeyboard::layout::flashMatrix};
+
+struct columnDebounce_t final
+{
+	uint8_t state{0};
+	uint8_t count0{0};
+	uint8_t count1{0};
+	uint8_t pending{0};
+	// Rows whose keys take presses (or both edges) straight from the raw sample
+	uint8_t eagerPress{0};
+	uint8_t eagerBoth{0};
+};
+
+// Raw row snapshot from the last scan and the rows with key state still in flux
+struct columnScan_t final
+{
+	uint8_t previous{0};
+	uint8_t pending{0};
+};
+
+// The profile's press/release times for a key in milliseconds, to reload its timers from
+struct keyTiming_t final
+{
+	uint8_t timePress{0};
+	uint8_t timeRelease{0};
+};
+
+// A key whose state keyIRQ changed, for the main loop to pass on to the LEDs and usb::hid
+struct keyEvent_t final
+{
+	uint8_t key;
+	state_t state;
+	// When the scan that completed the change started, for latency measurement
+	uint16_t timestamp;
+};
+
+// Just what keyIRQ needs of the profile, rather than a whole profile_t
+static uint8_t debounceTime{0};
+static std::array<keyTiming_t, keyCount> keyTimings{};
 static std::array<keyState_t, keyCount> keyStates{{}};
+static std::array<keyInfo_t, keyCount> keyInfo{{}};
+// Only takes up space when the vertical counter debounce engine is in use
+static std::array<columnDebounce_t, verticalDebounce ? columnCount : 0U> columnDebounce{};
+static std::array<columnScan_t, verticalDebounce ? 0U : columnCount> columnScan{};
+static scanStats_t stats{};
+static ringBuffer_t<keyEvent_t, 32> keyEvents{};
+// Set from the USB interrupt when the host changes the lock key states
+static volatile bool lockKeysChanged{false};
+static uint16_t scanTimestamp{};
+// Start of the current achieved scan rate measurement window, which is 256 scans long
+static uint16_t rateWindowStart{};
+static uint8_t rateWindowScans{};
+static uint16_t rateWindowTicks{};
+// Scans since the vertical counters were last clocked, which happens once a millisecond
+static uint8_t debounceScans{};
 
 static keyState_t *numLock;
 static keyState_t *capsLock;
 static keyState_t *scrollLock;
+// The held keys that make the number keys select profiles
+static keyState_t *profileControl;
+static keyState_t *profileMenu;
+
+static uint8_t activeProfile_{0};
+// Set by selectProfile(), possibly from the USB interrupt, for dispatchKeyEvents() to switch to
+static volatile uint8_t requestedProfile{noProfile};
+// The profile being switched to a step at a time, and whether the switch changed how much the key timers are worth
+static keyReader_t switchReader{noProfile};
+static bool switching{false};
+static bool switchRetime{false};
+// The number key that selected a profile, whose release mustn't reach the host either
+static uint8_t chordKey{noKey};
+
+static void reloadTimers(keyState_t &key, const uint8_t index) noexcept
+{
+	// Convert from the profile's milliseconds to scans at the current scan rate
+	const auto scale{mxKeyboard::scanTimer::scansPerMillisecond()};
+	const auto &timing{keyTimings[index]};
+	key.debounce = uint16_t(debounceTime * scale);
+	key.timePress = uint16_t(timing.timePress * scale);
+	key.timeRelease = uint16_t(timing.timeRelease * scale);
+}
+
+static uint8_t keyIndex(const keyState_t &key) noexcept
+	{ return static_cast<uint8_t>(&key - keyStates.data()); }
+
+static void reloadTimers(keyState_t &key) noexcept
+	{ reloadTimers(key, keyIndex(key)); }
+
+static debounceMode_t debounceModeFor(const debounceMode_t keyMode, const debounceMode_t profileMode) noexcept
+{
+	auto mode{keyMode};
+	if (mode == debounceMode_t::profileDefault)
+		mode = profileMode;
+	// Guard against erased or otherwise invalid profile data by falling back to the safe mode
+	if (mode != debounceMode_t::eagerPress && mode != debounceMode_t::eagerBoth)
+		mode = debounceMode_t::deferred;
+	return mode;
+}
+
+// Points the vertical counters' eager rows at the key's debounce mode
+static void eagerRows(const uint8_t index, const debounceMode_t mode) noexcept
+{
+	const auto mask{uint8_t(1U << (index % rowCount))};
+	auto &counter{columnDebounce[index / rowCount]};
+	counter.eagerPress &= uint8_t(~mask);
+	counter.eagerBoth &= uint8_t(~mask);
+	if (mode == debounceMode_t::eagerPress)
+		counter.eagerPress |= mask;
+	else if (mode == debounceMode_t::eagerBoth)
+		counter.eagerBoth |= mask;
+}
+
+static void writeDefaultProfile() noexcept
+{
+	mxKeyboard::profile::writeDefault(0, {1, debounceMode_t::deferred, scanRate_t::rate1kHz,
+		mxKeyboard::ledEffects::effect_t::staticColour, {0x1FU, 0x1FU, 0xFFU}});
+	// Key setup reads the profile back, so let the save finish
+	profile_t::waitForSave();
+}
 
 void keyInit() noexcept
 {
@@ -46,57 +187,55 @@ void keyInit() noexcept
 	PORTF.DIRCLR = rowMask;
 	PORTF.OUTCLR = ~rowMask;
 
-	TCD0.CTRLA = TC_CLKSEL_DIV4_gc; // Use fPER/4
-	TCD0.CTRLB = TC_WGMODE_NORMAL_gc;
-	TCD0.CTRLE = TC_BYTEM_NORMAL_gc;
-	TCD0.INTCTRLA = TC_OVFINTLVL_HI_gc;
-	TCD0.CTRLFCLR = 0x0FU;
-	TCD0.CTRLFSET = TC_CMD_UPDATE_gc;
-	TCD0.PERBUF = 10000; // 1MHz / 1kHz = 5000
-	TCD0.CNT = 0;
+	// Set up the scan timer
+	mxKeyboard::scanTimer::init();
 
 	// Enable normal lds/sts access to the EEPROM
 	NVM.CTRLB |= NVM_EEMAPEN_bm;
 
-	profile = profile_t::read(0);
-	if (!profile.valid(0))
-	{
-		profile.clear();
-		profile.number(0);
-		profile.debounce(1);
+	mxKeyboard::profile::checkProfiles();
+	if (!profileView_t{0}.valid())
+		writeDefaultProfile();
 
-		for (const auto &index : substrate::indexSequence_t{keyCount})
-		{
-			const auto i{static_cast<uint8_t>(index)};
-			const key_t key = keys[i];
-			profile.keyColour(i, {0x1FU, 0x1FU, 0xFFU});
-			profile.timePress(i, 0);
-			profile.timePress(i, 0);
-			profile.scancode(i, key.usbScancode);
-
-			if (key.usbScancode == usbScancode_t::numLock || key.usbScancode == usbScancode_t::capsLock ||
-				key.usbScancode == usbScancode_t::scrollLock)
-				profile.keyType(i, keyType_t::latching);
-		}
-		profile.write();
-	}
+	// Nothing is being saved by now, so the reader gets everything it asks for
+	keyReader_t profile{0};
+	profile.fill();
+	// This must be done before the key timers get loaded as they are scaled by the scan rate
+	mxKeyboard::scanTimer::scanRate(profile.scanRate());
+	ledHighlightColour(0x00, 0xFF, 0x00);
+	mxKeyboard::ledEffects::effect(profile.effect());
+	debounceTime = profile.debounce();
+	const auto profileDebounceMode{profile.debounceMode()};
 
-	// Pull the initial key state information from flash
-	for (const auto &[index, keyState] : substrate::indexedIterator_t{keyStates})
+	// Pull the initial key state information from the profile, decoding it a key at a time
+	for (const auto &index : substrate::indexSequence_t{keyCount})
 	{
 		const auto i{static_cast<uint8_t>(index)};
-		const key_t key = keys[i];
+		storedKey_t stored{};
+		while (!profile.next(stored))
+			profile.fill();
+		const auto key{*keys[i]};
+		const auto &settings{stored.key};
+		auto &keyState{keyStates[i]};
+		keyTimings[i] = {settings.timePress, settings.timeRelease};
 		keyState.state = {};
-		keyState.debounce = profile.debounce();
-		keyState.timePress = profile.timePress(i);
-		keyState.timeRelease = profile.timeRelease(i);
-		keyState.ledIndex = key.ledIndex;
-		keyState.ledColour = profile.keyColour(i);
-		keyState.usbScancode = profile.scancode(i);
-		keyState.state.keyType(profile.keyType(i) ? keyType_t::latching : keyType_t::momentary);
+		reloadTimers(keyState, i);
+		keyState.lockout = 0;
+		keyState.state.debounceMode(debounceModeFor(static_cast<debounceMode_t>(settings.debounceMode),
+			profileDebounceMode));
+		keyState.state.keyType(stored.latching ? keyType_t::latching : keyType_t::momentary);
+		keyInfo[i] = {key.ledIndex, settings.scancode};
+
+		if constexpr (verticalDebounce)
+			eagerRows(i, keyState.state.debounceMode());
 
-		if (key.ledIndex != 255)
-			ledSetValue(key.ledIndex, keyState.ledColour.r, keyState.ledColour.g, keyState.ledColour.b);
+		if (key.ledIndex != noLED)
+		{
+			const auto &colour{stored.colour};
+			ledCacheColour(key.ledIndex, colour.r, colour.g, colour.b);
+			ledRestoreColour(key.ledIndex);
+			mxKeyboard::ledEffects::keyLED(key.ledIndex, uint8_t(i / rowCount), uint8_t(i % rowCount), colour);
+		}
 
 		if (key.usbScancode == usbScancode_t::numLock)
 			numLock = &keyState;
@@ -104,19 +243,176 @@ void keyInit() noexcept
 			capsLock = &keyState;
 		else if (key.usbScancode == usbScancode_t::scrollLock)
 			scrollLock = &keyState;
+		else if (key.usbScancode == usbScancode_t::rightControl)
+			profileControl = &keyState;
+		else if (key.usbScancode == usbScancode_t::application)
+			profileMenu = &keyState;
+	}
+}
+
+/*!
+ * Brings one key from the active profile to the target one, touching only what differs. Keys
+ * part way through an edge keep their timers and pick up the new ones once it completes, and
+ * a latching key's logical state is left to be put right by its next edge.
+ */
+static void switchKey(const uint8_t index, const mxKeyboard::profile::key_t &stored, const rgb_t colour,
+	const keyType_t type, const debounceMode_t profileMode, const bool retime) noexcept
+{
+	auto &keyState{keyStates[index]};
+	auto &info{keyInfo[index]};
+	if (stored.scancode != info.usbScancode)
+	{
+		// Let go of the old scancode so a key held through the switch isn't left down on the host
+		if (keyState.state.physicalState())
+			usb::hid::keyRelease(info.usbScancode);
+		info.usbScancode = stored.scancode;
+	}
+
+	const keyTiming_t timing{stored.timePress, stored.timeRelease};
+	const auto mode{debounceModeFor(static_cast<debounceMode_t>(stored.debounceMode), profileMode)};
+	auto &currentTiming{keyTimings[index]};
+	if (retime || timing.timePress != currentTiming.timePress || timing.timeRelease != currentTiming.timeRelease ||
+		mode != keyState.state.debounceMode() || type != keyState.state.keyType())
+	{
+		// keyIRQ reads all of these, so keep it out while the key is inconsistent
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		currentTiming = timing;
+		keyState.state.debounceMode(mode);
+		keyState.state.keyType(type);
+		if (!keyState.state.dirty() && !keyState.lockout)
+			reloadTimers(keyState, index);
+		if constexpr (verticalDebounce)
+			eagerRows(index, mode);
+		SREG = sreg;
+	}
+
+	const auto led{info.ledIndex};
+	if (led == noLED)
+		return;
+	const auto current{mxKeyboard::ledEffects::keyColour(led)};
+	if (colour.r == current.r && colour.g == current.g && colour.b == current.b)
+		return;
+	ledCacheColour(led, colour.r, colour.g, colour.b);
+	// Leave the highlight on a pressed key be, it gets the new colour on release
+	if (!keyState.state.logicalState())
+		ledRestoreColour(led);
+	mxKeyboard::ledEffects::keyLED(led, uint8_t(index / rowCount), uint8_t(index % rowCount), colour);
+}
+
+/*!
+ * Starts switching to another stored profile, which switchStep() then works through. Asking for
+ * another profile part way through a switch starts over towards that one.
+ */
+static void switchProfile(const uint8_t profileNumber) noexcept
+{
+	if (profileNumber == (switching ? switchReader.number() : activeProfile_) || !profileView_t{profileNumber}.valid())
+		return;
+	switchReader = keyReader_t{profileNumber};
+	switching = true;
+}
+
+/*!
+ * Does the next step of a profile switch: one read of the target profile, or bringing the next
+ * switchBatch keys over to it, comparing each against what the active profile set up and applying
+ * only the differences. A step at a time per main loop pass keeps keyIRQ's events and USB reports
+ * moving however big the profile, and waits out any save in progress rather than blocking on it.
+ * Keys part way through keep working throughout, some with the old profile's settings.
+ */
+static void switchStep() noexcept
+{
+	if (!switching)
+		return;
+	auto &profile{switchReader};
+	// A save can move the target's slots about, so go through it again - keys already switched are left as they are
+	if (profile.stale())
+		profile = keyReader_t{profile.number()};
+
+	if (!profile.headRead())
+	{
+		if (!profile.fill())
+			return;
+		if (!profile.valid())
+		{
+			switching = false;
+			return;
+		}
+		// Either of these changes how many scans every key's timers are worth
+		const auto rate{profile.scanRate()};
+		if (rate != mxKeyboard::scanTimer::scanRate())
+		{
+			mxKeyboard::scanTimer::scanRate(rate);
+			switchRetime = true;
+		}
+		const auto debounce{profile.debounce()};
+		if (debounce != debounceTime)
+		{
+			debounceTime = debounce;
+			switchRetime = true;
+		}
+		const auto effect{profile.effect()};
+		if (effect != mxKeyboard::ledEffects::effect())
+			mxKeyboard::ledEffects::effect(effect);
+		return;
 	}
+
+	for (uint8_t count{0}; count < switchBatch && profile.index() < keyCount; ++count)
+	{
+		const auto index{profile.index()};
+		storedKey_t stored{};
+		if (!profile.next(stored))
+		{
+			profile.fill();
+			return;
+		}
+		switchKey(index, stored.key, stored.colour, stored.latching ? keyType_t::latching : keyType_t::momentary,
+			profile.debounceMode(), switchRetime);
+	}
+	if (profile.index() < keyCount)
+		return;
+	activeProfile_ = profile.number();
+	switching = false;
+	switchRetime = false;
+}
+
+/*!
+ * Holding Right Control + Menu and pressing 1-9 or 0 selects profiles 1-9 or 0. The number key
+ * is kept from the host, press and release both, returning true if the event was used up.
+ */
+static bool profileChord(const uint8_t index, const state_t state) noexcept
+{
+	if (index == chordKey)
+	{
+		if (!state.physicalState())
+			chordKey = noKey;
+		return true;
+	}
+	if (!state.physicalState() || !profileControl || !profileMenu ||
+		!profileControl->state.physicalState() || !profileMenu->state.physicalState())
+		return false;
+
+	// Go by the layout rather than the profile so a remapped key can't lock the chord out
+	const auto scancode{(*keys[index]).usbScancode};
+	if (scancode < usbScancode_t::_1 || scancode > usbScancode_t::_0)
+		return false;
+	chordKey = index;
+	switchProfile(uint8_t((uint8_t(scancode) - uint8_t(usbScancode_t::_1) + 1U) % 10U));
+	return true;
 }
 
 namespace mxKeyboard::keyMatrix
 {
-	void updateKey(keyState_t &key)
+	static void updateKey(const uint8_t index, const state_t state) noexcept
 	{
-		if (key.state.logicalState())
-			ledSetValue(key.ledIndex, 0x00, 0xFF, 0x00);
+		const auto &key{keyInfo[index]};
+		// Tell the effects engine first so it doesn't paint over the highlight
+		ledEffects::keyPressed(key.ledIndex, state.logicalState());
+		if (state.logicalState())
+			ledHighlight(key.ledIndex);
 		else
-			ledSetValue(key.ledIndex, key.ledColour.r, key.ledColour.g, key.ledColour.b);
+			ledRestoreColour(key.ledIndex);
 
-		if (key.state.physicalState())
+		if (state.physicalState())
 			usb::hid::keyPress(key.usbScancode);
 		else
 			usb::hid::keyRelease(key.usbScancode);
@@ -140,76 +436,299 @@ namespace mxKeyboard::keyMatrix
 		if (key)
 		{
 			key->state.logicalState(pressed);
-			updateKey(*key);
+			// The LEDs and usb::hid belong to the main loop, so leave it to dispatchKeyEvents() to apply
+			lockKeysChanged = true;
 		}
 	}
-}
 
-void keyIRQ() noexcept
-{
-	for (uint8_t column{0}; column < 21; ++column)
+	void dispatchKeyEvents() noexcept
 	{
-		PORTA.OUT = column;
-		// This waits for the propergation delays in the 3-to-8 decoders so the PORTF read is valid
-		for (volatile uint8_t wait{0}; wait < 1; ++wait)
-			continue;
-		const auto pressStates = PORTF.IN;
-		for (uint8_t row{0}; row < 6; ++row)
+		while (!keyEvents.empty())
 		{
-			const auto switchState{bool((pressStates >> row) & 1U)};
-			auto &key{keyStates[(column * 6) + row]};
-			if (key.ledIndex == 255)
+			const auto event{keyEvents.front()};
+			keyEvents.pop();
+			if (profileChord(event.key, event.state))
 				continue;
+			usb::hid::keyEdge(event.timestamp);
+			updateKey(event.key, event.state);
+		}
 
-			if (key.state.physicalState() == switchState)
+		if (lockKeysChanged)
+		{
+			lockKeysChanged = false;
+			for (const auto *const key : {numLock, capsLock, scrollLock})
 			{
-				if (key.state.dirty())
-				{
-					key.debounce = 0;
-					key.timePress = 0;
-					key.timeRelease = 0;
-					key.state.dirty(false);
-					updateKey(key);
-				}
+				if (key)
+					updateKey(keyIndex(*key), key->state);
 			}
-			else
-			{
-				uint8_t timerCount{0};
+		}
+
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		const uint8_t profileNumber{requestedProfile};
+		requestedProfile = noProfile;
+		SREG = sreg;
+		if (profileNumber != noProfile)
+			switchProfile(profileNumber);
+		switchStep();
+	}
+
+	bool selectProfile(const uint8_t profileNumber) noexcept
+	{
+		if (profileNumber >= profileCount)
+			return false;
+		requestedProfile = profileNumber;
+		return true;
+	}
+
+	uint8_t activeProfile() noexcept { return activeProfile_; }
+
+	bool idle() noexcept
+	{
+		if (!keyEvents.empty())
+			return false;
+		// A column with nothing closed, pending or mid-count has nothing left for the scan to report
+		if constexpr (verticalDebounce)
+			return std::all_of(columnDebounce.begin(), columnDebounce.end(), [](const columnDebounce_t &column) noexcept
+				{ return !(column.state | column.pending | column.count0 | column.count1); });
+		else
+			return std::all_of(columnScan.begin(), columnScan.end(), [](const columnScan_t &column) noexcept
+				{ return !(column.previous | column.pending); });
+	}
+
+	scanStats_t scanStats() noexcept
+	{
+		// The counters are updated from keyIRQ, so keep it out while we take a consistent copy
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		auto result{stats};
+		const auto windowTicks{rateWindowTicks};
+		SREG = sreg;
+
+		// 256 scans in windowTicks timestamp ticks
+		constexpr uint32_t ticksPerSecond{1000000U / mxKeyboard::scanTimer::microsecondsPerTimestampTick};
+		if (windowTicks)
+			result.achievedRate = uint16_t((256U * ticksPerSecond) / windowTicks);
+		return result;
+	}
+
+	void resetScanStats() noexcept
+	{
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		stats = {};
+		SREG = sreg;
+	}
+}
+
+// Latch the new switch state into the key, completing the edge
+static void completeEdge(keyState_t &key, const bool switchState) noexcept
+{
+	key.state.physicalState(switchState);
+	// If the key is momentary, update it with the current real state
+	if (key.state.keyType() == keyType_t::momentary)
+		key.state.logicalState(switchState);
+	// Else invert the logical state as we are completing a key press
+	else if (switchState) // keyType_t::latching
+		key.state.logicalState(!key.state.logicalState());
+}
+
+static bool eagerEdge(const keyState_t &key, const bool switchState) noexcept
+{
+	const auto mode{key.state.debounceMode()};
+	return mode == debounceMode_t::eagerBoth || (mode == debounceMode_t::eagerPress && switchState);
+}
+
+// Queues the key's new state for dispatchKeyEvents(), returning false if the queue is full
+static bool queueKeyEvent(const keyState_t &key) noexcept
+{
+	if (keyEvents.push({keyIndex(key), key.state, scanTimestamp}))
+		return true;
+	++stats.eventsDeferred;
+	return false;
+}
+
+static void updateKeyState(keyState_t &key, const bool switchState) noexcept
+{
+	// An eager edge was just reported, so ignore the switch bouncing until the lockout expires
+	if (key.lockout)
+	{
+		--key.lockout;
+		return;
+	}
+
+	if (key.state.physicalState() == switchState)
+	{
+		// Keys stay dirty until their new state has made it into the event queue
+		if (key.state.dirty() && queueKeyEvent(key))
+		{
+			reloadTimers(key);
+			key.state.dirty(false);
+		}
+	}
+	else
+	{
+		if (eagerEdge(key, switchState))
+		{
+			// Report the edge now and spend the debounce window locked out instead of waiting it out
+			completeEdge(key, switchState);
+			key.lockout = uint16_t(key.debounce + (switchState ? key.timePress : key.timeRelease));
+			// If the queue is full, leave the key dirty to try again once the lockout expires
+			if (!queueKeyEvent(key))
 				key.state.dirty(true);
+			return;
+		}
+
+		uint16_t timerCount{0};
+		key.state.dirty(true);
 
-				if (key.debounce)
-				{
-					--key.debounce;
-					continue;
-				}
-				else if (key.state.keyType() == keyType_t::momentary)
-				{
-					if (switchState)
-						timerCount = key.timePress--;
-					else
-						timerCount = key.timeRelease--;
-				}
-				else if (switchState) // keyType_t::latching
-				{
-					// If the latching key is currently considered pressed
-					if (key.state.logicalState())
-						timerCount = key.timeRelease--;
-					else
-						timerCount = key.timePress--;
-				}
-				// If the timer for the key expired
-				if (!timerCount)
-				{
-					key.state.physicalState(switchState);
-					// If the key is momentary, update it with the current real state
-					if (key.state.keyType() == keyType_t::momentary)
-						key.state.logicalState(switchState);
-					// Else invert the logical state as we are completing a key press
-					else if (switchState) // keyType_t::latching
-						key.state.logicalState(!key.state.logicalState());
-				}
+		// The vertical counters have already debounced the input we're given
+		if constexpr (!verticalDebounce)
+		{
+			if (key.debounce)
+			{
+				--key.debounce;
+				return;
 			}
 		}
+
+		if (key.state.keyType() == keyType_t::momentary)
+		{
+			if (switchState)
+				timerCount = key.timePress--;
+			else
+				timerCount = key.timeRelease--;
+		}
+		else if (switchState) // keyType_t::latching
+		{
+			// If the latching key is currently considered pressed
+			if (key.state.logicalState())
+				timerCount = key.timeRelease--;
+			else
+				timerCount = key.timePress--;
+		}
+		// If the timer for the key expired
+		if (!timerCount)
+			completeEdge(key, switchState);
+	}
+}
+
+/*!
+ * Only the rows whose raw state changed since the last scan, or which are still
+ * debouncing, running their press/release timers or locked out, need visiting. A column with
+ * none of those is skipped entirely, returning false.
+ */
+static bool scanColumn(const uint8_t column, const uint8_t pressStates) noexcept
+{
+	auto &scan{columnScan[column]};
+	const auto rows{uint8_t((pressStates ^ scan.previous) | scan.pending)};
+	scan.previous = pressStates;
+	if (!rows)
+		return false;
+
+	auto *const keys{&keyStates[column * rowCount]};
+	uint8_t pending{0};
+	for (uint8_t row{0}; row < rowCount; ++row)
+	{
+		const auto mask{uint8_t(1U << row)};
+		if (!(rows & mask))
+			continue;
+		auto &key{keys[row]};
+		updateKeyState(key, (pressStates & mask) != 0U);
+		if (key.state.dirty() || key.lockout)
+			pending |= mask;
 	}
-	usb::hid::handleReport();
+	scan.pending = pending;
+	return true;
+}
+
+/*!
+ * Debounces all the rows of a column at once using a 2-bit vertical counter per row.
+ * A row's counter advances on each sample scan, one a millisecond whatever the scan rate,
+ * where its sample differs from the debounced state and resets on any scan they agree,
+ * flipping the debounced state on the 4th differing sample so debouncing always takes 4ms.
+ * Rows with eager keys skip the counters for the edges they report eagerly, relying on
+ * the key's lockout window instead. Only rows whose debounced state flipped, or which
+ * are still working through their press/release timers or lockout, get handed on to
+ * the per-key logic; returns false if none did.
+ */
+static bool scanColumnVertical(const uint8_t column, const uint8_t pressStates, const bool sample) noexcept
+{
+	auto &counter{columnDebounce[column]};
+	const auto delta{uint8_t(pressStates ^ counter.state)};
+	auto settled{uint8_t(0U)};
+	if (sample)
+	{
+		counter.count1 = uint8_t((counter.count1 ^ counter.count0) & delta);
+		counter.count0 = uint8_t(~counter.count0 & delta);
+		settled = uint8_t(~(counter.count0 | counter.count1));
+	}
+	else
+	{
+		counter.count1 = uint8_t(counter.count1 & delta);
+		counter.count0 = uint8_t(counter.count0 & delta);
+	}
+	const auto eager{uint8_t(counter.eagerBoth | (counter.eagerPress & pressStates))};
+	const auto toggled{uint8_t(delta & (eager | settled))};
+	counter.state ^= toggled;
+	counter.pending |= toggled;
+
+	if (!counter.pending)
+		return false;
+
+	auto *const keys{&keyStates[column * rowCount]};
+	for (uint8_t row{0}; row < rowCount; ++row)
+	{
+		const auto mask{uint8_t(1U << row)};
+		if (!(counter.pending & mask))
+			continue;
+		auto &key{keys[row]};
+		const bool switchState{(counter.state & mask) != 0U};
+		updateKeyState(key, switchState);
+		if (key.state.physicalState() == switchState && !key.state.dirty() && !key.lockout)
+			counter.pending &= uint8_t(~mask);
+	}
+	return true;
+}
+
+void keyIRQ() noexcept
+{
+	const mxKeyboard::timing::scope_t timing{mxKeyboard::timing::isr_t::keyScan};
+	scanTimestamp = mxKeyboard::scanTimer::timestamp();
+	if (!++rateWindowScans)
+	{
+		rateWindowTicks = uint16_t(scanTimestamp - rateWindowStart);
+		rateWindowStart = scanTimestamp;
+	}
+	bool debounceSample{true};
+	if constexpr (verticalDebounce)
+	{
+		if (++debounceScans < mxKeyboard::scanTimer::scansPerMillisecond())
+			debounceSample = false;
+		else
+			debounceScans = 0U;
+	}
+	for (const auto column : scanColumns)
+	{
+		PORTA.OUT = column;
+		// This waits for the propergation delays in the 3-to-8 decoders so the PORTF read is valid
+		for (volatile uint8_t wait{0}; wait < 1; ++wait)
+			continue;
+		// Rows with no switch fitted read as released, so they never need visiting
+		const auto pressStates{uint8_t(mxKeyboard::timing::sampleRows(column) & populatedRows[column])};
+		bool processed{};
+		if constexpr (verticalDebounce)
+			processed = scanColumnVertical(column, pressStates, debounceSample);
+		else
+			processed = scanColumn(column, pressStates);
+
+		if (processed)
+			++stats.columnsProcessed;
+		else
+			++stats.columnsSkipped;
+	}
+
+	if (mxKeyboard::scanTimer::scanOverrun())
+		++stats.overruns;
+	mxKeyboard::timing::scanComplete();
 }
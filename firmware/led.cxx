@@ -1,32 +1,78 @@
 // SPDX-License-Identifier: BSD-3-Clause
 #include <cstddef>
 #include <array>
+#include <algorithm>
+#include <avr/builtins.h>
+#include <substrate/indexed_iterator>
 #include "MXKeyboard.hxx"
 #include "led.hxx"
 #include "uart.hxx"
 #include "flash.hxx"
 #include "interrupts.hxx"
+#include "timing.hxx"
+#include "ledEffects.hxx"
 
 constexpr static inline std::byte operator ""_b(const unsigned long long value) noexcept
 	{ return static_cast<std::byte>(value); }
 
-constexpr std::size_t toChips(const std::size_t ledCount) { return (ledCount / 24) + (ledCount % 24 ? 1 : 0); }
-constexpr std::size_t toNearestWholeChipBytes(const std::size_t ledCount) { return toChips(ledCount) * 36; }
-constexpr std::size_t toNearestWholeChipLEDs(const std::size_t ledCount) { return toChips(ledCount) * 24; }
+constexpr static std::size_t ledsPerChip{24};
+constexpr static std::size_t bytesPerChip{36};
+
+constexpr std::size_t toChips(const std::size_t ledCount)
+	{ return (ledCount / ledsPerChip) + (ledCount % ledsPerChip ? 1 : 0); }
+constexpr std::size_t toNearestWholeChipBytes(const std::size_t ledCount) { return toChips(ledCount) * bytesPerChip; }
+constexpr std::size_t toNearestWholeChipLEDs(const std::size_t ledCount) { return toChips(ledCount) * ledsPerChip; }
 static_assert(toNearestWholeChipBytes(1) == 36);
 static_assert(toNearestWholeChipLEDs(1) == 24);
 
-constexpr static std::size_t ledStringLength{toNearestWholeChipBytes(109)};
-constexpr static std::size_t ledStringLEDs{toNearestWholeChipLEDs(109)};
+constexpr static std::size_t ledStringLength{toNearestWholeChipBytes(ledCount)};
+constexpr static std::size_t ledStringLEDs{toNearestWholeChipLEDs(ledCount)};
+constexpr static std::size_t ledStringChips{toChips(ledCount)};
+static_assert(ledsPerChip == mxKeyboard::layout::ledsPerChip);
+static_assert(ledStringChips <= 8, "The dirty chip mask must fit in a byte");
+constexpr static uint8_t allChips{uint8_t((1U << ledStringChips) - 1U)};
+
+#ifndef MXKEYBOARD_LED_CURRENT_BUDGET
+#define MXKEYBOARD_LED_CURRENT_BUDGET 400
+#endif
+
+// Full-scale current of each driver output, as set by the drivers' IREF resistors
+constexpr static uint32_t milliampsPerChannel{20U};
+constexpr static uint32_t fullScaleValue{4095U};
+// Brightness scale factors are 8.8 fixed-point, so this leaves the frame as it is
+constexpr static uint16_t unityScale{256U};
+
+/*
+ * An LED's colour gamma corrected and packed into the wire layout for its position in the
+ * string. Each channel's 12 bits straddle two bytes, and which nibbles they take depends on
+ * whether the position is even or odd, so a packed colour is only valid for positions of the
+ * same parity as the one it was packed for. Held as red, green, blue.
+ */
+struct packedColour_t final
+{
+	std::array<uint8_t, 3> first{};
+	std::array<uint8_t, 3> second{};
+	// The sum of the three gamma corrected channel values, for the current governor
+	uint16_t load{};
+};
+
+struct cachedColour_t final
+{
+	uint8_t position{255};
+	packedColour_t colour{};
+};
 
 struct ledData_t
 {
 	std::array<uint8_t, ledStringLength> red{};
 	std::array<uint8_t, ledStringLength> green{};
 	std::array<uint8_t, ledStringLength> blue{};
-	bool setup{false};
+	// Bit n is set when chip n's data has changed since the buffers were last swapped
+	uint8_t dirtyChips{0};
 
-	void colour(uint8_t led, uint8_t r, uint8_t g, uint8_t b) noexcept;
+	void colour(uint8_t position, const packedColour_t &colour) noexcept;
+	void copyChips(const ledData_t &from, uint8_t chips) noexcept;
+	void scale(uint16_t factor) noexcept;
 };
 
 constexpr static const std::array<flash_t<uint16_t>, 256> gammaLUT
@@ -65,28 +111,49 @@ constexpr static const std::array<flash_t<uint16_t>, 256> gammaLUT
 	0xF58, 0xF70, 0xF88, 0xF9F, 0xFB7, 0xFCF, 0xFE7, 0xFFF
 };
 
-constexpr static const std::array<flash_t<uint8_t>, ledStringLEDs> ledIndexMap
-{
-	23, 22, 21, 20, 19, 18, 17, 16,
-	15, 14, 13, 12, 11, 10, 9, 8,
-	7, 6, 5, 4, 3, 2, 1, 0,
-	47, 46, 45, 44, 43, 42, 41, 40,
-	39, 38, 37, 36, 35, 34, 33, 32,
-	31, 30, 29, 28, 27, 26, 25, 24,
-	71, 70, 69, 68, 67, 66, 65, 64,
-	63, 62, 61, 60, 59, 58, 57, 56,
-	55, 54, 53, 52, 51, 50, 49, 48,
-	95, 94, 93, 92, 91, 90, 89, 88,
-	87, 86, 85, 84, 83, 82, 81, 80,
-	79, 78, 77, 76, 75, 74, 73, 72,
-	119, 118, 117, 116, 115, 114, 113, 112,
-	111, 110, 109, 108, 107, 255, 255, 255,
-	255, 255, 255, 255, 255, 255, 255, 255
-};
-
 enum class channel_t { red, green, blue };
 
-static ledData_t leds{};
+// The profile's key colours, packed once when loaded so restoring one is just a few byte stores.
+// This also holds each LED's position on the chain so no write has to look it up from flash.
+static std::array<cachedColour_t, ledCount> colourCache{};
+// The colour pressed keys are highlighted with, for even and odd positions
+static std::array<packedColour_t, 2> highlightColours{};
+
+/*
+ * The DMA channels only ever read the front buffer while ledSetValue() only ever writes the back
+ * one. Once the DMA has finished with a frame, dmaChannel2IRQ() swaps them over if anything
+ * changed and brings the new back buffer up to date so writers can carry on where they left off.
+ */
+static std::array<ledData_t, 2> frameBuffers{};
+static ledData_t *frontBuffer{&frameBuffers[0]};
+static ledData_t *backBuffer{&frameBuffers[1]};
+
+/*
+ * A frame is only sent when the back buffer had changes swapped in (frameQueued), and only
+ * latched once its transfer has completed (frameShifted), so an idle board leaves the DMA,
+ * USARTs and latch alone. The first frame is queued so the chips start out blank.
+ */
+static volatile bool transferActive{false};
+static volatile bool frameQueued{true};
+static volatile bool frameShifted{false};
+
+/*
+ * The current governor keeps a running total of the gamma corrected channel values in the back
+ * buffer, which is proportional to the current the LEDs will draw. When a frame is swapped in,
+ * if the total is more than the budget allows, the front buffer gets scaled back by the same
+ * factor across every channel. The back buffer is never scaled so writers always see what they
+ * wrote. USB start-of-frames stopping (as they do while the bus is suspended) switches to the
+ * suspended budget, which is also in force until the host starts the bus after power on.
+ */
+static std::array<uint16_t, ledStringLEDs> ledLoads{};
+static uint32_t totalLoad{0};
+static uint16_t activeBudget{MXKEYBOARD_LED_CURRENT_BUDGET};
+static uint16_t suspendedBudget{0};
+static volatile bool startOfFrameSeen{false};
+static bool busSuspended{true};
+static bool governorChanged{true};
+static uint16_t frontScale{unityScale};
+static ledCurrent_t current{};
 
 inline USART_t &ledChannelToUART(const channel_t channel)
 {
@@ -115,15 +182,20 @@ void ledInit()
 	dmaInit(DMA.CH0, DMA_CH_TRIGSRC_USARTD0_DRE_gc);
 	dmaInit(DMA.CH1, DMA_CH_TRIGSRC_USARTC0_DRE_gc);
 	dmaInit(DMA.CH2, DMA_CH_TRIGSRC_USARTC1_DRE_gc);
-	dmaTransferSource(DMA.CH0, leds.red.data());
-	dmaTransferLength(DMA.CH0, leds.red.size());
+	dmaTransferSource(DMA.CH0, frontBuffer->red.data());
+	dmaTransferLength(DMA.CH0, frontBuffer->red.size());
 	dmaTransferDest(DMA.CH0, &ledChannelToUART(channel_t::red).DATA);
-	dmaTransferSource(DMA.CH1, leds.green.data());
-	dmaTransferLength(DMA.CH1, leds.green.size());
+	dmaTransferSource(DMA.CH1, frontBuffer->green.data());
+	dmaTransferLength(DMA.CH1, frontBuffer->green.size());
 	dmaTransferDest(DMA.CH1, &ledChannelToUART(channel_t::green).DATA);
-	dmaTransferSource(DMA.CH2, leds.blue.data());
-	dmaTransferLength(DMA.CH2, leds.blue.size());
+	dmaTransferSource(DMA.CH2, frontBuffer->blue.data());
+	dmaTransferLength(DMA.CH2, frontBuffer->blue.size());
 	dmaTransferDest(DMA.CH2, &ledChannelToUART(channel_t::blue).DATA);
+	// The blue channel is triggered last, so its completion marks the end of the frame
+	dmaInterruptEnable(DMA.CH2, DMA_CH_TRNINTLVL_MED_gc);
+
+	for (const auto &[led, entry] : substrate::indexedIterator_t{colourCache})
+		entry.position = mxKeyboard::layout::ledPosition(uint8_t(led));
 }
 
 /*
@@ -137,45 +209,132 @@ void ledInit()
  * [ 00 ], [ 0D ], [ A8 ]
  */
 
-constexpr void maskAndCombine(uint8_t &value, const uint8_t mask, const uint8_t comb)
-{
-	value &= mask;
-	value |= comb;
-}
-
-void ledData_t::colour(const uint8_t led, const uint8_t r, const uint8_t g, const uint8_t b) noexcept
+static packedColour_t packColour(const uint8_t position, const uint8_t r, const uint8_t g, const uint8_t b) noexcept
 {
 	const uint16_t correctedR{gammaLUT[r]};
 	const uint16_t correctedG{gammaLUT[g]};
 	const uint16_t correctedB{gammaLUT[b]};
 
-	//const auto offsetLed{led >= 96 ? led + 12 : led};
-	//const uint8_t offsetLed{ledIndexMap[led]};
-	const auto startBit{led * 12U};
-	const auto startByte{startBit / 8U};
+	const auto load{uint16_t(correctedR + correctedG + correctedB)};
 
-	if (led & 1U)
+	if (position & 1U)
 	{
-		maskAndCombine(red[startByte], 0xF0U, uint8_t(correctedR >> 8U));
-		red[startByte + 1] = uint8_t(correctedR);
-		maskAndCombine(green[startByte], 0xF0U, uint8_t(correctedG >> 8U));
-		green[startByte + 1] = uint8_t(correctedG);
-		maskAndCombine(blue[startByte], 0xF0U, uint8_t(correctedB >> 8U));
-		blue[startByte + 1] = uint8_t(correctedB);
+		return
+		{
+			{uint8_t(correctedR >> 8U), uint8_t(correctedG >> 8U), uint8_t(correctedB >> 8U)},
+			{uint8_t(correctedR), uint8_t(correctedG), uint8_t(correctedB)},
+			load
+		};
 	}
-	else
+	return
+	{
+		{uint8_t(correctedR >> 4U), uint8_t(correctedG >> 4U), uint8_t(correctedB >> 4U)},
+		{uint8_t(correctedR << 4U), uint8_t(correctedG << 4U), uint8_t(correctedB << 4U)},
+		load
+	};
+}
+
+void ledData_t::colour(const uint8_t position, const packedColour_t &colour) noexcept
+{
+	const auto startByte{(position * 12U) / 8U};
+	// The nibbles of the two bytes that belong to the neighbouring LEDs
+	const uint8_t keepFirst{(position & 1U) ? uint8_t{0xF0U} : uint8_t{0x00U}};
+	const uint8_t keepSecond{(position & 1U) ? uint8_t{0x00U} : uint8_t{0x0FU}};
+	uint8_t changed{0};
+	const auto store{[&](uint8_t &byte, const uint8_t keep, const uint8_t value) noexcept
 	{
-		red[startByte] = uint8_t(correctedR >> 4U);
-		maskAndCombine(red[startByte + 1], 0x0FU, uint8_t(correctedR << 4U));
-		green[startByte] = uint8_t(correctedG >> 4U);
-		maskAndCombine(green[startByte + 1], 0x0FU, uint8_t(correctedG << 4U));
-		blue[startByte] = uint8_t(correctedB >> 4U);
-		maskAndCombine(blue[startByte + 1], 0x0FU, uint8_t(correctedB << 4U));
+		const auto result{uint8_t((byte & keep) | value)};
+		changed |= uint8_t(result ^ byte);
+		byte = result;
+	}};
+
+	store(red[startByte], keepFirst, colour.first[0]);
+	store(red[startByte + 1], keepSecond, colour.second[0]);
+	store(green[startByte], keepFirst, colour.first[1]);
+	store(green[startByte + 1], keepSecond, colour.second[1]);
+	store(blue[startByte], keepFirst, colour.first[2]);
+	store(blue[startByte + 1], keepSecond, colour.second[2]);
+
+	if (changed)
+		dirtyChips |= uint8_t(1U << (position / ledsPerChip));
+}
+
+void ledData_t::copyChips(const ledData_t &from, const uint8_t chips) noexcept
+{
+	for (uint8_t chip{0}; chip < ledStringChips; ++chip)
+	{
+		if (!(chips & (1U << chip)))
+			continue;
+		const auto offset{chip * bytesPerChip};
+		std::copy_n(from.red.begin() + offset, bytesPerChip, red.begin() + offset);
+		std::copy_n(from.green.begin() + offset, bytesPerChip, green.begin() + offset);
+		std::copy_n(from.blue.begin() + offset, bytesPerChip, blue.begin() + offset);
 	}
 }
 
+static_assert(ledStringLength % 3U == 0U, "Channel values must pair up into whole 3-byte groups");
+
+void ledData_t::scale(const uint16_t factor) noexcept
+{
+	const auto scaleValue{[factor](const uint16_t value) noexcept
+		{ return uint16_t((uint32_t(value) * factor) >> 8U); }};
+
+	for (auto *const channel : {&red, &green, &blue})
+	{
+		auto &data{*channel};
+		// Every 3 bytes holds two 12-bit values
+		for (std::size_t i{0}; i < ledStringLength; i += 3U)
+		{
+			const auto first{scaleValue(uint16_t((data[i] << 4U) | (data[i + 1] >> 4U)))};
+			const auto second{scaleValue(uint16_t(((data[i + 1] & 0x0FU) << 8U) | data[i + 2]))};
+			data[i] = uint8_t(first >> 4U);
+			data[i + 1] = uint8_t((first << 4U) | (second >> 8U));
+			data[i + 2] = uint8_t(second);
+		}
+	}
+}
+
+static void ledSetValue(const uint8_t position, const packedColour_t &colour) noexcept
+{
+	// Keep the swap out so the whole update lands in one buffer, and is known about
+	const uint8_t sreg{SREG};
+	__builtin_avr_cli();
+	backBuffer->colour(position, colour);
+	totalLoad -= ledLoads[position];
+	totalLoad += colour.load;
+	ledLoads[position] = colour.load;
+	SREG = sreg;
+}
+
 void ledSetValue(const std::size_t led, const uint8_t r, const uint8_t g, const uint8_t b)
-	{ leds.colour(ledIndexMap[led], r, g, b); }
+{
+	const auto position{colourCache[led].position};
+	ledSetValue(position, packColour(position, r, g, b));
+}
+
+void ledCacheColour(const std::size_t led, const uint8_t r, const uint8_t g, const uint8_t b) noexcept
+{
+	auto &entry{colourCache[led]};
+	entry.colour = packColour(entry.position, r, g, b);
+}
+
+void ledHighlightColour(const uint8_t r, const uint8_t g, const uint8_t b) noexcept
+{
+	highlightColours[0] = packColour(0U, r, g, b);
+	highlightColours[1] = packColour(1U, r, g, b);
+}
+
+void ledRestoreColour(const std::size_t led) noexcept
+{
+	const auto &entry{colourCache[led]};
+	ledSetValue(entry.position, entry.colour);
+}
+
+void ledHighlight(const std::size_t led) noexcept
+{
+	const auto position{colourCache[led].position};
+	ledSetValue(position, highlightColours[position & 1U]);
+}
 
 void ledLatch()
 {
@@ -184,76 +343,116 @@ void ledLatch()
 	PORTE.OUTCLR = 0x10;
 }
 
-enum class rgbState_t : uint8_t
+//leds.colour(i, 127, 7, 63);
+
+void ledCurrentBudget(const uint16_t activeMilliamps, const uint16_t suspendedMilliamps) noexcept
 {
-	red, purple, blue, cyan, green, yellow
-};
-static rgbState_t currentState{rgbState_t::red};
-static uint8_t redValue{255};
-static uint8_t greenValue{0};
-static uint8_t blueValue{0};
+	// The budgets are read from tcc0OverflowIRQ, so keep it out while they're updated
+	const uint8_t sreg{SREG};
+	__builtin_avr_cli();
+	activeBudget = activeMilliamps;
+	suspendedBudget = suspendedMilliamps;
+	governorChanged = true;
+	SREG = sreg;
+}
 
-void nextRGBValue() noexcept
+ledCurrent_t ledCurrent() noexcept
 {
-	switch (currentState)
-	{
-		case rgbState_t::red:
-			++blueValue;
-			if (blueValue == 255U)
-				currentState = rgbState_t::purple;
-			break;
-		case rgbState_t::purple:
-			--redValue;
-			if (!redValue)
-				currentState = rgbState_t::blue;
-			break;
-		case rgbState_t::blue:
-			++greenValue;
-			if (greenValue == 255U)
-				currentState = rgbState_t::cyan;
-			break;
-		case rgbState_t::cyan:
-			--blueValue;
-			if (!blueValue)
-				currentState = rgbState_t::green;
-			break;
-		case rgbState_t::green:
-			++redValue;
-			if (redValue == 255U)
-				currentState = rgbState_t::yellow;
-			break;
-		case rgbState_t::yellow:
-			--greenValue;
-			if (!greenValue)
-				currentState = rgbState_t::red;
-			break;
-	}
+	const uint8_t sreg{SREG};
+	__builtin_avr_cli();
+	const auto result{current};
+	SREG = sreg;
+	return result;
 }
 
-//leds.colour(i, 127, 7, 63);
+void ledStartOfFrame() noexcept { startOfFrameSeen = true; }
+
+// Works out how much the back buffer must be scaled back by to keep inside the budget
+static uint16_t governorScale() noexcept
+{
+	const uint32_t budget{busSuspended ? suspendedBudget : activeBudget};
+	const uint32_t demand{(totalLoad * milliampsPerChannel) / fullScaleValue};
+	const auto scale{demand > budget ? uint16_t((budget * unityScale) / demand) : unityScale};
+	current = {uint16_t(demand), uint16_t((demand * scale) / unityScale)};
+	return scale;
+}
+
+// Only call with the DMA idle
+static void swapBuffers() noexcept
+{
+	const uint8_t changedChips{backBuffer->dirtyChips};
+	if (!changedChips && !governorChanged)
+		return;
+	governorChanged = false;
+	const auto scale{governorScale()};
+	if (!changedChips && scale == frontScale)
+		return;
+
+	ledData_t *const frame{backBuffer};
+	backBuffer = frontBuffer;
+	frontBuffer = frame;
+	dmaTransferSource(DMA.CH0, frontBuffer->red.data());
+	dmaTransferSource(DMA.CH1, frontBuffer->green.data());
+	dmaTransferSource(DMA.CH2, frontBuffer->blue.data());
+	// The new back buffer is a frame behind in just the chips that changed, so bring those up to
+	// date - unless the governor scaled it, in which case all of it is
+	backBuffer->copyChips(*frontBuffer, frontScale == unityScale ? changedChips : allChips);
+	frontBuffer->dirtyChips = 0;
+	if (scale != unityScale)
+		frontBuffer->scale(scale);
+	frontScale = scale;
+	frameQueued = true;
+}
 
 void tcc0OverflowIRQ()
 {
-	if (leds.setup)
+	const mxKeyboard::timing::scope_t timing{mxKeyboard::timing::isr_t::ledFrame};
+	// Latch here rather than on DMA completion as the USARTs are still shifting out the last bytes then
+	if (frameShifted)
+	{
 		ledLatch();
-	//for (uint8_t i{0}; i < 109; ++i)
-	for (uint8_t i{106}; i < 109; ++i)
-		ledSetValue(i, redValue, greenValue, blueValue);
-	nextRGBValue();
+		frameShifted = false;
+	}
+	// A USB frame is 1ms and ours 8ms, so no start-of-frame in that time means the bus is suspended
+	const bool suspended{!startOfFrameSeen};
+	startOfFrameSeen = false;
+	if (suspended != busSuspended)
+	{
+		busSuspended = suspended;
+		governorChanged = true;
+	}
+	mxKeyboard::ledEffects::render();
+
+	// Changes made since the last transfer completed haven't been swapped in yet
+	if (!transferActive)
+		swapBuffers();
+	if (!frameQueued)
+		return;
+	frameQueued = false;
 
 #if 1
+	transferActive = true;
 	dmaTrigger(DMA.CH0);
 	dmaTrigger(DMA.CH1);
 	dmaTrigger(DMA.CH2);
 #else
 	for (uint8_t i{0}; i < ledStringLength; ++i)
 	{
-		uartWrite(ledChannelToUART(channel_t::red), static_cast<uint8_t>(leds.red[i]));
-		uartWrite(ledChannelToUART(channel_t::green), static_cast<uint8_t>(leds.green[i]));
-		uartWrite(ledChannelToUART(channel_t::blue), static_cast<uint8_t>(leds.blue[i]));
+		uartWrite(ledChannelToUART(channel_t::red), static_cast<uint8_t>(frontBuffer->red[i]));
+		uartWrite(ledChannelToUART(channel_t::green), static_cast<uint8_t>(frontBuffer->green[i]));
+		uartWrite(ledChannelToUART(channel_t::blue), static_cast<uint8_t>(frontBuffer->blue[i]));
 	}
+	frameShifted = true;
 #endif
-	leds.setup = true;
 }
 
-void dmaChannel2IRQ() { ledLatch(); }
+void dmaChannel2IRQ()
+{
+	DMA.CH2.CTRLB |= DMA_CH_TRNIF_bm;
+	// Red and green were triggered first and run at the same rate, so at most finish off a byte
+	while (DMA.STATUS & (DMA_CH0BUSY_bm | DMA_CH1BUSY_bm))
+		continue;
+	transferActive = false;
+	frameShifted = true;
+	swapBuffers();
+}
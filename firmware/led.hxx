@@ -4,8 +4,28 @@
 
 #include <cstdint>
 #include <cstddef>
+#include "layout.hxx"
+
+constexpr static std::size_t ledCount{mxKeyboard::layout::ledCount};
 
 extern void ledSetValue(std::size_t led, uint8_t r, uint8_t g, uint8_t b);
+// Set an LED from colours packed ahead of time by ledCacheColour() and ledHighlightColour()
+extern void ledCacheColour(std::size_t led, uint8_t r, uint8_t g, uint8_t b) noexcept;
+extern void ledHighlightColour(uint8_t r, uint8_t g, uint8_t b) noexcept;
+extern void ledRestoreColour(std::size_t led) noexcept;
+extern void ledHighlight(std::size_t led) noexcept;
 extern void ledLatch();
 
+// The estimated LED current in mA, as the frame asks for and after the governor has scaled it back
+struct ledCurrent_t final
+{
+	uint16_t demand;
+	uint16_t delivered;
+};
+
+extern void ledCurrentBudget(uint16_t activeMilliamps, uint16_t suspendedMilliamps) noexcept;
+extern ledCurrent_t ledCurrent() noexcept;
+// Call on every USB start-of-frame, which is how the governor knows the bus isn't suspended
+extern void ledStartOfFrame() noexcept;
+
 #endif /*LED__HXX*/
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <avr/io.h>
+#include <avr/builtins.h>
+#include "ledEffects.hxx"
+#include "ringBuffer.hxx"
+#include "led.hxx"
+
+namespace mxKeyboard::ledEffects
+{
+	// TCC0 runs from clkPER/4, so 4MHz
+	constexpr static uint16_t ticksPerMicrosecond{4U};
+	// Leave the rest of the LED frame (33334 ticks) for the main loop
+	constexpr static uint16_t maximumBudget{30000U};
+	constexpr static uint8_t noKey{255U};
+	// The LEDs past the end of the key LEDs that light the case rather than a key
+	constexpr static uint8_t firstAccentLED{mxKeyboard::layout::keyLEDCount};
+	constexpr static uint8_t rippleCount{4U};
+	// In effect frames; ripples grow by a quarter of a key each frame and fade as they age
+	constexpr static uint8_t rippleLifetime{112U};
+	constexpr static uint8_t rippleBackground{64U};
+
+	struct keyLED_t final
+	{
+		uint8_t column{noKey};
+		uint8_t row{noKey};
+		rgb_t colour{};
+	};
+
+	struct ripple_t final
+	{
+		uint8_t column{0};
+		uint8_t row{0};
+		uint8_t age{rippleLifetime};
+
+		bool active() const noexcept { return age < rippleLifetime; }
+	};
+
+	static std::array<keyLED_t, ledCount> keyLEDs{};
+	static std::array<uint8_t, (ledCount + 7U) / 8U> pressedLEDs{};
+	static std::array<ripple_t, rippleCount> ripples{};
+	// Keys pressed in the main loop, waiting for render() to start their ripples
+	static ringBuffer_t<uint8_t, 4> newRipples{};
+
+	static volatile effect_t effect_{effect_t::staticColour};
+	static effect_t renderedEffect{effect_t::staticColour};
+	// Set for the first frame of the static effect so the keys get their own colours back
+	static bool restoreKeys{false};
+	static uint16_t budgetTicks{1000U * ticksPerMicrosecond};
+
+	static uint16_t frameCount{0};
+	static uint8_t breathingLevel{0};
+	static uint8_t nextLED{0};
+	static uint16_t frameTicks{0};
+	static bool frameSplit{false};
+	static frameStats_t stats{};
+
+	static uint8_t scale(const uint8_t value, const uint8_t level) noexcept
+		{ return uint8_t((uint16_t(value) * uint16_t(level + 1U)) >> 8U); }
+
+	static uint8_t difference(const uint8_t a, const uint8_t b) noexcept
+		{ return a > b ? uint8_t(a - b) : uint8_t(b - a); }
+
+	static uint8_t maximum(const uint8_t a, const uint8_t b) noexcept { return a > b ? a : b; }
+
+	static bool pressed(const uint8_t led) noexcept
+		{ return pressedLEDs[led >> 3U] & (1U << (led & 7U)); }
+
+	rgb_t hsvToRGB(const hsv_t colour) noexcept
+	{
+		const auto &[hue, saturation, value] {colour};
+		if (!saturation)
+			return {value, value, value};
+
+		// Six 43-step regions around the colour wheel, with the position within one scaled to 0-252
+		const uint8_t region{uint8_t(hue / 43U)};
+		const uint8_t remainder{uint8_t((hue - (region * 43U)) * 6U)};
+		const uint8_t p{scale(value, uint8_t(255U - saturation))};
+		const uint8_t q{scale(value, uint8_t(255U - scale(saturation, remainder)))};
+		const uint8_t t{scale(value, uint8_t(255U - scale(saturation, uint8_t(255U - remainder))))};
+
+		switch (region)
+		{
+			case 0U:
+				return {value, t, p};
+			case 1U:
+				return {q, value, p};
+			case 2U:
+				return {p, value, t};
+			case 3U:
+				return {p, q, value};
+			case 4U:
+				return {t, p, value};
+		}
+		return {value, p, q};
+	}
+
+	void keyLED(const uint8_t led, const uint8_t column, const uint8_t row, const rgb_t colour) noexcept
+	{
+		if (led >= ledCount)
+			return;
+		keyLEDs[led] = {column, row, colour};
+	}
+
+	rgb_t keyColour(const uint8_t led) noexcept { return led < ledCount ? keyLEDs[led].colour : rgb_t{}; }
+
+	// Called from the main loop as keys get highlighted and un-highlighted
+	void keyPressed(const uint8_t led, const bool pressed) noexcept
+	{
+		if (led >= ledCount)
+			return;
+		auto &bits{pressedLEDs[led >> 3U]};
+		const auto mask{uint8_t(1U << (led & 7U))};
+		// render() only ever reads these, so there's nothing for it to race with
+		if (!pressed)
+			bits &= uint8_t(~mask);
+		else if (!(bits & mask))
+		{
+			bits |= mask;
+			if (effect_ == effect_t::ripple)
+				newRipples.push(led);
+		}
+	}
+
+	void effect(const effect_t effect) noexcept
+		{ effect_ = effect > effect_t::ripple ? effect_t::staticColour : effect; }
+	effect_t effect() noexcept { return effect_; }
+
+	void frameBudget(const uint16_t microseconds) noexcept
+	{
+		const auto ticks{uint32_t(microseconds) * ticksPerMicrosecond};
+		// The budget is read by render(), so keep it out while both bytes are updated
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		budgetTicks = ticks < maximumBudget ? uint16_t(ticks) : maximumBudget;
+		SREG = sreg;
+	}
+
+	uint16_t frameBudget() noexcept { return budgetTicks / ticksPerMicrosecond; }
+
+	static void startFrame() noexcept
+	{
+		const auto effect{effect_};
+		if (effect != renderedEffect)
+		{
+			restoreKeys = effect == effect_t::staticColour;
+			renderedEffect = effect;
+		}
+		// Once the keys have their colours back, the static effect only has the accent LEDs to do
+		if (renderedEffect == effect_t::staticColour && !restoreKeys)
+			nextLED = firstAccentLED;
+
+		// A triangle wave with a period of 512 frames, the gamma correction takes care of making it look smooth
+		const auto phase{uint8_t(frameCount >> 1U)};
+		breathingLevel = uint8_t(((phase & 0x80U) ? uint8_t(~phase) : phase) << 1U);
+
+		while (!newRipples.empty())
+		{
+			const auto &key{keyLEDs[newRipples.front()]};
+			// Replace the oldest ripple if they're all busy
+			auto *slot{&ripples[0]};
+			for (auto &ripple : ripples)
+			{
+				if (ripple.age > slot->age)
+					slot = &ripple;
+			}
+			*slot = {key.column, key.row, 0U};
+			newRipples.pop();
+		}
+	}
+
+	static void endFrame() noexcept
+	{
+		++frameCount;
+		for (auto &ripple : ripples)
+		{
+			if (ripple.active())
+				++ripple.age;
+		}
+		restoreKeys = false;
+	}
+
+	static rgb_t rippleColour(const keyLED_t &key) noexcept
+	{
+		uint8_t level{rippleBackground};
+		for (const auto &ripple : ripples)
+		{
+			if (!ripple.active())
+				continue;
+			// Approximate the distance with max + min / 2, in quarter keys to match the ripple's growth
+			const auto columns{difference(key.column, ripple.column)};
+			const auto rows{difference(key.row, ripple.row)};
+			const auto distance{uint16_t((maximum(columns, rows) * 4U) + (columns < rows ? columns : rows) * 2U)};
+			const uint16_t age{ripple.age};
+			const auto offset{uint16_t(distance > age ? distance - age : age - distance)};
+			if (offset >= 4U)
+				continue;
+			const auto intensity{uint8_t(255U - (offset * 64U))};
+			level = maximum(level, scale(intensity, uint8_t(255U - (ripple.age << 1U))));
+		}
+		return {scale(key.colour.r, level), scale(key.colour.g, level), scale(key.colour.b, level)};
+	}
+
+	static void renderLED(const uint8_t led) noexcept
+	{
+		const auto &key{keyLEDs[led]};
+		if (key.column == noKey)
+		{
+			if (led < firstAccentLED)
+				return;
+			const auto colour{hsvToRGB({uint8_t(frameCount >> 2U), 255U, 255U})};
+			ledSetValue(led, colour.r, colour.g, colour.b);
+			return;
+		}
+		// Leave the highlight alone
+		if (pressed(led))
+			return;
+
+		rgb_t colour{};
+		switch (renderedEffect)
+		{
+			case effect_t::staticColour:
+				if (restoreKeys)
+					ledRestoreColour(led);
+				return;
+			case effect_t::breathing:
+				colour = {scale(key.colour.r, breathingLevel), scale(key.colour.g, breathingLevel),
+					scale(key.colour.b, breathingLevel)};
+				break;
+			case effect_t::hueWave:
+				colour = hsvToRGB({uint8_t(frameCount + (key.column * 12U)), 255U, 255U});
+				break;
+			case effect_t::ripple:
+				colour = rippleColour(key);
+				break;
+		}
+		ledSetValue(led, colour.r, colour.g, colour.b);
+	}
+
+	void render() noexcept
+	{
+		const uint16_t start{TCC0.CNT};
+		if (!nextLED)
+			startFrame();
+
+		bool outOfTime{false};
+		for (; nextLED < ledCount; ++nextLED)
+		{
+			if (uint16_t(TCC0.CNT - start) >= budgetTicks)
+			{
+				outOfTime = true;
+				break;
+			}
+			renderLED(nextLED);
+		}
+
+		const auto elapsed{uint16_t(TCC0.CNT - start)};
+		stats.renderTicks = elapsed;
+		if (elapsed > stats.maxRenderTicks)
+			stats.maxRenderTicks = elapsed;
+		frameTicks += elapsed;
+
+		if (outOfTime)
+		{
+			frameSplit = true;
+			return;
+		}
+
+		stats.frameTicks = frameTicks;
+		if (frameSplit && stats.splitFrames != UINT16_MAX)
+			++stats.splitFrames;
+		frameTicks = 0;
+		frameSplit = false;
+		nextLED = 0;
+		endFrame();
+	}
+
+	frameStats_t frameStats() noexcept
+	{
+		// The statistics are updated from tcc0OverflowIRQ, so keep it out while we take a consistent copy
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		const auto result{stats};
+		SREG = sreg;
+		return result;
+	}
+
+	void resetFrameStats() noexcept
+	{
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		stats = {};
+		SREG = sreg;
+	}
+} // namespace mxKeyboard::ledEffects
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <cstdint>
+#include "MXKeyboard.hxx"
+#include "nvm.hxx"
+
+namespace mxKeyboard::nvm
+{
+	[[gnu::noinline]]
+	static void readToRAM(const uint32_t flashAddr, const uint32_t memoryAddr, const uint16_t count) noexcept
+	{
+		__asm__(R"(
+			movw r26, %[memory]
+			out 0x39, %C[memory]
+			movw r30, %[flash]
+			out 0x3B, %C[flash]
+			movw r24, %[count]
+			clz
+loop%=:
+			breq loopDone%=
+			elpm r16, Z+
+			st X+, r16
+			sbiw r24, 1
+			rjmp loop%=
+loopDone%=:
+			)" : : [memory] "r" (memoryAddr), [flash] "r" (flashAddr), [count] "r" (count) :
+				"r16", "r24", "r25", "r26", "r27", "r30", "r31"
+		);
+	}
+
+	void readFlash(const uint32_t flashAddr, void *const buffer, const uint16_t count) noexcept
+	{
+		const uint8_t x{RAMPX};
+		const uint8_t z{RAMPZ};
+		readToRAM(flashAddr, reinterpret_cast<uint32_t>(buffer), count);
+		RAMPZ = z;
+		RAMPX = x;
+	}
+
+	void eraseFlashBuffer() noexcept
+	{
+		NVM.CMD = NVM_CMD_ERASE_FLASH_BUFFER_gc;
+		CCP = CCP_IOREG_gc;
+		NVM.CTRLA = NVM_CMDEX_bm;
+		while (NVM.STATUS & NVM_NVMBUSY_bm)
+			continue;
+	}
+
+	[[gnu::noinline]]
+	void loadFlashBuffer(const uint32_t flashAddr, const uint8_t *const buffer, const uint16_t count) noexcept
+	{
+		const uint8_t x{RAMPX};
+		const uint8_t z{RAMPZ};
+		const auto memoryAddr{reinterpret_cast<uint32_t>(buffer)};
+		NVM.CMD = NVM_CMD_LOAD_FLASH_BUFFER_gc;
+
+		__asm__(R"(
+				movw r26, %[memory]
+				out 0x39, %C[memory]
+				movw r30, %[flash]
+				out 0x3B, %C[flash]
+				movw r24, %[count]
+				clz
+loop%=:
+				breq loopDone%=
+				ld r0, X+
+				ld r1, X+
+				spm Z+
+				sbiw r24, 2
+				rjmp loop%=
+loopDone%=:
+				clr r1
+			)" : : [memory] "r" (memoryAddr), [flash] "r" (flashAddr), [count] "r" (count) :
+				"r0", "r1", "r24", "r25", "r26", "r27", "r30", "r31"
+		);
+
+		RAMPZ = z;
+		RAMPX = x;
+	}
+
+	[[gnu::noinline]]
+	void startFlashPageWrite(const uint32_t pageAddr) noexcept
+	{
+		const uint8_t z{RAMPZ};
+		NVM.CMD = NVM_CMD_ERASE_WRITE_FLASH_PAGE_gc;
+
+		__asm__(R"(
+				movw r30, %[page] ; Load Z with the page to erase + write
+				out 0x3B, %C[page]
+				ldi r16, 0x9D
+				out 0x34, r16 ; Unlock SPM
+				spm
+			)" : : [page] "r" (pageAddr) : "r16", "r30", "r31"
+		);
+
+		RAMPZ = z;
+	}
+
+	void writeFlashPage(const uint32_t pageAddr) noexcept
+	{
+		startFlashPageWrite(pageAddr);
+		while (NVM.STATUS & NVM_NVMBUSY_bm)
+			continue;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+
+	// With the EEPROM mapped into data space, writes to it load the page buffer
+	void loadEEPROMBuffer(const uint16_t eepromAddr, const uint8_t *const buffer, const uint8_t count) noexcept
+	{
+		auto *const eeprom{reinterpret_cast<volatile uint8_t *>(MAPPED_EEPROM_START + eepromAddr)};
+		for (uint8_t i{0}; i < count; ++i)
+			eeprom[i] = buffer[i];
+	}
+
+	void eraseEEPROMBuffer() noexcept
+	{
+		NVM.CMD = NVM_CMD_ERASE_EEPROM_BUFFER_gc;
+		CCP = CCP_IOREG_gc;
+		NVM.CTRLA = NVM_CMDEX_bm;
+		while (NVM.STATUS & NVM_NVMBUSY_bm)
+			continue;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+
+	[[gnu::noinline]]
+	static void startEEPROMCommand(const NVM_CMD_t command, const uint16_t pageAddr) noexcept
+	{
+		NVM.CMD = command;
+		NVM.ADDR0 = pageAddr & 0xFFU;
+		NVM.ADDR1 = (pageAddr >> 8U) & 0xFFU;
+		NVM.ADDR2 = 0;
+		CCP = CCP_IOREG_gc;
+		NVM.CTRLA = NVM_CMDEX_bm;
+	}
+
+	void startEEPROMPageWrite(const uint16_t pageAddr) noexcept
+		{ startEEPROMCommand(NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc, pageAddr); }
+
+	void startEEPROMPageWriteOnly(const uint16_t pageAddr) noexcept
+		{ startEEPROMCommand(NVM_CMD_WRITE_EEPROM_PAGE_gc, pageAddr); }
+
+	void writeEEPROMPage(const uint16_t pageAddr) noexcept
+	{
+		startEEPROMPageWrite(pageAddr);
+		while (NVM.STATUS & NVM_NVMBUSY_bm)
+			continue;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	}
+} // namespace mxKeyboard::nvm
@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <array>
+#include <algorithm>
+#include <avr/io.h>
+#include <avr/builtins.h>
+#include "interrupts.hxx"
+#include "nvm.hxx"
+#include "ringBuffer.hxx"
+
+namespace mxKeyboard::nvm
+{
+	// Written to from the main loop (or writesDone_ callback) and drained from the NVM ready interrupts
+	static ringBuffer_t<pageWrite_t, pageWriteQueueLength> writeQueue{};
+	// Set while the write at the front of the queue is in the NVM controller's hands
+	static volatile bool writing{false};
+	// Set once the queue has emptied, until serviceWrites() has called writesDone_
+	static volatile bool drained{false};
+	static writesDone_t writesDone_{nullptr};
+	static flashWriteGate_t flashWriteGate_{nullptr};
+	// How far serviceWrites() is through streaming the page at the front of the queue, and whether it has changed
+	static uint16_t streamed{0};
+	static bool streamChanged{false};
+
+	static_assert(eepromPageSize % pageChunkSize == 0U && flashPageSize % pageChunkSize == 0U);
+
+	static uint16_t pageSize(const pageWrite_t &write) noexcept
+		{ return write.type == pageType_t::flash ? flashPageSize : eepromPageSize; }
+
+	// Loads a chunk of the page into the relevant page buffer
+	static void loadChunk(const pageWrite_t &write, const uint16_t offset, const uint8_t *const data) noexcept
+	{
+		if (write.type == pageType_t::flash)
+			loadFlashBuffer(write.address + offset, data, pageChunkSize);
+		else
+			loadEEPROMBuffer(uint16_t(write.address + offset), data, pageChunkSize);
+	}
+
+	// Whether a chunk of the page differs from what's stored there
+	static bool chunkChanged(const pageWrite_t &write, const uint16_t offset, const uint8_t *const data) noexcept
+	{
+		std::array<uint8_t, pageChunkSize> current{};
+		if (write.type == pageType_t::flash)
+			readFlash(write.address + offset, current.data(), pageChunkSize);
+		else
+		{
+			const auto *const eeprom{reinterpret_cast<const uint8_t *>(MAPPED_EEPROM_START + write.address + offset)};
+			std::copy(eeprom, eeprom + pageChunkSize, current.begin());
+		}
+		return !std::equal(current.begin(), current.end(), data);
+	}
+
+	// Has the NVM controller write the page, which must already be in the page buffer
+	static void startWrite(const pageWrite_t &write) noexcept
+	{
+		if (write.type == pageType_t::flash)
+		{
+			startFlashPageWrite(write.address);
+			NVM.INTCTRL = NVM_SPMLVL_LO_gc;
+		}
+		else
+		{
+			if (write.type == pageType_t::eepromWriteOnly)
+				startEEPROMPageWriteOnly(uint16_t(write.address));
+			else
+				startEEPROMPageWrite(uint16_t(write.address));
+			NVM.INTCTRL = NVM_EELVL_LO_gc;
+		}
+		writing = true;
+	}
+
+	/*!
+	 * Starts the write at the front of the queue if it is an EEPROM page with its contents in RAM,
+	 * loading the whole page so none of the old contents survive in the page buffer. A write only
+	 * page gets its existing bytes loaded as they are, which writing leaves untouched. Writes from a
+	 * source, and Flash pages which halt the CPU while they're written, wait for serviceWrites().
+	 * Must be called with interrupts off.
+	 */
+	static void nextWrite() noexcept
+	{
+		if (writeQueue.empty())
+		{
+			drained = true;
+			return;
+		}
+		const auto &write{writeQueue.front()};
+		if (!write.data || write.type == pageType_t::flash)
+			return;
+		for (uint16_t offset{0}; offset < pageSize(write); offset += pageChunkSize)
+			loadChunk(write, offset, write.data + offset);
+		startWrite(write);
+	}
+
+	// Retires the write just finished and starts the next, if it can be. Must be called with interrupts off
+	static void writeComplete() noexcept
+	{
+		// Both ready interrupts stay asserted for as long as the NVM is idle
+		NVM.INTCTRL = 0;
+		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+		writing = false;
+		writeQueue.pop();
+		nextWrite();
+	}
+
+	// Streams the next chunk of the page at the front of the queue in from its source, or its data
+	static void streamChunk(const pageWrite_t &write) noexcept
+	{
+		if (!streamed && write.type == pageType_t::flash)
+			eraseFlashBuffer();
+		std::array<uint8_t, pageChunkSize> chunk{};
+		if (write.data)
+			std::copy(write.data + streamed, write.data + streamed + pageChunkSize, chunk.begin());
+		else
+			write.source(write.address, streamed, chunk.data(), pageChunkSize);
+		if (!streamChanged)
+			streamChanged = chunkChanged(write, streamed, chunk.data());
+		loadChunk(write, streamed, chunk.data());
+		streamed += pageChunkSize;
+		if (streamed < pageSize(write))
+			return;
+
+		streamed = 0U;
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		if (streamChanged)
+			startWrite(write);
+		else
+		{
+			// Nothing to write, so don't wear the page - the Flash page buffer is erased before it's next used
+			if (write.type != pageType_t::flash)
+				eraseEEPROMBuffer();
+			writeQueue.pop();
+			nextWrite();
+		}
+		SREG = sreg;
+		streamChanged = false;
+	}
+
+	bool queuePageWrite(const pageWrite_t &write) noexcept
+	{
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		const bool queued{writeQueue.push(write)};
+		// Only writes that arrive at an empty queue need starting, the rest follow on
+		if (queued && writeQueue.size() == 1U)
+			nextWrite();
+		SREG = sreg;
+		return queued;
+	}
+
+	void writesDone(const writesDone_t callback) noexcept { writesDone_ = callback; }
+	void flashWriteGate(const flashWriteGate_t gate) noexcept { flashWriteGate_ = gate; }
+
+	uint8_t pageWritesPending() noexcept { return writeQueue.size(); }
+
+	static void serviceWrites(const bool gated) noexcept
+	{
+		// Nothing else touches the queue while the front is waiting to be streamed in
+		if (!writing && !writeQueue.empty())
+		{
+			const auto &write{writeQueue.front()};
+			// The CPU halts for the whole of a Flash page write, so only work towards one while that's allowed
+			if (gated && write.type == pageType_t::flash && flashWriteGate_ && !flashWriteGate_())
+				return;
+			streamChunk(write);
+			return;
+		}
+
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		const bool done{drained && !writing && writeQueue.empty()};
+		if (done)
+			drained = false;
+		SREG = sreg;
+		// The callback may queue more writes
+		if (done && writesDone_)
+			writesDone_();
+	}
+
+	void serviceWrites() noexcept { serviceWrites(true); }
+
+	void waitForWrites() noexcept
+	{
+		while (true)
+		{
+			const uint8_t sreg{SREG};
+			__builtin_avr_cli();
+			if (writing)
+			{
+				// Poll rather than wait on the interrupt, so this also works with interrupts off
+				if (!(NVM.STATUS & NVM_NVMBUSY_bm))
+					writeComplete();
+				SREG = sreg;
+				continue;
+			}
+			const bool idle{writeQueue.empty() && !drained};
+			SREG = sreg;
+			if (idle)
+				return;
+			serviceWrites(false);
+		}
+	}
+} // namespace mxKeyboard::nvm
+
+using namespace mxKeyboard::nvm;
+
+static void nvmReadyIRQ() noexcept
+{
+	if (writing)
+		writeComplete();
+}
+
+void nvmEEPROMReadyIRQ() noexcept { nvmReadyIRQ(); }
+void nvmSPMReadyIRQ() noexcept { nvmReadyIRQ(); }
@@ -1,252 +1,1228 @@
 // SPDX-License-Identifier: BSD-3-Clause
-#include "indexSequence.hxx"
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <avr/io.h>
+#include <avr/builtins.h>
+#include "nvm.hxx"
 #include "profile.hxx"
 
+/*!
+ * Profiles are stored in slots (see profile.hxx) as a base copy - each slot's EEPROM part at the
+ * start of the EEPROM and its Flash part in the .profile section - plus a journal of changes at the
+ * end of the EEPROM. A profile's first slot lists the extra slots holding the rest of its key
+ * entries, which are only taken when a profile's keys don't fit in its first slot.
+ *
+ * profile_t::write() compares the profile with what is stored in the slots it already has and
+ * appends a record for each run of bytes that differ, so changing a key's colour costs a single
+ * EEPROM page write rather than erasing and rewriting the slot's Flash pages and EEPROM. Records
+ * never straddle an EEPROM page so each is one page write, and reading a slot replays its records
+ * over the base copy. Slots a profile is newly given are written straight into the base copies,
+ * before the records that point the profile's first slot at them.
+ *
+ * Only once the journal is full are the base copies brought up to date, rewriting just the pages
+ * that changed, and the journal erased. Every journal byte therefore gets erased once per
+ * journal's worth of changes, and the base copies written at most that often. A save that changes
+ * more of a profile's extra slots than the journal can take gives them fresh slots instead.
+ *
+ * The page writes go through the NVM write queue, so write() returns as soon as the save's first
+ * pages are queued. Journal pages are written without being erased first, as records only ever go
+ * into erased space, so an append that doesn't complete can't take the records already in its page
+ * with it. Anything such an append leaves past the last whole record gets the journal compacted
+ * rather than written over.
+ *
+ * Compaction is driven from the queue's completion callback, which runs from the main loop, queuing
+ * each base copy page once the one before it has been written. The page is then streamed into the
+ * NVM page buffer a chunk at a time, also from the main loop, and only written if it differs from
+ * what's there. None of the journal replaying that takes happens in an interrupt.
+ *
+ * Compaction is the only thing that writes the Flash parts - a save that fits in the journal
+ * writes nothing but EEPROM pages. Writing a Flash page halts the CPU (see nvm.hxx), so the main
+ * loop holds compaction's Flash pages back until the keyboard is idle, and a save that needs them
+ * finishes once they're written rather than stopping key scanning and USB while keys are in use.
+ *
+ * A record is the slot number, a byte holding the length of the data less one in its bottom 4 bits
+ * with the next 3 bits set, the offset of the data in the slot, then the data. The top bit of the
+ * length byte is cleared in the last record of each save. An erased (0xFF) slot number ends the
+ * records in a page - the journal carries on in the next page if that has any - and an empty page
+ * ends it.
+ *
+ * The stored form (storedChain_t) is encoded from profile_t into a RAM copy for saving, while
+ * keyReader_t decodes it straight out of the slots a few bytes at a time. Keys whose settings
+ * all match the defaults - the profile's timings, the profile's debounce mode, and the layout's
+ * scancode and key type - take no space. The rest get a key entry: the first key's index with its
+ * key type in the top bit, the number of keys in the run less one with whether the key is remapped
+ * in the top bit, the press time, the release time with the debounce mode in the top two bits, then
+ * the scancode if the key is remapped. A run covers neighbouring keys with the same settings that
+ * aren't remapped, skipping matrix positions with no switch. An erased (0xFF) first byte ends the
+ * entries, which carry on from the end of one slot into the next. Every key with a switch being
+ * remapped still fits in a profile's slots.
+ *
+ * write() seals each slot with a CRC-16 of its EEPROM part and a CRC-32 of the rest of its Flash
+ * part, computed by the CRC module. checkProfiles() checks every slot at boot, having the NVM
+ * controller CRC a Flash part straight out of the .profile section when no records touch it. The
+ * records of a save that didn't finish are ignored until the next compaction folds the good copies
+ * back in, as are those of the last save that did if the profile it saved doesn't check out.
+ */
+
 using mxKeyboard::keyMatrix::keyType_t;
-using mxKeyboard::profile::flashPart_t;
+using mxKeyboard::layout::flashMatrix;
+using mxKeyboard::layout::noLED;
 
-constexpr static uint16_t flashPageSize{512U};
-constexpr static auto flashPageMask{flashPageSize - 1U};
-constexpr static uint16_t eepromPageSize{32U};
-constexpr static auto eepromPageMask{eepromPageSize - 1U};
+using namespace mxKeyboard::nvm;
 
-template<> struct flash_t<flashPart_t> final
+namespace mxKeyboard::profile
 {
-private:
-	const void *value_;
-
-	[[gnu::noinline]]
-	static void readToRAM(const uint32_t flashAddr, const uint32_t memoryAddr, const uint16_t count) noexcept
-	{
-		__asm__(R"(
-			movw r26, %[memory]
-			out 0x39, %C[memory]
-			movw r30, %[flash]
-			out 0x3B, %C[flash]
-			movw r24, %[count]
-			clz
-loop%=:
-			breq loopDone%=
-			elpm r16, Z+
-			st X+, r16
-			sbiw r24, 1
-			rjmp loop%=
-loopDone%=:
-			)" : : [memory] "r" (memoryAddr), [flash] "r" (flashAddr), [count] "r" (count) :
-				"r16", "r24", "r25", "r26", "r27", "r30", "r31"
-		);
-	}
-
-	static void erasePageBuffer() noexcept
-	{
-		NVM.CMD = NVM_CMD_ERASE_FLASH_BUFFER_gc;
-		CCP = CCP_IOREG_gc;
-		NVM.CTRLA = NVM_CMDEX_bm;
-		while (NVM.STATUS & NVM_NVMBUSY_bm)
-			continue;
-	}
-
-	[[gnu::noinline]]
-	static void loadPageBuffer(const uint32_t flashAddr, const std::array<uint8_t, flashPageSize> &buffer) noexcept
-	{
-		const auto memoryAddr{reinterpret_cast<uint32_t>(buffer.data())};
-		NVM.CMD = NVM_CMD_LOAD_FLASH_BUFFER_gc;
-
-		__asm__(R"(
-				movw r26, %[memory]
-				out 0x39, %C[memory]
-				movw r30, %[flash]
-				out 0x3B, %C[flash]
-				movw r24, %[count]
-				clz
-loop%=:
-				breq loopDone%=
-				ld r0, X+
-				ld r1, X+
-				spm Z+
-				sbiw r24, 2
-				rjmp loop%=
-loopDone%=:
-			)" : : [memory] "r" (memoryAddr), [flash] "r" (flashAddr), [count] "r" (flashPageSize) :
-				"r0", "r1", "r24", "r25", "r26", "r27", "r30", "r31"
-		);
-	}
-
-	[[gnu::noinline]]
-	static void writePage(const uint32_t pageAddr) noexcept
-	{
-		NVM.CMD = NVM_CMD_ERASE_WRITE_FLASH_PAGE_gc;
-
-		__asm__(R"(
-				movw r30, %[page] ; Load Z with the page to erase + write
-				out 0x3B, %C[page]
-				ldi r16, 0x9D
-				out 0x34, r16 ; Unlock SPM
-				spm
-			)" : : [page] "r" (pageAddr) : "r16", "r30", "r31"
-		);
-
-		while (NVM.STATUS & NVM_NVMBUSY_bm)
-			continue;
-		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
-	}
-
-public:
-	constexpr flash_t() noexcept : value_{nullptr} { }
-	constexpr flash_t(const void *const value) noexcept : value_{value} { }
-
-	operator flashPart_t() const noexcept
-	{
-		flashPart_t result{};
-		const auto resultAddr{reinterpret_cast<uint32_t>(&result)};
-		const auto valueAddr{reinterpret_cast<uint32_t>(value_)};
-		const uint8_t x{RAMPX};
-		const uint8_t z{RAMPZ};
-		readToRAM(valueAddr, resultAddr, sizeof(flashPart_t));
-		RAMPZ = z;
-		RAMPX = x;
-		return result;
-	}
-
-	void operator =(const flashPart_t &source) const noexcept
-	{
-		std::array<uint8_t, flashPageSize> flashBuffer{};
-		const uint8_t x{RAMPX};
-		const uint8_t z{RAMPZ};
-
-		const auto *const sourceBuffer{reinterpret_cast<const uint8_t *>(&source)};
-		const auto destAddr{reinterpret_cast<uint32_t>(value_)};
-		auto pageAddr{destAddr & uint32_t(~flashPageMask)};
-		auto offset{static_cast<uint16_t>(destAddr - pageAddr)};
-
-		readToRAM(pageAddr, reinterpret_cast<uint32_t>(flashBuffer.data()), offset);
-		std::memcpy(flashBuffer.data() + offset, sourceBuffer,
-			std::min(size_t(flashPageSize - offset), sizeof(flashPart_t)));
-		if (offset + sizeof(flashPart_t) <= flashPageSize)
-		{
-			offset += sizeof(flashPart_t);
-			const auto remainder{static_cast<uint16_t>(flashPageSize - offset)};
-			readToRAM(pageAddr + offset, reinterpret_cast<uint32_t>(flashBuffer.data() + offset), remainder);
-			erasePageBuffer();
-			loadPageBuffer(pageAddr, flashBuffer);
-			writePage(pageAddr);
+	constexpr static uint16_t eepromPartsLength{eepromPartLength * slotCount};
+	constexpr static uint16_t flashPartsLength{flashPartLength * slotCount};
+	constexpr static uint16_t journalLength{8U * eepromPageSize};
+	constexpr static uint16_t journalStart{eepromSize - journalLength};
+	constexpr static uint16_t journalEnd{eepromSize};
+
+	[[gnu::section(".profile"), gnu::used]] const static std::array<uint8_t, flashPartsLength> flashProfiles{{}};
+	static_assert(sizeof(flashProfiles) <= profileFlashLength);
+	static_assert(eepromPartsLength <= journalStart, "The EEPROM parts must leave room for the journal");
+	constexpr static uint8_t recordHeaderLength{3U};
+	constexpr static uint8_t maxRecordData{16U};
+	constexpr static uint8_t journalFree{0xFFU};
+	// A record's length byte: the length less one, bits that must be left set, and whether more of its save follows
+	constexpr static uint8_t recordLengthMask{0x0FU};
+	constexpr static uint8_t recordUnusedBits{0x70U};
+	constexpr static uint8_t recordMoreBit{0x80U};
+	// Changed bytes this close together are cheaper to journal as one record than as two
+	constexpr static uint8_t mergeDistance{recordHeaderLength};
+	// Where the CRCs are in a slot, and how much of the Flash part the CRC-32 covers
+	constexpr static uint16_t crcsOffset{offsetof(storedProfile_t, crcs)};
+	constexpr static uint16_t flashCRCLength{crcsOffset - eepromPartLength};
+	constexpr static uint8_t keyEntryLength{4U};
+	constexpr static uint8_t noKeyEntry{0xFFU};
+	constexpr static uint16_t keyEntriesLength{headKeyEntriesLength + (extraKeyEntriesLength * extraSlotCount)};
+
+	static_assert(slotCount < journalFree && slotCount < noSlot, "A slot number must never look like the end of something");
+	static_assert(slotLength <= 256U, "Record offsets must fit a byte");
+	static_assert(maxRecordData - 1U <= recordLengthMask);
+	static_assert(offsetof(storedProfile_t, header) == 0U && offsetof(storedKeyEntries_t, header) == 0U &&
+		offsetof(storedKeyEntries_t, crcs) == crcsOffset, "Both kinds of slot must start and end alike");
+	static_assert(eepromPartLength <= crcsOffset && eepromPartLength > offsetof(storedProfile_t, extraSlots));
+	static_assert(sizeof(storedChain_t) == slotLength * (extraSlotCount + 1U));
+	static_assert(keyCount <= 128U, "Key indices must fit in 7 bits");
+	// Every key has an LED, so this is every key with a switch getting its own entry with a scancode
+	static_assert(keyEntriesLength >= layout::keyLEDCount * (keyEntryLength + 1U),
+		"A profile's slots must be able to hold every key being remapped");
+	static_assert(journalEnd - journalStart >= 4U * eepromPageSize, "The profile journal needs some room");
+	static_assert(recordHeaderLength + maxRecordData <= eepromPageSize);
+
+	enum class savePhase_t : uint8_t
+	{
+		idle,
+		compactEEPROM,
+		compactFlash,
+		append,
+		// The last of the save's page writes are queued, so it's done once they complete
+		finishing
+	};
+
+	// One bit for each slot
+	struct slotSet_t final
+	{
+	private:
+		std::array<uint8_t, bytesFor(slotCount)> bits_{};
+
+	public:
+		void add(const uint8_t slot) noexcept { bits_[slot >> 3U] |= uint8_t(1U << (slot & 7U)); }
+		void remove(const uint8_t slot) noexcept { bits_[slot >> 3U] &= uint8_t(~(1U << (slot & 7U))); }
+		bool contains(const uint8_t slot) const noexcept { return bits_[slot >> 3U] & (1U << (slot & 7U)); }
+		bool empty() const noexcept
+			{ return std::all_of(bits_.begin(), bits_.end(), [](const uint8_t bits) noexcept { return !bits; }); }
+
+		void merge(const slotSet_t &other) noexcept
+		{
+			for (uint8_t index{0}; index < bits_.size(); ++index)
+				bits_[index] |= other.bits_[index];
 		}
-		else
+	};
+
+	struct record_t final
+	{
+		uint8_t slot;
+		uint8_t length;
+		uint16_t offset;
+		uint16_t dataAddress;
+		bool endsSave;
+	};
+
+	using slotList_t = std::array<uint8_t, extraSlotCount + 1U>;
+
+	static volatile savePhase_t savePhase{savePhase_t::idle};
+	static saveDone_t saveDone{nullptr};
+	// The slots being saved to in order, and those of them new to the profile, which go straight into the base copies
+	static slotList_t savingSlots{};
+	static slotSet_t freshSlots{};
+	// The slots compaction has to bring up to date, how far through the base copies it is, and whether to erase the journal
+	static slotSet_t compactSlots{};
+	static uint16_t compactAddress{0};
+	static bool compactJournal{false};
+	// The new contents of the end of the journal while a save's records are being written to it
+	static std::array<uint8_t, journalLength> journalImage{};
+	// The profile being saved, encoded, which must be left alone until it's saved
+	static storedChain_t chain{};
+	// Bumped by every save and by checkProfiles(), so a keyReader_t can tell what it has read may have moved
+	static uint8_t profileWrites{0};
+	// Each profile's first slot, or noSlot if it has none that checked out, and the slots profiles are stored in
+	static std::array<uint8_t, profileCount> firstSlots
+	{
+		[]() noexcept
+		{
+			std::array<uint8_t, profileCount> slots{};
+			for (auto &slot : slots)
+				slot = noSlot;
+			return slots;
+		}()
+	};
+	static slotSet_t usedSlots{};
+	// Records from before discardEnd that end past discardFrom are from saves that didn't check out
+	static uint16_t discardFrom{journalStart};
+	static uint16_t discardEnd{journalStart};
+
+	static_assert(journalLength / eepromPageSize <= pageWriteQueueLength,
+		"The whole journal must be able to be queued for writing at once");
+
+	static const uint8_t *eepromAt(const uint16_t address) noexcept
+		{ return reinterpret_cast<const uint8_t *>(MAPPED_EEPROM_START + address); }
+
+	constexpr static uint16_t eepromAddressFor(const uint8_t slot) noexcept
+		{ return eepromPartLength * slot; }
+
+	constexpr static uint32_t flashAddressFor(const uint8_t slot) noexcept
+		{ return profileFlashStart + (flashPartLength * slot); }
+
+	// One of the slots in chain, the profile's first being 0
+	static uint8_t *chainSlot(const uint8_t index) noexcept
+		{ return reinterpret_cast<uint8_t *>(&chain) + (slotLength * index); }
+
+	/*!
+	 * Calls function for each record in the journal in the order they were written, returning
+	 * the address the next record goes at. If the journal looks corrupt, it is treated as full
+	 * so the next write compacts it away.
+	 */
+	template<typename function_t> static uint16_t walkJournal(function_t &&function) noexcept
+	{
+		uint16_t address{journalStart};
+		while (address < journalEnd)
 		{
-			auto remainder{static_cast<uint16_t>((offset + sizeof(flashPart_t)) - flashPageSize)};
-			offset &= flashPageMask;
-			erasePageBuffer();
-			loadPageBuffer(pageAddr, flashBuffer);
-			writePage(pageAddr);
+			const auto header{*eepromAt(address)};
+			if (header == journalFree)
+			{
+				const auto nextPage{uint16_t((address | eepromPageMask) + 1U)};
+				// The last record in this page left room, but the one after it didn't fit
+				if ((address & eepromPageMask) && nextPage < journalEnd && *eepromAt(nextPage) != journalFree)
+				{
+					address = nextPage;
+					continue;
+				}
+				return address;
+			}
 
-			pageAddr += flashPageSize;
-			std::memcpy(flashBuffer.data(), sourceBuffer + offset, remainder);
-			offset = remainder;
-			remainder = flashPageSize - remainder;
-			readToRAM(pageAddr + offset, reinterpret_cast<uint32_t>(flashBuffer.data() + offset), remainder);
-			erasePageBuffer();
-			loadPageBuffer(pageAddr, flashBuffer);
-			writePage(pageAddr);
+			const auto length{eepromAt(address)[1]};
+			const record_t record
+			{
+				header, uint8_t((length & recordLengthMask) + 1U), eepromAt(address)[2],
+				uint16_t(address + recordHeaderLength), !(length & recordMoreBit)
+			};
+			if (record.slot >= slotCount || (length & recordUnusedBits) != recordUnusedBits ||
+				record.offset + record.length > slotLength || record.dataAddress + record.length > journalEnd)
+				return journalEnd;
+			function(record);
+			address = uint16_t(record.dataAddress + record.length);
 		}
+		return journalEnd;
+	}
 
-		RAMPZ = z;
-		RAMPX = x;
+	// Whether the record is part of the slot's stored form, which it isn't if from a save that didn't check out
+	static bool applies(const record_t &record, const uint8_t slot) noexcept
+	{
+		return record.slot == slot && (record.dataAddress >= discardEnd ||
+			record.dataAddress + record.length <= discardFrom);
 	}
-};
 
-struct eeprom_t final
-{
-private:
-	[[gnu::noinline]]
-	static void writePage(const uint32_t pageAddr) noexcept
+	static void readBase(const uint8_t slot, uint16_t offset, uint8_t *buffer, uint16_t count) noexcept
+	{
+		if (offset < eepromPartLength)
+		{
+			const auto length{std::min(count, uint16_t(eepromPartLength - offset))};
+			std::memcpy(buffer, eepromAt(eepromAddressFor(slot) + offset), length);
+			offset += length;
+			buffer += length;
+			count -= length;
+		}
+		if (count)
+			readFlash(flashAddressFor(slot) + (offset - eepromPartLength), buffer, count);
+	}
+
+	// Reads count bytes of a slot starting at offset, with any journaled changes applied
+	static void readStored(const uint8_t slot, const uint16_t offset, uint8_t *const buffer,
+		const uint16_t count) noexcept
+	{
+		readBase(slot, offset, buffer, count);
+		walkJournal([&](const record_t &record) noexcept
+		{
+			const auto begin{std::max(record.offset, offset)};
+			const auto end{std::min(uint16_t(record.offset + record.length), uint16_t(offset + count))};
+			if (!applies(record, slot) || begin >= end)
+				return;
+			std::memcpy(buffer + (begin - offset), eepromAt(record.dataAddress + (begin - record.offset)), end - begin);
+		});
+	}
+
+	template<typename T> static T readSlot(const uint8_t slot, const uint16_t offset) noexcept
+	{
+		T value{};
+		readStored(slot, offset, reinterpret_cast<uint8_t *>(&value), sizeof(T));
+		return value;
+	}
+
+	// The slots the profile is stored in, in order, followed by noSlot
+	static slotList_t slotsOf(const uint8_t profileNumber) noexcept
+	{
+		slotList_t slots{};
+		for (auto &slot : slots)
+			slot = noSlot;
+		slots[0] = firstSlots[profileNumber];
+		if (slots[0] == noSlot)
+			return slots;
+		const auto extraSlots{readSlot<decltype(storedProfile_t::extraSlots)>(slots[0],
+			offsetof(storedProfile_t, extraSlots))};
+		for (uint8_t index{0}; index < extraSlotCount && extraSlots[index] != noSlot; ++index)
+			slots[index + 1U] = extraSlots[index];
+		return slots;
+	}
+
+	/*!
+	 * Appends records for length bytes of the slot from offset to the journal image starting at
+	 * imageStart, returning false if there's no room left. Records never straddle a page, so each is
+	 * written in one go, but are cut short to use up the end of one.
+	 */
+	static bool appendRecords(uint16_t &tail, const uint16_t imageStart, const uint8_t slot, uint16_t offset,
+		const uint8_t *data, uint8_t length, uint16_t &firstRecord, uint16_t &lastRecord) noexcept
+	{
+		while (length)
+		{
+			auto room{uint8_t(eepromPageSize - (tail & eepromPageMask))};
+			if (room <= recordHeaderLength)
+			{
+				tail = uint16_t((tail | eepromPageMask) + 1U);
+				room = eepromPageSize;
+			}
+			const auto count{std::min(length, uint8_t(room - recordHeaderLength))};
+			if (tail + recordHeaderLength + count > journalEnd)
+				return false;
+
+			auto *const record{journalImage.data() + (tail - imageStart)};
+			record[0] = slot;
+			record[1] = uint8_t(recordMoreBit | recordUnusedBits | (count - 1U));
+			record[2] = uint8_t(offset);
+			std::memcpy(record + recordHeaderLength, data, count);
+			if (firstRecord == journalEnd)
+				firstRecord = tail;
+			lastRecord = tail;
+			tail += recordHeaderLength + count;
+			offset += count;
+			data += count;
+			length -= count;
+		}
+		return true;
+	}
+
+	/*!
+	 * Builds the save's records in the journal image from start on, one for each run of bytes that
+	 * differ in the slots the profile already had, marking the last as ending the save. Returns
+	 * false if they don't fit, else where the records start and where the next would go.
+	 */
+	static bool buildRecords(const uint16_t start, uint16_t &firstRecord, uint16_t &newTail) noexcept
+	{
+		const auto imageStart{uint16_t(start & uint16_t(~eepromPageMask))};
+		std::memcpy(journalImage.data(), eepromAt(imageStart), journalEnd - imageStart);
+		newTail = start;
+		// Where the first record went, which may be the page after start's if it didn't fit there
+		firstRecord = journalEnd;
+		uint16_t lastRecord{journalEnd};
+
+		std::array<uint8_t, eepromPageSize> stored{};
+		for (uint8_t slotIndex{0}; slotIndex <= extraSlotCount && savingSlots[slotIndex] != noSlot; ++slotIndex)
+		{
+			const auto slot{savingSlots[slotIndex]};
+			if (freshSlots.contains(slot))
+				continue;
+			const auto *const bytes{chainSlot(slotIndex)};
+			for (uint16_t chunk{0}; chunk < slotLength; chunk += stored.size())
+			{
+				const auto count{uint8_t(std::min(uint16_t(stored.size()), uint16_t(slotLength - chunk)))};
+				const auto *const current{bytes + chunk};
+				readStored(slot, chunk, stored.data(), count);
+
+				for (uint8_t index{0}; index < count; )
+				{
+					if (current[index] == stored[index])
+					{
+						++index;
+						continue;
+					}
+					// Take in any more changes close enough that one record is cheaper than two
+					auto last{index};
+					for (uint8_t end(index + 1U); end < count && end - index < maxRecordData; ++end)
+					{
+						if (current[end] != stored[end])
+							last = end;
+						else if (end - last > mergeDistance)
+							break;
+					}
+					const auto length{uint8_t(last + 1U - index)};
+					if (!appendRecords(newTail, imageStart, slot, uint16_t(chunk + index), current + index, length,
+						firstRecord, lastRecord))
+						return false;
+					index += length;
+				}
+			}
+		}
+
+		if (lastRecord != journalEnd)
+			journalImage[lastRecord + 1U - imageStart] &= uint8_t(~recordMoreBit);
+		return true;
+	}
+
+	// Whether the chain's slot differs from what's stored in the slot it's being saved to
+	static bool slotChanged(const uint8_t index) noexcept
 	{
-		NVM.CMD = NVM_CMD_ERASE_WRITE_EEPROM_PAGE_gc;
-		NVM.ADDR0 = pageAddr & 0xFFU;
-		NVM.ADDR1 = (pageAddr >> 8U) & 0xFFU;
-		NVM.ADDR2 = (pageAddr >> 16U) & 0xFFU;
-		CCP = CCP_IOREG_gc;
-		NVM.CTRLA = NVM_CMDEX_bm;
-		while (NVM.STATUS & NVM_NVMBUSY_bm)
-			continue;
+		std::array<uint8_t, eepromPageSize> stored{};
+		const auto *const bytes{chainSlot(index)};
+		for (uint16_t chunk{0}; chunk < slotLength; chunk += stored.size())
+		{
+			const auto count{uint8_t(std::min(uint16_t(stored.size()), uint16_t(slotLength - chunk)))};
+			readStored(savingSlots[index], chunk, stored.data(), count);
+			if (!std::equal(stored.begin(), stored.begin() + count, bytes + chunk))
+				return true;
+		}
+		return false;
 	}
 
-public:
-	template<typename T> static void write(uint16_t destAddr, const T &source) noexcept
+	/*!
+	 * Takes the first free slot for the profile being saved, returning noSlot if there are none.
+	 * Slots with records in the journal are taken last as the journal has to be compacted away to
+	 * stop them replaying over the slot's new contents.
+	 */
+	static uint8_t allocateSlot(const slotSet_t &journaledSlots, bool &compact) noexcept
 	{
-		auto *eeprom{reinterpret_cast<uint8_t *>(MAPPED_EEPROM_START)};
-		const auto *const sourceBuffer{reinterpret_cast<const uint8_t *>(&source)};
-		auto pageAddr{destAddr & uint16_t(~eepromPageMask)};
+		uint8_t journaled{noSlot};
+		for (uint8_t slot{0}; slot < slotCount; ++slot)
+		{
+			if (usedSlots.contains(slot) || freshSlots.contains(slot))
+				continue;
+			if (!journaledSlots.contains(slot))
+			{
+				freshSlots.add(slot);
+				return slot;
+			}
+			if (journaled == noSlot)
+				journaled = slot;
+		}
+		if (journaled != noSlot)
+		{
+			freshSlots.add(journaled);
+			compact = true;
+		}
+		return journaled;
+	}
 
-		eeprom += pageAddr;
-		for (const auto &i : utility::indexSequence_t{destAddr - pageAddr})
+	// Fills in the headers of the profile's slots in chain, the list of them in the first, and their CRCs
+	static void sealChain(const uint8_t profileNumber, const uint8_t slots) noexcept
+	{
+		for (uint8_t index{0}; index < extraSlotCount; ++index)
+			chain.profile.extraSlots[index] = index + 1U < slots ? savingSlots[index + 1U] : noSlot;
+		for (uint8_t index{0}; index < slots; ++index)
 		{
-			// Load the EEPROM data
-			volatile const auto value{eeprom[i]};
-			// Load the EEPROM Page Buffer with that data
-			eeprom[i] = value;
+			auto *const bytes{chainSlot(index)};
+			const slotHeader_t header{profileFormat, profileNumber, index};
+			std::memcpy(bytes, &header, sizeof(header));
+
+			profileCRCs_t crcs{};
+			crcStart(crc_t::crc16);
+			crcUpdate(bytes, eepromPartLength);
+			crcs.eepromPart = uint16_t(crcResult());
+			crcStart(crc_t::crc32);
+			crcUpdate(bytes + eepromPartLength, flashCRCLength);
+			crcs.flashPart = crcResult();
+			std::memcpy(bytes + crcsOffset, &crcs, sizeof(crcs));
 		}
+	}
 
-		auto offset{static_cast<uint16_t>(destAddr - pageAddr)};
-		for (const auto &i : utility::indexSequence_t{sizeof(T)})
+	/*!
+	 * Fills buffer with the up to date contents of count bytes of one of the base copy regions,
+	 * starting address bytes in. Each slot has partLength bytes of the region, holding its stored
+	 * form from partOffset on. The slots being freshly saved come from RAM, and bytes past the last
+	 * slot are left as they are.
+	 */
+	static void readUpToDate(uint16_t address, uint8_t *buffer, uint16_t count, const uint16_t partLength,
+		const uint16_t partOffset) noexcept
+	{
+		while (count)
 		{
-			// If we are on a page boundary and that is not the start of the 0th page
-			if (offset + i && ((offset + i) & eepromPageMask) == 0)
+			const auto slot{uint8_t(address / partLength)};
+			const auto offset{uint16_t(address % partLength)};
+			const auto length{std::min(count, uint16_t(partLength - offset))};
+			if (freshSlots.contains(slot))
 			{
-				// Perform an atomic erase + write cycle
-				writePage(pageAddr);
-				pageAddr += eepromPageSize;
+				const auto index{uint8_t(std::find(savingSlots.begin(), savingSlots.end(), slot) - savingSlots.begin())};
+				std::memcpy(buffer, chainSlot(index) + partOffset + offset, length);
 			}
-			// Load the EEPROM Page Buffer with data
-			eeprom[offset + i] = sourceBuffer[i];
+			else if (slot < slotCount)
+				readStored(slot, uint16_t(partOffset + offset), buffer, length);
+			address += length;
+			buffer += length;
+			count -= length;
+		}
+	}
+
+	// Whether any of the slots with part of the given base copy page need compacting
+	static bool needsCompacting(const uint16_t address, const uint16_t length, const uint16_t partLength) noexcept
+	{
+		const auto last{uint8_t(std::min(uint16_t((address + length - 1U) / partLength), uint16_t(slotCount - 1U)))};
+		for (auto slot{uint8_t(address / partLength)}; slot <= last; ++slot)
+		{
+			if (compactSlots.contains(slot))
+				return true;
+		}
+		return false;
+	}
+
+	// Streams the up to date contents of an EEPROM part page
+	static void eepromPartChunk(const uint32_t pageAddr, const uint16_t offset, uint8_t *const buffer,
+		const uint8_t count) noexcept
+	{
+		const auto address{uint16_t(pageAddr + offset)};
+		std::memcpy(buffer, eepromAt(address), count);
+		if (address < eepromPartsLength)
+			readUpToDate(address, buffer, std::min(uint16_t(count), uint16_t(eepromPartsLength - address)),
+				eepromPartLength, 0U);
+	}
+
+	// Streams the up to date contents of a Flash part page
+	static void flashPartChunk(const uint32_t pageAddr, const uint16_t offset, uint8_t *const buffer,
+		const uint8_t count) noexcept
+	{
+		const auto address{uint16_t(pageAddr + offset - profileFlashStart)};
+		readFlash(pageAddr + offset, buffer, count);
+		if (address < flashPartsLength)
+			readUpToDate(address, buffer, std::min(uint16_t(count), uint16_t(flashPartsLength - address)),
+				flashPartLength, eepromPartLength);
+	}
+
+	static void erasedChunk(const uint32_t, const uint16_t, uint8_t *const buffer, const uint8_t count) noexcept
+		{ std::memset(buffer, journalFree, count); }
+
+	// Queues the next EEPROM part page that may change, returning false once there are none left
+	static bool compactEEPROM() noexcept
+	{
+		while (compactAddress < eepromPartsLength)
+		{
+			const auto address{compactAddress};
+			const auto length{std::min(eepromPageSize, uint16_t(eepromPartsLength - address))};
+			compactAddress += eepromPageSize;
+			if (needsCompacting(address, length, eepromPartLength))
+				return queuePageWrite({pageType_t::eeprom, address, nullptr, eepromPartChunk});
+		}
+		return false;
+	}
+
+	// Queues the next Flash part page that may change, returning false once there are none left
+	static bool compactFlash() noexcept
+	{
+		while (compactAddress < flashPartsLength)
+		{
+			const auto address{compactAddress};
+			const auto length{std::min(flashPageSize, uint16_t(flashPartsLength - address))};
+			compactAddress += flashPageSize;
+			if (needsCompacting(address, length, flashPartLength))
+				return queuePageWrite({pageType_t::flash, profileFlashStart + address, nullptr, flashPartChunk});
+		}
+		return false;
+	}
+
+	// Queues erasing the journal from the back, returning false if it was already empty
+	static bool eraseJournal() noexcept
+	{
+		// Find the pages to erase first, as the EEPROM can't be read once the first is queued
+		uint8_t usedPages{0};
+		for (uint16_t address{journalStart}; address < journalEnd; address += eepromPageSize)
+		{
+			const auto *const page{eepromAt(address)};
+			if (std::any_of(page, page + eepromPageSize, [](const uint8_t value) noexcept { return value != journalFree; }))
+				usedPages |= uint8_t(1U << ((address - journalStart) / eepromPageSize));
+		}
+		if (!usedPages)
+			return false;
+
+		for (uint16_t address{journalEnd}; address > journalStart; )
+		{
+			address -= eepromPageSize;
+			if (usedPages & (1U << ((address - journalStart) / eepromPageSize)))
+				queuePageWrite({pageType_t::eeprom, address, nullptr, erasedChunk});
+		}
+		return true;
+	}
+
+	// Queues the save's journal records, returning false if there are none
+	static bool appendSave() noexcept
+	{
+		const auto tail{walkJournal([](const record_t &) noexcept { })};
+		uint16_t firstRecord{};
+		uint16_t newTail{};
+		// write() made sure the records would fit
+		if (!buildRecords(tail, firstRecord, newTail) || newTail == tail)
+			return false;
+
+		const auto imageStart{uint16_t(tail & uint16_t(~eepromPageMask))};
+		// Queue the lot in one go so the save can't be seen to finish part way through
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		for (auto address{uint16_t(firstRecord & uint16_t(~eepromPageMask))}; address < newTail; address += eepromPageSize)
+			queuePageWrite({pageType_t::eepromWriteOnly, address, journalImage.data() + (address - imageStart), nullptr});
+		SREG = sreg;
+		return true;
+	}
+
+	/*!
+	 * Moves the save on once the page writes queued for it have completed, with the NVM idle.
+	 *
+	 * Compaction writes the profile's fresh slots into the base copies a page at a time, along with
+	 * the journal if it needs erasing, then erases the journal. Until the journal is erased,
+	 * replaying it over the new base copies gives the same result, and it is erased from the back so
+	 * an interrupted erase leaves only records that are already part of the base copies. Then the
+	 * save's records are appended.
+	 */
+	static void saveStep() noexcept
+	{
+		switch (savePhase)
+		{
+			case savePhase_t::idle:
+				return;
+			case savePhase_t::compactEEPROM:
+				if (compactEEPROM())
+					return;
+				savePhase = savePhase_t::compactFlash;
+				compactAddress = 0U;
+				[[fallthrough]];
+			case savePhase_t::compactFlash:
+				if (compactFlash())
+					return;
+				savePhase = savePhase_t::append;
+				if (compactJournal)
+				{
+					compactJournal = false;
+					// Any saves that didn't check out are gone from the base copies, and soon the journal
+					discardFrom = journalStart;
+					discardEnd = journalStart;
+					if (eraseJournal())
+						return;
+				}
+				[[fallthrough]];
+			case savePhase_t::append:
+				savePhase = savePhase_t::finishing;
+				if (appendSave())
+					return;
+				[[fallthrough]];
+			case savePhase_t::finishing:
+				break;
 		}
 
-		offset += sizeof(T);
-		const auto remainder{offset & eepromPageMask};
-		offset &= uint16_t(~eepromPageMask);
-		if (remainder)
+		savePhase = savePhase_t::idle;
+		freshSlots = {};
+		if (const auto done{saveDone}; done)
+		{
+			saveDone = nullptr;
+			done();
+		}
+	}
+
+	// Writes a profile's key entries in order, carrying on from the end of one slot into the next
+	struct keyEntryCursor_t final
+	{
+	private:
+		storedChain_t &chain_;
+		uint16_t position_{0};
+		uint8_t slot_{0};
+		uint8_t offset_{0};
+
+	public:
+		constexpr keyEntryCursor_t(storedChain_t &chain) noexcept : chain_{chain} { }
+		uint16_t remaining() const noexcept { return uint16_t(keyEntriesLength - position_); }
+		// How many slots the entries so far take
+		uint8_t slots() const noexcept { return std::max(uint8_t(slot_ + (offset_ ? 1U : 0U)), uint8_t(1U)); }
+
+		auto &next() noexcept
 		{
-			for (const auto &i : utility::indexSequence_t{remainder, eepromPageSize})
+			auto &byte{slot_ ? chain_.extra[slot_ - 1U].keyEntries[offset_] : chain_.profile.keyEntries[offset_]};
+			if (++offset_ == (slot_ ? extraKeyEntriesLength : headKeyEntriesLength))
 			{
-				// Load the EEPROM data
-				volatile const auto value{eeprom[offset + i]};
-				// Load the EEPROM Page Buffer with that data
-				eeprom[offset + i] = value;
+				++slot_;
+				offset_ = 0U;
 			}
+			++position_;
+			return byte;
 		}
-		// Flush the final page to EEPROM
-		writePage(pageAddr);
+	};
 
-		NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+	// Keys that latch unless their profile says otherwise
+	static bool latchingByDefault(const usbScancode_t scancode) noexcept
+	{
+		return scancode == usbScancode_t::numLock || scancode == usbScancode_t::capsLock ||
+			scancode == usbScancode_t::scrollLock;
 	}
-};
 
-namespace mxKeyboard::profile
-{
-	[[gnu::section(".profile")]] const static std::array<flashPart_t, profileCount> flashProfiles{{}};
+	static bool populated(const uint8_t index) noexcept { return (*flashMatrix[index]).ledIndex != noLED; }
+
+	// Finds the colour in the palette, adding it if there's room, returning paletteSize if there isn't
+	static uint8_t paletteEntry(std::array<rgb_t, paletteSize> &palette, uint8_t &colours, const rgb_t colour) noexcept
+	{
+		for (uint8_t entry{0}; entry < colours; ++entry)
+		{
+			const auto &candidate{palette[entry]};
+			if (candidate.r == colour.r && candidate.g == colour.g && candidate.b == colour.b)
+				return entry;
+		}
+		if (colours == paletteSize)
+			return paletteSize;
+		palette[colours] = colour;
+		return colours++;
+	}
+
+	uint8_t profile_t::encode(storedChain_t &chain) const noexcept
+	{
+		chain = {};
+		auto &stored{chain.profile};
+		stored.debounce = debounce_;
+		stored.debounceMode = debounceMode_;
+		stored.scanRate = scanRate_;
+		stored.effect = effect_;
+
+		uint8_t colours{0};
+		for (uint8_t index{0}; index < keyCount; ++index)
+		{
+			const auto led{(*flashMatrix[index]).ledIndex};
+			if (led == noLED)
+				continue;
+			const auto entry{paletteEntry(stored.palette, colours, keyColours_[index])};
+			if (entry == paletteSize)
+				return 0U;
+			stored.colourIndices[led >> 1U] |= uint8_t((led & 1U) ? entry << 4U : entry);
+		}
+
+		// Take the timings most of the keys share as the default, finding them by majority vote
+		uint8_t votes{0};
+		for (uint8_t index{0}; index < keyCount; ++index)
+		{
+			if (!populated(index))
+				continue;
+			const auto &key{keys_[index]};
+			if (!votes)
+			{
+				stored.timePress = key.timePress;
+				stored.timeRelease = key.timeRelease;
+			}
+			if (key.timePress == stored.timePress && key.timeRelease == stored.timeRelease)
+				++votes;
+			else
+				--votes;
+		}
+
+		const auto sameSettings
+		{
+			[this](const uint8_t a, const uint8_t b) noexcept
+			{
+				const auto &keyA{keys_[a]};
+				const auto &keyB{keys_[b]};
+				return keyA.timePress == keyB.timePress && keyA.timeRelease == keyB.timeRelease &&
+					keyA.debounceMode == keyB.debounceMode && keyType(a) == keyType(b);
+			}
+		};
+
+		keyEntryCursor_t entries{chain};
+		for (uint8_t index{0}; index < keyCount; )
+		{
+			const auto &key{keys_[index]};
+			const auto scancode{(*flashMatrix[index]).usbScancode};
+			const bool remapped{key.scancode != scancode};
+			if (!populated(index) || (!remapped && key.timePress == stored.timePress &&
+				key.timeRelease == stored.timeRelease && key.debounceMode == uint8_t(debounceMode_t::profileDefault) &&
+				keyType(index) == latchingByDefault(scancode)))
+			{
+				++index;
+				continue;
+			}
+
+			uint8_t count{1};
+			if (!remapped)
+			{
+				for (auto next{uint8_t(index + 1U)}; next < keyCount; ++next)
+				{
+					if (populated(next))
+					{
+						if (!sameSettings(index, next) || keys_[next].scancode != (*flashMatrix[next]).usbScancode)
+							break;
+						count = uint8_t(next + 1U - index);
+					}
+				}
+			}
+
+			if (entries.remaining() < keyEntryLength + (remapped ? 1U : 0U))
+				return 0U;
+			entries.next() = uint8_t(index | (keyType(index) ? 0x80U : 0x00U));
+			entries.next() = uint8_t((count - 1U) | (remapped ? 0x80U : 0x00U));
+			entries.next() = key.timePress;
+			entries.next() = uint8_t(key.timeRelease | (key.debounceMode << 6U));
+			if (remapped)
+				entries.next() = uint8_t(key.scancode);
+			index += count;
+		}
+
+		const auto slots{entries.slots()};
+		while (entries.remaining())
+			entries.next() = noKeyEntry;
+		return slots;
+	}
+
+	keyReader_t::keyReader_t(const uint8_t profileNumber) noexcept :
+		profileNumber_{profileNumber}, writes_{profileWrites} { }
+
+	bool keyReader_t::stale() const noexcept { return writes_ != profileWrites; }
+
+	bool keyReader_t::fill() noexcept
+	{
+		static_assert(sizeof(head_t) == offsetof(storedProfile_t, keyEntries) - offsetof(storedProfile_t, extraSlots) &&
+			offsetof(head_t, palette) == offsetof(storedProfile_t, palette) - offsetof(storedProfile_t, extraSlots),
+			"head_t must match storedProfile_t");
+		// What's stored can't be read while it's being written to
+		if (savePhase != savePhase_t::idle || pageWritesPending())
+			return false;
+		if (!headRead_)
+		{
+			headRead_ = true;
+			firstSlot_ = profileNumber_ < profileCount ? firstSlots[profileNumber_] : noSlot;
+			if (firstSlot_ == noSlot)
+			{
+				entriesEnded_ = true;
+				return true;
+			}
+			readStored(firstSlot_, offsetof(storedProfile_t, extraSlots), reinterpret_cast<uint8_t *>(&head_), sizeof(head_t));
+			// As with slotsOf(), the first noSlot ends the list
+			for (uint8_t index{1}; index < extraSlotCount; ++index)
+			{
+				if (head_.extraSlots[index - 1U] == noSlot)
+					head_.extraSlots[index] = noSlot;
+			}
+			return true;
+		}
+		if (entriesEnded_)
+			return true;
+
+		// Keep what's left to decode, reading in what follows it up to the end of its slot
+		const auto kept{uint8_t(entriesRead_ - entriesUsed_)};
+		std::memmove(entries_.data(), entries_.data() + entriesUsed_, kept);
+		entriesStart_ += entriesUsed_;
+		entriesRead_ = kept;
+		entriesUsed_ = 0U;
+		const auto position{uint16_t(entriesStart_ + kept)};
+		const bool head{position < headKeyEntriesLength};
+		const auto extra{uint16_t(position - headKeyEntriesLength)};
+		const auto slotIndex{uint8_t(head ? 0U : 1U + (extra / extraKeyEntriesLength))};
+		const auto offset{uint16_t(head ? position : extra % extraKeyEntriesLength)};
+		const auto left{uint16_t((head ? headKeyEntriesLength : extraKeyEntriesLength) - offset)};
+		const auto count{uint8_t(std::min(left, uint16_t(entries_.size() - kept)))};
+		const auto slot{slotIndex ? head_.extraSlots[slotIndex - 1U] : firstSlot_};
+		// Past the profile's last slot, the entries read as erased
+		if (slot == noSlot)
+			std::fill(entries_.begin() + kept, entries_.begin() + kept + count, noKeyEntry);
+		else
+			readStored(slot, uint16_t((head ? offsetof(storedProfile_t, keyEntries) :
+				offsetof(storedKeyEntries_t, keyEntries)) + offset), entries_.data() + kept, count);
+		entriesRead_ = uint8_t(kept + count);
+		return true;
+	}
+
+	// Decodes the next key entry, returning false if more of them have to be read first
+	bool keyReader_t::nextEntry() noexcept
+	{
+		const auto remaining{uint16_t(keyEntriesLength - (entriesStart_ + entriesUsed_))};
+		const auto available{uint8_t(entriesRead_ - entriesUsed_)};
+		const auto *const entry{entries_.data() + entriesUsed_};
+		const auto ended
+		{
+			[this]() noexcept
+			{
+				entriesEnded_ = true;
+				entryCount_ = 0U;
+				return true;
+			}
+		};
+
+		if (remaining < keyEntryLength)
+			return ended();
+		if (available < keyEntryLength)
+			return false;
+		if (entry[0] == noKeyEntry)
+			return ended();
+		const bool remapped{(entry[1] & 0x80U) != 0U};
+		const auto length{uint8_t(keyEntryLength + (remapped ? 1U : 0U))};
+		if (remaining < length)
+			return ended();
+		if (available < length)
+			return false;
+
+		entryFirst_ = entry[0] & 0x7FU;
+		entryCount_ = uint8_t((entry[1] & 0x7FU) + 1U);
+		entryLatching_ = (entry[0] & 0x80U) != 0U;
+		entryRemapped_ = remapped;
+		entryKey_.timePress = entry[2];
+		entryKey_.timeRelease = entry[3] & 0x3FU;
+		entryKey_.debounceMode = entry[3] >> 6U;
+		if (remapped)
+			entryKey_.scancode = static_cast<usbScancode_t>(entry[4]);
+		entriesUsed_ += length;
+		return true;
+	}
+
+	bool keyReader_t::next(storedKey_t &key) noexcept
+	{
+		if (!headRead_ || index_ >= keyCount)
+			return false;
+		// Entries are in key order, so those wholly before this key are done with
+		while (!entriesEnded_ && index_ >= entryFirst_ + entryCount_)
+		{
+			if (!nextEntry())
+				return false;
+		}
+
+		const auto index{index_++};
+		key = {};
+		if (!valid())
+			return true;
+		const auto &layoutKey{*flashMatrix[index]};
+		const auto led{layoutKey.ledIndex};
+		// A key entry's run skips matrix positions with no switch, which take the defaults
+		if (index >= entryFirst_ && index - entryFirst_ < entryCount_ && led != noLED)
+		{
+			key.key = entryKey_;
+			key.latching = entryLatching_;
+			if (!entryRemapped_)
+				key.key.scancode = layoutKey.usbScancode;
+		}
+		else
+		{
+			key.key.timePress = head_.timePress;
+			key.key.timeRelease = head_.timeRelease & 0x3FU;
+			key.key.debounceMode = uint8_t(debounceMode_t::profileDefault);
+			key.key.scancode = layoutKey.usbScancode;
+			key.latching = latchingByDefault(layoutKey.usbScancode);
+		}
+
+		// Keys without an LED have no colour
+		if (led != noLED)
+		{
+			const auto indices{head_.colourIndices[led >> 1U]};
+			key.colour = head_.palette[(led & 1U) ? indices >> 4U : indices & 0x0FU];
+		}
+		return true;
+	}
+
+	// Reads the profile's keys through to the given one, waiting for any save in progress
+	static storedKey_t readKey(const uint8_t profileNumber, const uint8_t index) noexcept
+	{
+		waitForWrites();
+		keyReader_t reader{profileNumber};
+		storedKey_t key{};
+		while (reader.index() <= index)
+		{
+			if (!reader.next(key))
+				reader.fill();
+		}
+		return key;
+	}
 
 	profile_t profile_t::read(const uint8_t profileNumber) noexcept
 	{
 		profile_t profile{};
-		const auto *const eeprom{reinterpret_cast<void *>(MAPPED_EEPROM_START +
-			(sizeof(eepromPart_t) * profileNumber))};
-
-		std::memcpy(&profile.eeprom, eeprom, sizeof(eepromPart_t));
-		profile.flash = flash_t<flashPart_t>{&flashProfiles[profileNumber]};
+		waitForWrites();
+		keyReader_t reader{profileNumber};
+		reader.fill();
+		if (!reader.valid())
+			return profile;
+		profile.profileNumber_ = profileNumber;
+		profile.debounce_ = reader.debounce();
+		profile.debounceMode_ = reader.debounceMode();
+		profile.scanRate_ = reader.scanRate();
+		profile.effect_ = reader.effect();
+		for (uint8_t index{0}; index < keyCount; ++index)
+		{
+			storedKey_t key{};
+			while (!reader.next(key))
+				reader.fill();
+			profile.keyColours_[index] = key.colour;
+			profile.keys_[index] = key.key;
+			profile.keyType(index, key.latching ? keyType_t::latching : keyType_t::momentary);
+		}
 		return profile;
 	}
 
-	void profile_t::write() noexcept
+	/*!
+	 * Saves the profile encoded into chain, which takes the given number of slots. The profile keeps
+	 * the slots it has in the same order, taking more or giving some up as needed.
+	 */
+	static bool save(const uint8_t profileNumber, const uint8_t slots, const saveDone_t done) noexcept
+	{
+		++profileWrites;
+		const auto currentSlots{slotsOf(profileNumber)};
+		slotSet_t journaledSlots{};
+		const auto tail{walkJournal([&](const record_t &record) noexcept { journaledSlots.add(record.slot); })};
+		// Appends only fill in erased bytes, so anything a torn append left past the tail has to be compacted
+		// away, as do the records of any saves that didn't check out
+		bool compact{discardFrom != discardEnd || !std::all_of(eepromAt(tail), eepromAt(journalEnd),
+			[](const uint8_t value) noexcept { return value == journalFree; })};
+		freshSlots = {};
+		for (uint8_t index{0}; index < savingSlots.size(); ++index)
+		{
+			savingSlots[index] = index < slots ? currentSlots[index] : noSlot;
+			if (index < slots && savingSlots[index] == noSlot &&
+				(savingSlots[index] = allocateSlot(journaledSlots, compact)) == noSlot)
+				return false;
+		}
+		sealChain(profileNumber, slots);
+
+		// Works out if the records fit after the tail, or failing that in an empty journal
+		const auto planRecords
+		{
+			[&]() noexcept
+			{
+				uint16_t firstRecord{};
+				uint16_t newTail{};
+				compactJournal = compact || !buildRecords(tail, firstRecord, newTail);
+				return !compactJournal || buildRecords(journalStart, firstRecord, newTail);
+			}
+		};
+		if (!planRecords())
+		{
+			// Too much changed for the journal, so give the extra slots that changed fresh copies
+			for (uint8_t index{1}; index < slots; ++index)
+			{
+				if (freshSlots.contains(savingSlots[index]) || !slotChanged(index))
+					continue;
+				if ((savingSlots[index] = allocateSlot(journaledSlots, compact)) == noSlot)
+					return false;
+			}
+			sealChain(profileNumber, slots);
+			if (!planRecords())
+				return false;
+		}
+
+		for (const auto slot : currentSlots)
+		{
+			if (slot != noSlot)
+				usedSlots.remove(slot);
+		}
+		for (uint8_t index{0}; index < slots; ++index)
+			usedSlots.add(savingSlots[index]);
+		firstSlots[profileNumber] = savingSlots[0];
+
+		saveDone = done;
+		if (compactJournal || !freshSlots.empty())
+		{
+			compactSlots = freshSlots;
+			if (compactJournal)
+				compactSlots.merge(journaledSlots);
+			compactAddress = 0U;
+			savePhase = savePhase_t::compactEEPROM;
+		}
+		else
+			savePhase = savePhase_t::append;
+		writesDone(saveStep);
+		saveStep();
+		return true;
+	}
+
+	bool profile_t::write(const saveDone_t done) noexcept
+	{
+		const auto profileNumber{profileNumber_};
+		if (profileNumber >= profileCount)
+			return false;
+		// Let any previous save finish so what's stored can be read and chain can be reused
+		waitForWrites();
+		const auto slots{encode(chain)};
+		return slots && save(profileNumber, slots, done);
+	}
+
+	bool writeDefault(const uint8_t profileNumber, const defaultProfile_t &profile, const saveDone_t done) noexcept
+	{
+		if (profileNumber >= profileCount)
+			return false;
+		waitForWrites();
+		chain = {};
+		auto &stored{chain.profile};
+		stored.debounce = profile.debounce;
+		stored.debounceMode = profile.debounceMode;
+		stored.scanRate = profile.scanRate;
+		stored.effect = profile.effect;
+		// Every key takes the first palette entry, and none needs a key entry
+		stored.palette[0] = profile.colour;
+		keyEntryCursor_t entries{chain};
+		while (entries.remaining())
+			entries.next() = noKeyEntry;
+		return save(profileNumber, 1U, done);
+	}
+
+	bool profile_t::saving() noexcept { return savePhase != savePhase_t::idle; }
+	void profile_t::waitForSave() noexcept { waitForWrites(); }
+
+	template<typename T> static T readField(const uint8_t profileNumber, const uint16_t offset) noexcept
+	{
+		waitForWrites();
+		if (profileNumber >= profileCount || firstSlots[profileNumber] == noSlot)
+			return {};
+		return readSlot<T>(firstSlots[profileNumber], offset);
+	}
+
+	// Runs count bytes of the slot from offset through the CRC module
+	static void crcStored(const uint8_t slot, uint16_t offset, uint16_t count) noexcept
+	{
+		std::array<uint8_t, pageChunkSize> chunk{};
+		while (count)
+		{
+			const auto length{std::min(count, uint16_t(chunk.size()))};
+			readStored(slot, offset, chunk.data(), length);
+			crcUpdate(chunk.data(), length);
+			offset += length;
+			count -= length;
+		}
+	}
+
+	// Whether the slot as stored, less any discarded records, is the given part of a profile and checks out against its CRCs
+	static bool storedValid(const uint8_t slot, const uint8_t profileNumber, const uint8_t sequence) noexcept
+	{
+		const auto header{readSlot<slotHeader_t>(slot, 0U)};
+		if (header.format != profileFormat || header.profileNumber != profileNumber || header.sequence != sequence)
+			return false;
+		const auto crcs{readSlot<profileCRCs_t>(slot, crcsOffset)};
+
+		crcStart(crc_t::crc16);
+		crcStored(slot, 0U, eepromPartLength);
+		if (uint16_t(crcResult()) != crcs.eepromPart)
+			return false;
+
+		bool flashJournaled{false};
+		walkJournal([&](const record_t &record) noexcept
+		{
+			if (applies(record, slot) && record.offset + record.length > eepromPartLength && record.offset < crcsOffset)
+				flashJournaled = true;
+		});
+		if (!flashJournaled)
+			return flashRangeCRC(flashAddressFor(slot), flashCRCLength) == crcs.flashPart;
+		crcStart(crc_t::crc32);
+		crcStored(slot, eepromPartLength, flashCRCLength);
+		return crcResult() == crcs.flashPart;
+	}
+
+	// Finds each profile's slots, taking the first copy of a profile that checks out, returning how many profiles did
+	static uint8_t findProfiles() noexcept
 	{
-		flash_t<flashPart_t> flashPart{&flashProfiles[eeprom.profileNumber]};
-		flashPart = flash;
-		eeprom_t::write(sizeof(eepromPart_t) * eeprom.profileNumber, eeprom);
+		for (auto &slot : firstSlots)
+			slot = noSlot;
+		usedSlots = {};
+		uint8_t found{0};
+		for (uint8_t slot{0}; slot < slotCount; ++slot)
+		{
+			const auto profileNumber{readSlot<slotHeader_t>(slot, 0U).profileNumber};
+			if (profileNumber >= profileCount || firstSlots[profileNumber] != noSlot || usedSlots.contains(slot) ||
+				!storedValid(slot, profileNumber, 0U))
+				continue;
+
+			slotSet_t slots{};
+			slots.add(slot);
+			const auto extraSlots{readSlot<decltype(storedProfile_t::extraSlots)>(slot, offsetof(storedProfile_t, extraSlots))};
+			uint8_t index{0};
+			for (; index < extraSlotCount && extraSlots[index] != noSlot; ++index)
+			{
+				const auto extra{extraSlots[index]};
+				if (extra >= slotCount || slots.contains(extra) || usedSlots.contains(extra) ||
+					!storedValid(extra, profileNumber, uint8_t(index + 1U)))
+					break;
+				slots.add(extra);
+			}
+			if (index < extraSlotCount && extraSlots[index] != noSlot)
+				continue;
+			firstSlots[profileNumber] = slot;
+			usedSlots.merge(slots);
+			++found;
+		}
+		return found;
+	}
+
+	void checkProfiles() noexcept
+	{
+		waitForWrites();
+		++profileWrites;
+		// Records after the last one to end a save are from a save that didn't finish
+		uint16_t lastSave{journalStart};
+		uint16_t previousSave{journalStart};
+		discardEnd = walkJournal([&](const record_t &record) noexcept
+		{
+			if (!record.endsSave)
+				return;
+			previousSave = lastSave;
+			lastSave = uint16_t(record.dataAddress + record.length);
+		});
+		discardFrom = lastSave;
+		const auto found{findProfiles()};
+		if (lastSave == journalStart)
+			return;
+
+		// The last save to finish may have been torn too, which would leave its profile not checking out
+		discardFrom = previousSave;
+		if (findProfiles() > found)
+			return;
+		discardFrom = lastSave;
+		findProfiles();
+	}
+
+	bool profileView_t::valid() const noexcept
+		{ return profileNumber_ < profileCount && firstSlots[profileNumber_] != noSlot; }
+
+	uint8_t profileView_t::debounce() const noexcept
+		{ return readField<uint8_t>(profileNumber_, offsetof(storedProfile_t, debounce)); }
+	debounceMode_t profileView_t::debounceMode() const noexcept
+		{ return readField<debounceMode_t>(profileNumber_, offsetof(storedProfile_t, debounceMode)); }
+	scanRate_t profileView_t::scanRate() const noexcept
+		{ return readField<scanRate_t>(profileNumber_, offsetof(storedProfile_t, scanRate)); }
+	effect_t profileView_t::effect() const noexcept
+		{ return readField<effect_t>(profileNumber_, offsetof(storedProfile_t, effect)); }
+
+	rgb_t profileView_t::keyColour(const uint8_t index) const noexcept
+	{
+		const auto led{(*flashMatrix[index]).ledIndex};
+		if (led == noLED)
+			return {};
+		const auto indices{readField<uint8_t>(profileNumber_,
+			uint16_t(offsetof(storedProfile_t, colourIndices) + (led >> 1U)))};
+		const auto entry{uint8_t((led & 1U) ? indices >> 4U : indices & 0x0FU)};
+		return readField<rgb_t>(profileNumber_, uint16_t(offsetof(storedProfile_t, palette) + (sizeof(rgb_t) * entry)));
 	}
 
+	key_t profileView_t::key(const uint8_t index) const noexcept
+		{ return readKey(profileNumber_, index).key; }
+	bool profileView_t::keyType(const uint8_t index) const noexcept
+		{ return readKey(profileNumber_, index).latching; }
+
 	void profile_t::keyType(const uint8_t index, const keyType_t type) noexcept
 	{
 		if (type == keyType_t::latching)
-			flash.keyTypes[index >> 3U] |= uint8_t(1U << (index & 7U));
+			keyTypes_[index >> 3U] |= uint8_t(1U << (index & 7U));
 		else
-			flash.keyTypes[index >> 3U] &= uint8_t(~(1U << (index & 7U)));
+			keyTypes_[index >> 3U] &= uint8_t(~(1U << (index & 7U)));
 	}
 } // namespace mxKeyboard::profile
@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include <avr/io.h>
+#include <avr/builtins.h>
+#include "scanTimer.hxx"
+
+#ifndef MXKEYBOARD_SCAN_LEAD_TIME
+#define MXKEYBOARD_SCAN_LEAD_TIME 250
+#endif
+
+namespace mxKeyboard::scanTimer
+{
+	// TCD0 runs from clkPER/4, so 4MHz
+	constexpr static uint16_t scanTicksPerMicrosecond{4U};
+	constexpr static uint16_t framePeriod{1000U * scanTicksPerMicrosecond};
+
+#ifdef MXKEYBOARD_SOF_SYNC
+	static bool sofSync_{true};
+#else
+	static bool sofSync_{false};
+#endif
+	static uint16_t leadTicks_{MXKEYBOARD_SCAN_LEAD_TIME * scanTicksPerMicrosecond};
+	static scanRate_t scanRate_{scanRate_t::rate1kHz};
+	static latencyHistogram_t histogram{};
+
+	static_assert(MXKEYBOARD_SCAN_LEAD_TIME * scanTicksPerMicrosecond < framePeriod,
+		"The scan lead time must be less than a USB frame");
+
+	// In TCD0 ticks, and always an exact divisor of a frame so SOF sync works at any rate
+	static uint16_t scanPeriod() noexcept { return framePeriod >> uint8_t(scanRate_); }
+
+	void init() noexcept
+	{
+		TCD0.CTRLA = TC_CLKSEL_DIV4_gc; // Use fPER/4
+		TCD0.CTRLB = TC_WGMODE_NORMAL_gc;
+		TCD0.CTRLE = TC_BYTEM_NORMAL_gc;
+		TCD0.INTCTRLA = TC_OVFINTLVL_HI_gc;
+		TCD0.CTRLFCLR = 0x0FU;
+		TCD0.CTRLFSET = TC_CMD_UPDATE_gc;
+		TCD0.PERBUF = scanPeriod() - 1U;
+		TCD0.CNT = 0;
+
+		TCD1.CTRLA = TC_CLKSEL_DIV64_gc;
+		TCD1.CTRLB = TC_WGMODE_NORMAL_gc;
+		TCD1.CTRLE = TC_BYTEM_NORMAL_gc;
+		TCD1.INTCTRLA = TC_OVFINTLVL_OFF_gc;
+		TCD1.PER = UINT16_MAX;
+		TCD1.CNT = 0;
+	}
+
+	void scanRate(const scanRate_t rate) noexcept
+	{
+		scanRate_ = rate > scanRate_t::rate8kHz ? scanRate_t::rate1kHz : rate;
+		TCD0.PERBUF = scanPeriod() - 1U;
+	}
+
+	scanRate_t scanRate() noexcept { return scanRate_; }
+	uint8_t scansPerMillisecond() noexcept { return uint8_t(1U << uint8_t(scanRate_)); }
+
+	// keyIRQ is still running when the next scan comes due, so it is not keeping up with the scan rate
+	bool scanOverrun() noexcept { return TCD0.INTFLAGS & TC0_OVFIF_bm; }
+
+	void sofSync(const bool enable) noexcept { sofSync_ = enable; }
+
+	bool sofSync() noexcept { return sofSync_; }
+
+	void leadTime(const uint16_t microseconds) noexcept
+	{
+		// Clamp to leave the scan a little room inside the frame
+		const auto ticks{uint32_t(microseconds) * scanTicksPerMicrosecond};
+		leadTicks_ = ticks < framePeriod ? uint16_t(ticks) : framePeriod - scanTicksPerMicrosecond;
+	}
+
+	uint16_t leadTime() noexcept { return leadTicks_ / scanTicksPerMicrosecond; }
+
+	void startOfFrame() noexcept
+	{
+		if (!sofSync_)
+			return;
+		// Restart the scan period such that one ends (and keyIRQ fires) leadTime before the next SOF
+		TCD0.CNT = leadTicks_ % scanPeriod();
+	}
+
+	uint16_t timestamp() noexcept { return TCD1.CNT; }
+
+	void recordLatency(const uint16_t edgeTimestamp) noexcept
+	{
+		const auto bucket{uint16_t(uint16_t(timestamp() - edgeTimestamp) / latencyBucketWidth)};
+		auto &count{histogram.buckets[bucket < latencyBucketCount ? bucket : latencyBucketCount - 1U]};
+		// Saturate rather than wrap so a long capture can't make a bucket look empty
+		if (count != UINT16_MAX)
+			++count;
+	}
+
+	latencyHistogram_t latencyHistogram() noexcept
+	{
+		// Latencies are recorded from the USB interrupt, so keep it out while we take a consistent copy
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		const auto result{histogram};
+		SREG = sreg;
+		return result;
+	}
+
+	void resetLatencyHistogram() noexcept
+	{
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		histogram = {};
+		SREG = sreg;
+	}
+} // namespace mxKeyboard::scanTimer
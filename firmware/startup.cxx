@@ -135,7 +135,7 @@ void vectorTable()
 		jmp irqEmptyDef ; DMA Channel 0 vector
 		jmp irqEmptyDef ; DMA Channel 1 vector
 		jmp dmaChannel2IRQ ; DMA Channel 2 vector
-		jmp irqEmptyDef ; DMA Channel 3 vector
+		jmp dmaChannel3IRQ ; DMA Channel 3 vector
 		jmp irqEmptyDef ; RTC Overflow vector
 		jmp irqEmptyDef ; RTC Compare vector
 		jmp irqEmptyDef ; Two-Wire C Peripheral vector
@@ -158,8 +158,8 @@ void vectorTable()
 		jmp irqEmptyDef ; USART C1 Data Register Empty vector
 		jmp irqEmptyDef ; USART C1 Transmit Complete vector
 		jmp irqEmptyDef ; AES vector
-		jmp irqEmptyDef ; NVM EEPROM Ready vector
-		jmp irqEmptyDef ; NVM SPM Ready vector
+		jmp nvmEEPROMReadyIRQ ; NVM EEPROM Ready vector
+		jmp nvmSPMReadyIRQ ; NVM SPM Ready vector
 		jmp irqEmptyDef ; Port B Int0 vector
 		jmp irqEmptyDef ; Port B Int1 vector
 		jmp irqEmptyDef ; Analog Comparator B Int0 vector
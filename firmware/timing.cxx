@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: BSD-3-Clause
+#include "MXKeyboard.hxx"
+#include "memory.hxx"
+#include "timing.hxx"
+
+using namespace mxKeyboard::timing;
+
+[[gnu::used]] std::array<isrTiming_t, 2> isrTimings{};
+[[gnu::used]] timingInput_t timingInput{};
+[[gnu::used]] std::array<copyTiming_t, copySizes.size()> copyTimings{};
+
+namespace mxKeyboard::timing
+{
+	static uint8_t lfsr{0xA5U};
+	static uint8_t scanCount{0};
+
+	void timingInit() noexcept
+	{
+		TCE0.CTRLA = TC_CLKSEL_DIV1_gc; // Use fPER which is also the CPU clock
+		TCE0.CTRLB = TC_WGMODE_NORMAL_gc;
+		TCE0.CTRLE = TC_BYTEM_NORMAL_gc;
+		TCE0.INTCTRLA = TC_OVFINTLVL_OFF_gc;
+		TCE0.PER = UINT16_MAX;
+		TCE0.CNT = 0;
+	}
+
+	uint8_t sampleRows(const uint8_t column) noexcept
+	{
+		const uint8_t switches{PORTF.IN};
+		if (timingInput.toggle && ((scanCount / timingInput.toggle) & 1U))
+			return switches & 0x3FU;
+		auto rows{timingInput.rows[column]};
+		if (timingInput.chatter)
+		{
+			// Galois LFSR, x^8 + x^6 + x^5 + x^4 + 1
+			lfsr = uint8_t((lfsr >> 1U) ^ (-(lfsr & 1U) & 0xB8U));
+			rows ^= lfsr;
+		}
+		return (rows | switches) & 0x3FU;
+	}
+
+	void scanComplete() noexcept { ++scanCount; }
+
+	// Copying the buffer onto itself costs the same as copying it elsewhere and saves 4KiB of RAM
+	static std::array<uint8_t, copySizes[copySizes.size() - 1U]> copyBuffer{};
+
+	void timeCopies() noexcept
+	{
+		for (std::size_t size{0}; size < copySizes.size(); ++size)
+		{
+			const auto count{copySizes[size]};
+			auto &timing{copyTimings[size]};
+
+			uint16_t start{TCE0.CNT};
+			mxKeyboard::memory::copy(copyBuffer.data(), copyBuffer.data(), count);
+			timing.copy = uint16_t(TCE0.CNT - start);
+
+			start = TCE0.CNT;
+			mxKeyboard::memory::fill(copyBuffer.data(), uint8_t(size), count);
+			timing.fill = uint16_t(TCE0.CNT - start);
+
+			start = TCE0.CNT;
+			dmaCopy(copyBuffer.data(), copyBuffer.data(), count);
+			dmaWaitForCopy();
+			timing.dmaCopy = uint16_t(TCE0.CNT - start);
+		}
+	}
+} // namespace mxKeyboard::timing
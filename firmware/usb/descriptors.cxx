@@ -38,7 +38,7 @@ namespace usb::descriptors
 			1, // This config
 			4, // Configuration string index
 			usbConfigAttr_t::defaults,
-			250 // "500mA max", except we need 1A
+			250 // 500mA max, the LEDs could draw far more at full white so led.cxx governs them to fit
 		}
 	}};
 
@@ -1,10 +1,17 @@
 // SPDX-License-Identifier: BSD-3-Clause
+#include <cstring>
+#include <algorithm>
+#include <avr/io.h>
+#include <avr/builtins.h>
 #include <usb/core.hxx>
 #include <usb/device.hxx>
-#include <substrate/index_sequence>
+#include "ringBuffer.hxx"
+#include "scanTimer.hxx"
 #include "usb/hid.hxx"
 #include "usb/hidTypes.hxx"
 #include "keyMatrix.hxx"
+#include "ledEffects.hxx"
+#include "timing.hxx"
 
 using namespace usb::core;
 using namespace usb::device;
@@ -24,7 +31,9 @@ namespace usb::hid
 	};
 } // namespace usb::hid
 
-static const std::array<uint8_t, 63> usbKeyboardReport
+// In report protocol the host gets an N-key rollover report: the modifier byte followed by
+// a bitmap of every usage from reserved (0x00) through to keypadEquals (0x67)
+static const std::array<uint8_t, 51> usbKeyboardReport
 {{
 	// Usage Page (Generic Desktop)
 	hid::items::global_t::usagePage | hid::descriptorSize(1),
@@ -60,20 +69,9 @@ static const std::array<uint8_t, 63> usbKeyboardReport
 	// Input (Data | Variable | Absolute) Modifier byte
 	hid::items::main_t::input | hid::descriptorSize(1),
 	hid::main_t::data | hid::main_t::variable | hid::main_t::absolute,
-	// Report Count (1)
-	hid::items::global_t::reportCount | hid::descriptorSize(1),
-	1,
-	// Report Size (8)
-	hid::items::global_t::reportSize | hid::descriptorSize(1),
-	8,
-	hid::items::main_t::input | hid::descriptorSize(1),
-	0U | hid::main_t::constant,
 	// Report Count (3)
 	hid::items::global_t::reportCount | hid::descriptorSize(1),
 	3,
-	// Report Size (1)
-	hid::items::global_t::reportSize | hid::descriptorSize(1),
-	1,
 	// Usage Page (LEDs)
 	hid::items::global_t::usagePage | hid::descriptorSize(1),
 	uint8_t(hid::usagePage_t::led),
@@ -95,30 +93,24 @@ static const std::array<uint8_t, 63> usbKeyboardReport
 	// Output (Constant)
 	hid::items::main_t::output | hid::descriptorSize(1),
 	0U | hid::main_t::constant,
-	// Report Count (6)
+	// Report Count (104)
 	hid::items::global_t::reportCount | hid::descriptorSize(1),
-	6,
-	// Report Size (8)
+	usb::hid::nkroUsageCount,
+	// Report Size (1)
 	hid::items::global_t::reportSize | hid::descriptorSize(1),
-	8,
+	1,
 	// Usage Page (KeyCodes)
 	hid::items::global_t::usagePage | hid::descriptorSize(1),
 	uint8_t(hid::usagePage_t::keyboard),
 	// Usage Minimum (Minimum Scancode) = 0
 	hid::items::local_t::usageMinimum | hid::descriptorSize(1),
 	uint8_t(hid::scancode_t::reserved),
-	// Usage Maximum (Maximum Scancode) = 0x65
+	// Usage Maximum (Maximum Scancode) = 0x67
 	hid::items::local_t::usageMaximum | hid::descriptorSize(1),
-	uint8_t(hid::scancode_t::application),
-	// Logical Minumum = 0
-	hid::items::global_t::logicalMinimum | hid::descriptorSize(1),
-	0,
-	// Logical Maximum = 101
-	hid::items::global_t::logicalMaximum | hid::descriptorSize(1),
-	101,
-	// Input (Data | Array) Scancodes
+	uint8_t(hid::scancode_t::keypadEquals),
+	// Input (Data | Variable | Absolute) Scancode bitmap
 	hid::items::main_t::input | hid::descriptorSize(1),
-	hid::main_t::data | hid::main_t::array,
+	hid::main_t::data | hid::main_t::variable | hid::main_t::absolute,
 	// End Collection
 	hid::items::main_t::endCollection | hid::descriptorSize(0)
 }};
@@ -152,11 +144,158 @@ namespace usb::hid
 {
 	bool reportStale{false};
 	bootReport_t bootReport{};
+	nkroReport_t nkroReport{};
+	protocol_t protocol{protocol_t::report};
 	uint8_t reportEndpoint{};
 	uint8_t statusStates{};
+	uint8_t profileNumber{};
+#ifdef MXKEYBOARD_ISR_TIMING
+	constexpr static std::size_t timingReplyLength{std::max(sizeof(isrTimings), sizeof(copyTimings))};
+#else
+	constexpr static std::size_t timingReplyLength{0U};
+#endif
+	// Replies to vendor requests are copied here so they outlive the request
+	std::array<uint8_t, std::max({sizeof(mxKeyboard::scanTimer::latencyHistogram_t),
+		sizeof(mxKeyboard::keyMatrix::scanStats_t), sizeof(mxKeyboard::ledEffects::frameStats_t),
+		timingReplyLength})> vendorReply{};
+
+	/*!
+	 * Tracks the pressed non-modifier usages in the order they were pressed, as a list linked through
+	 * next_ by usage, so checking for a duplicate is one lookup and letting go of a key only walks
+	 * the keys pressed before it. The oldest six are also held in slots_ for the boot report, which
+	 * letting go of one of them refills from the list, again in press order.
+	 */
+	struct pressedKeys_t final
+	{
+	private:
+		// Only usages below the modifiers (0xE0) are ever tracked
+		constexpr static uint8_t usageCount{uint8_t(scancode_t::leftControl)};
+		// next_ holds notPressed for a usage that isn't pressed, and the reserved usage ends the list
+		constexpr static uint8_t notPressed{0xFFU};
+		constexpr static uint8_t endOfList{uint8_t(scancode_t::reserved)};
+
+	public:
+		constexpr static uint8_t slotCount{6U};
+
+	private:
+		std::array<uint8_t, usageCount> next_
+		{
+			[]() noexcept
+			{
+				std::array<uint8_t, usageCount> next{};
+				for (auto &usage : next)
+					usage = notPressed;
+				return next;
+			}()
+		};
+		uint8_t first_{endOfList};
+		uint8_t last_{endOfList};
+		std::array<scancode_t, slotCount> slots_{};
+		uint8_t count_{0};
+
+		bool pressed(const uint8_t usage) const noexcept { return next_[usage] != notPressed; }
+
+		// Copies the oldest slotCount keys out of the list
+		void fillSlots() noexcept
+		{
+			auto usage{first_};
+			for (auto &slot : slots_)
+			{
+				slot = static_cast<scancode_t>(usage);
+				if (usage != endOfList)
+					usage = next_[usage];
+			}
+		}
+
+	public:
+		void clear() noexcept
+		{
+			for (auto &usage : next_)
+				usage = notPressed;
+			first_ = endOfList;
+			last_ = endOfList;
+			slots_ = {};
+			count_ = 0;
+		}
+
+		bool insert(const scancode_t key) noexcept
+		{
+			const auto usage{uint8_t(key)};
+			if (!usage || usage >= usageCount || pressed(usage))
+				return false;
+			next_[usage] = endOfList;
+			if (first_ == endOfList)
+				first_ = usage;
+			else
+				next_[last_] = usage;
+			last_ = usage;
+			if (count_ < slotCount)
+				slots_[count_] = key;
+			++count_;
+			return true;
+		}
+
+		bool erase(const scancode_t key) noexcept
+		{
+			const auto usage{uint8_t(key)};
+			if (!usage || usage >= usageCount || !pressed(usage))
+				return false;
+			// Find the key pressed just before this one to unlink it
+			uint8_t previous{endOfList};
+			uint8_t position{0};
+			for (auto current{first_}; current != usage; current = next_[current])
+			{
+				previous = current;
+				++position;
+			}
+			const auto following{next_[usage]};
+			if (previous == endOfList)
+				first_ = following;
+			else
+				next_[previous] = following;
+			if (last_ == usage)
+				last_ = previous;
+			next_[usage] = notPressed;
+			--count_;
+			// Only letting go of one of the oldest keys changes which have slots
+			if (position < slotCount)
+				fillSlots();
+			return true;
+		}
+
+		uint8_t count() const noexcept { return count_; }
+		// The oldest slotCount keys in press order, with scancode_t::reserved in any not in use
+		const std::array<scancode_t, slotCount> &slots() const noexcept { return slots_; }
+	};
 
-	std::array<scancode_t, 99> keyQueue{};
-	std::size_t keyCount{};
+	static pressedKeys_t pressedKeys{};
+
+	// A copy of a report as it stood at the end of a scan, in whichever format was active
+	struct reportSnapshot_t final
+	{
+		uint8_t length{};
+		// Whether this report carries a key change, and when the earliest one was detected
+		bool hasEdge{false};
+		uint16_t edgeTimestamp{};
+		std::array<uint8_t, sizeof(nkroReport_t)> data{};
+	};
+
+	static_assert(sizeof(bootReport_t) <= sizeof(nkroReport_t));
+
+	/*!
+	 * Reports waiting for the host to poll for them. handleReport() pushes a snapshot each time
+	 * it finds the report changed and each completed IN transfer pops one and sends the next, so a
+	 * tap shorter than the polling interval is still seen by the host as a press and a release.
+	 * The front entry is the one being transferred and stays queued until the transfer completes.
+	 */
+	static ringBuffer_t<reportSnapshot_t, 8> reportQueue{};
+	static bool reportInFlight{false};
+	static reportStats_t stats{};
+	// The stamp of the earliest key change in the next report, and that of the key change being applied
+	static bool edgePending{false};
+	static uint16_t edgeTimestamp{};
+	static bool keyEdgePending{false};
+	static uint16_t keyEdgeTimestamp{};
 
 	static_assert(sizeof(bootReport_t) == 8);
 
@@ -164,13 +303,48 @@ namespace usb::hid
 	{
 		reportStale = false;
 		bootReport = {};
+		nkroReport = {};
+		// Devices must come up in report protocol, boot hosts will ask for the boot protocol
+		protocol = protocol_t::report;
 		reportEndpoint = endpoint;
-		keyCount = 0;
+		pressedKeys.clear();
+		reportQueue.clear();
+		reportInFlight = false;
+		edgePending = false;
+		keyEdgePending = false;
 
 		epStatusControllerIn[reportEndpoint].stall(false);
 		epStatusControllerIn[reportEndpoint].memoryType(memory_t::sram);
 	}
 
+	static void buildBootReport() noexcept
+	{
+		if (pressedKeys.count() > bootReport.keyCodes.size())
+		{
+			for (auto &keyCode : bootReport.keyCodes)
+				keyCode = scancode_t::errorRollOver;
+		}
+		else
+		{
+			static_assert(sizeof(bootReport_t::keyCodes) == pressedKeys_t::slotCount * sizeof(scancode_t));
+			const auto &slots{pressedKeys.slots()};
+			std::copy(slots.begin(), slots.end(), bootReport.keyCodes.begin());
+		}
+	}
+
+	static void nkroKey(const scancode_t key, const bool pressed) noexcept
+	{
+		const auto usage{uint8_t(key)};
+		// Usages past keypadEquals have no bit in the report and so can only be sent via the boot report
+		if (usage >= nkroUsageCount)
+			return;
+		const auto mask{uint8_t(1U << (usage & 7U))};
+		if (pressed)
+			nkroReport.keys[usage >> 3U] |= mask;
+		else
+			nkroReport.keys[usage >> 3U] &= uint8_t(~mask);
+	}
+
 	static answer_t handleGetDescriptor() noexcept
 	{
 		if (packet.requestType.dir() == endpointDir_t::controllerOut)
@@ -219,9 +393,33 @@ namespace usb::hid
 		switch (request)
 		{
 			case types::request_t::getReport:
+			{
 				if (packet.requestType.dir() == endpointDir_t::controllerOut)
 					return {response_t::stall, nullptr, 0};
-				break;
+				const auto report{packet.value.asReport()};
+				if (report.type != setupPacket::reportType_t::input || report.index != 0)
+					break;
+				buildBootReport();
+				if (protocol == protocol_t::boot)
+					return {response_t::data, &bootReport, sizeof(bootReport)};
+				return {response_t::data, &nkroReport, sizeof(nkroReport)};
+			}
+			case types::request_t::getProtocol:
+				if (packet.requestType.dir() == endpointDir_t::controllerOut || packet.length != 1U)
+					return {response_t::stall, nullptr, 0};
+				return {response_t::data, &protocol, sizeof(protocol)};
+			case types::request_t::setProtocol:
+			{
+				if (packet.requestType.dir() == endpointDir_t::controllerIn)
+					return {response_t::stall, nullptr, 0};
+				const auto requested{static_cast<protocol_t>(uint16_t(packet.value))};
+				if (requested != protocol_t::boot && requested != protocol_t::report)
+					break;
+				protocol = requested;
+				// Make sure the host sees the current key state in the newly selected format
+				reportStale = true;
+				return {response_t::zeroLength, nullptr, 0};
+			}
 			case types::request_t::setReport:
 			{
 				if (packet.requestType.dir() == endpointDir_t::controllerIn)
@@ -239,11 +437,105 @@ namespace usb::hid
 				}
 				return {response_t::stall, nullptr, 0};
 			}
+			default:
+				break;
 		}
 
 		return {response_t::stall, nullptr, 0};
 	}
 
+	// Answers a vendor request for data with a copy of value, if the host asked for exactly that much
+	template<typename T> static answer_t vendorData(const T &value) noexcept
+	{
+		static_assert(sizeof(T) <= sizeof(vendorReply));
+		if (packet.requestType.dir() == endpointDir_t::controllerOut || packet.length != sizeof(T))
+			return {response_t::stall, nullptr, 0};
+		std::memcpy(vendorReply.data(), &value, sizeof(T));
+		return {response_t::data, vendorReply.data(), sizeof(T)};
+	}
+
+	static answer_t handleVendorRequest() noexcept
+	{
+		const auto request{static_cast<vendorRequest_t>(packet.request)};
+		switch (request)
+		{
+			case vendorRequest_t::getProfile:
+				if (packet.requestType.dir() == endpointDir_t::controllerOut || packet.length != 1U)
+					return {response_t::stall, nullptr, 0};
+				profileNumber = mxKeyboard::keyMatrix::activeProfile();
+				return {response_t::data, &profileNumber, sizeof(profileNumber)};
+			case vendorRequest_t::setProfile:
+			{
+				if (packet.requestType.dir() == endpointDir_t::controllerIn)
+					return {response_t::stall, nullptr, 0};
+				const auto requested{uint16_t(packet.value)};
+				// The switch itself happens from the main loop
+				if (requested > UINT8_MAX || !mxKeyboard::keyMatrix::selectProfile(uint8_t(requested)))
+					break;
+				return {response_t::zeroLength, nullptr, 0};
+			}
+			case vendorRequest_t::getLatency:
+			{
+				const auto answer{vendorData(mxKeyboard::scanTimer::latencyHistogram())};
+				if (answer.response == response_t::data && uint16_t(packet.value) == 1U)
+					mxKeyboard::scanTimer::resetLatencyHistogram();
+				return answer;
+			}
+			case vendorRequest_t::getScanSync:
+				return vendorData(scanSync_t{mxKeyboard::scanTimer::sofSync(), mxKeyboard::scanTimer::leadTime()});
+			case vendorRequest_t::setSOFSync:
+			{
+				const auto enable{uint16_t(packet.value)};
+				if (packet.requestType.dir() == endpointDir_t::controllerIn || enable > 1U)
+					break;
+				mxKeyboard::scanTimer::sofSync(enable == 1U);
+				return {response_t::zeroLength, nullptr, 0};
+			}
+			case vendorRequest_t::setLeadTime:
+				if (packet.requestType.dir() == endpointDir_t::controllerIn)
+					break;
+				mxKeyboard::scanTimer::leadTime(uint16_t(packet.value));
+				return {response_t::zeroLength, nullptr, 0};
+			case vendorRequest_t::getScanStats:
+			{
+				const auto answer{vendorData(mxKeyboard::keyMatrix::scanStats())};
+				if (answer.response == response_t::data && uint16_t(packet.value) == 1U)
+					mxKeyboard::keyMatrix::resetScanStats();
+				return answer;
+			}
+			case vendorRequest_t::getFrameStats:
+			{
+				const auto answer{vendorData(mxKeyboard::ledEffects::frameStats())};
+				if (answer.response == response_t::data && uint16_t(packet.value) == 1U)
+					mxKeyboard::ledEffects::resetFrameStats();
+				return answer;
+			}
+#ifdef MXKEYBOARD_ISR_TIMING
+			case vendorRequest_t::getISRTimings:
+			{
+				// keyIRQ and tcc0OverflowIRQ record into these, so keep them out while we take a consistent copy
+				const uint8_t sreg{SREG};
+				__builtin_avr_cli();
+				const auto timings{isrTimings};
+				SREG = sreg;
+				const auto answer{vendorData(timings)};
+				if (answer.response == response_t::data && uint16_t(packet.value) == 1U)
+				{
+					__builtin_avr_cli();
+					isrTimings = {};
+					SREG = sreg;
+				}
+				return answer;
+			}
+			case vendorRequest_t::getCopyTimings:
+				return vendorData(copyTimings);
+#endif
+			default:
+				break;
+		}
+		return {response_t::stall, nullptr, 0};
+	}
+
 	static answer_t handleSetupRequest(std::size_t interface) noexcept
 	{
 		if (packet.requestType.recipient() != setupPacket::recipient_t::interface ||
@@ -258,34 +550,110 @@ namespace usb::hid
 				break;
 			case setupPacket::request_t::typeClass:
 				return handleHIDRequest();
+			case setupPacket::request_t::typeVendor:
+				return handleVendorRequest();
 			default:
 				break;
 		}
 		return {response_t::stall, nullptr, 0};
 	}
 
+	// Starts sending the oldest queued report if the endpoint is not already busy with one
+	static void sendReport() noexcept
+	{
+		if (reportInFlight || reportQueue.empty())
+			return;
+
+		const auto &report{reportQueue.front()};
+		auto &epStatus{epStatusControllerIn[reportEndpoint]};
+		epStatus.memBuffer = report.data.data();
+		epStatus.transferCount = report.length;
+		epStatus.needsArming(true);
+		reportInFlight = true;
+		writeEP(reportEndpoint);
+	}
+
+	static void reportSent(const uint8_t) noexcept
+	{
+		if (reportInFlight)
+		{
+			const auto &report{reportQueue.front()};
+			if (report.hasEdge)
+				mxKeyboard::scanTimer::recordLatency(report.edgeTimestamp);
+			reportQueue.pop();
+			reportInFlight = false;
+		}
+		sendReport();
+	}
+
 	void handleReport() noexcept
 	{
 		if (reportStale)
 		{
-			pauseWriteEP(reportEndpoint);
-
-			if (keyCount > bootReport.keyCodes.size())
+			// Both reports are kept up to date by keyPress() and keyRelease(), so this is just picking one
+			reportSnapshot_t snapshot{};
+			if (protocol == protocol_t::boot)
 			{
-				for (auto &keyCode : bootReport.keyCodes)
-					keyCode = scancode_t::errorRollOver;
+				buildBootReport();
+				snapshot.length = sizeof(bootReport);
+				std::memcpy(snapshot.data.data(), &bootReport, sizeof(bootReport));
 			}
 			else
-				std::memcpy(bootReport.keyCodes.data(), keyQueue.data(), bootReport.keyCodes.size());
+			{
+				snapshot.length = sizeof(nkroReport);
+				std::memcpy(snapshot.data.data(), &nkroReport, sizeof(nkroReport));
+			}
+			snapshot.hasEdge = edgePending;
+			snapshot.edgeTimestamp = edgeTimestamp;
+			edgePending = false;
 
-			epStatusControllerIn[reportEndpoint].memBuffer = &bootReport;
-			epStatusControllerIn[reportEndpoint].needsArming(true);
-			epStatusControllerIn[reportEndpoint].transferCount = sizeof(bootReport);
+			if (!reportQueue.push(snapshot))
+			{
+				// Out of space, so fold this into the newest queued report (which is never the one
+				// in flight) so at least the final state the host ends up seeing is correct
+				auto &newest{reportQueue.back()};
+				if (newest.hasEdge)
+				{
+					snapshot.hasEdge = true;
+					snapshot.edgeTimestamp = newest.edgeTimestamp;
+				}
+				newest = snapshot;
+				++stats.overflows;
+			}
+			if (reportQueue.size() > stats.maxDepth)
+				stats.maxDepth = reportQueue.size();
 			reportStale = false;
-			writeEP(reportEndpoint);
 		}
+
+		// Completing an IN transfer also starts a report send, so keep the USB interrupt out while we do
+		const uint8_t sreg{SREG};
+		__builtin_avr_cli();
+		sendReport();
+		SREG = sreg;
 	}
 
+	void keyEdge(const uint16_t timestamp) noexcept
+	{
+		keyEdgePending = true;
+		keyEdgeTimestamp = timestamp;
+	}
+
+	// Marks the report as needing sending, taking the stamp of the key change that changed it
+	static void reportChanged() noexcept
+	{
+		reportStale = true;
+		// Only the earliest change going into a report counts towards its latency
+		if (keyEdgePending && !edgePending)
+		{
+			edgePending = true;
+			edgeTimestamp = keyEdgeTimestamp;
+		}
+	}
+
+	// The counters are only touched by handleReport(), which runs from the main loop
+	reportStats_t reportStats() noexcept { return stats; }
+	void resetReportStats() noexcept { stats = {}; }
+
 	static void handleModifier(const scancode_t key, const bool pressed) noexcept
 	{
 		const uint8_t bit{uint8_t(uint8_t(key) - uint8_t(scancode_t::leftControl))};
@@ -294,50 +662,39 @@ namespace usb::hid
 			bootReport.modifier |= mask;
 		else
 			bootReport.modifier &= uint8_t(~mask);
-		reportStale = true;
+		nkroReport.modifier = bootReport.modifier;
+		reportChanged();
 	}
 
 	void keyPress(const scancode_t key) noexcept
 	{
 		if (key >= scancode_t::leftControl && key <= scancode_t::rightMeta)
 			handleModifier(key, true);
-		else
+		else if (pressedKeys.insert(key))
 		{
-			for (const auto &i : substrate::indexSequence_t{keyCount})
-			{
-				if (keyQueue[i] == key)
-					return;
-			}
-			keyQueue[keyCount] = key;
-			++keyCount;
-			reportStale = true;
+			nkroKey(key, true);
+			reportChanged();
 		}
+		// The stamp went with this key change whether it changed the report or not
+		keyEdgePending = false;
 	}
 
 	void keyRelease(const scancode_t key) noexcept
 	{
 		if (key >= scancode_t::leftControl && key <= scancode_t::rightMeta)
 			handleModifier(key, false);
-		else
+		else if (pressedKeys.erase(key))
 		{
-			bool found{false};
-			for (const auto &i : substrate::indexSequence_t{keyCount})
-			{
-				if (found)
-					keyQueue[i - 1U] = keyQueue[i];
-				else if (keyQueue[i] == key)
-					found = true;
-			}
-			if (found)
-				keyQueue[--keyCount] = scancode_t::reserved;
-			reportStale = true;
+			nkroKey(key, false);
+			reportChanged();
 		}
+		keyEdgePending = false;
 	}
 
 	static const flash_t<handler_t> hidKeyboardHandler
 	{{
 		init,
-		nullptr,
+		reportSent,
 		nullptr
 	}};
 
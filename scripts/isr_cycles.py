@@ -0,0 +1,221 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: BSD-3-Clause
+"""
+Measures the cycle cost of keyIRQ and tcc0OverflowIRQ under an AVR simulator.
+
+The firmware must be built with -Disr_timing=true, which makes the ISRs record
+their own cycle counts (see firmware/include/timing.hxx) and makes keyIRQ read
+the matrix from the timingInput structure as well as PORTF. This script starts
+the simulator with its GDB server enabled, then for each key pattern: halts the
+CPU, writes the pattern and fresh statistics into RAM, lets it run, halts it
+again and reads the statistics back. It also reports the cycle counts the firmware
+took for memory copies and fills of a few sizes as it started up.
+
+The simulator must model the ATxmega256A3U (its XMEGA timers, DMA and NVM
+controller included), which neither simavr nor simulavr do at present, so the
+meson benchmark only runs when one is given with -Disr_simulator=<path>. Without
+one the same statistics can be read from a keyboard running an isr_timing build
+with the getISRTimings and getCopyTimings vendor requests (see
+firmware/include/usb/hid.hxx): those numbers are what the instrumented ISRs
+counted on the real part, while it scanned the real matrix.
+"""
+
+import argparse
+import dataclasses
+import pathlib
+import socket
+import struct
+import subprocess
+import sys
+import time
+import typing
+
+MATRIX_COLUMNS = 21
+ISR_NAMES = ("keyIRQ", "tcc0OverflowIRQ")
+# uint16_t min, uint16_t max, uint32_t total, uint16_t count
+ISR_TIMING = struct.Struct("<HHIH")
+# Must match copySizes in firmware/include/timing.hxx
+COPY_SIZES = (8, 64, 512, 4096)
+# uint16_t copy, uint16_t fill, uint16_t dmaCopy
+COPY_TIMING = struct.Struct("<HHH")
+# uint8_t chatter, uint8_t toggle, uint8_t rows[21]
+TIMING_INPUT = struct.Struct(f"<BB{MATRIX_COLUMNS}s")
+
+
+@dataclasses.dataclass
+class Pattern:
+    name: str
+    rows: typing.List[int]
+    toggle: int = 0
+    chatter: bool = False
+
+    def encode(self):
+        return TIMING_INPUT.pack(int(self.chatter), self.toggle, bytes(self.rows))
+
+
+def matrix(*keys):
+    rows = [0] * MATRIX_COLUMNS
+    for column, row in keys:
+        rows[column] |= 1 << row
+    return rows
+
+
+PATTERNS = (
+    Pattern("idle", matrix()),
+    # The 'A' key, pressed and released every 8 scans
+    Pattern("single press", matrix((1, 3)), toggle=8),
+    # The number and top letter rows of columns 1-10, pressed and released every 32 scans
+    Pattern("20-key chord", matrix(*((column, row) for column in range(1, 11) for row in (1, 2))), toggle=32),
+    Pattern("full-matrix chatter", matrix(), chatter=True),
+)
+
+
+class GDBRemote:
+    """Just enough of the GDB remote serial protocol to halt, resume and poke at memory."""
+
+    def __init__(self, port, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                self.sock = socket.create_connection(("localhost", port), timeout=timeout)
+                break
+            except OSError:
+                if time.monotonic() > deadline:
+                    raise
+                time.sleep(0.1)
+        self.buffer = b""
+
+    def close(self):
+        self.sock.close()
+
+    def _read_byte(self):
+        if not self.buffer:
+            self.buffer = self.sock.recv(4096)
+            if not self.buffer:
+                raise ConnectionError("simulator closed the GDB connection")
+        byte, self.buffer = self.buffer[:1], self.buffer[1:]
+        return byte
+
+    def _read_packet(self):
+        while self._read_byte() != b"$":
+            continue
+        data = b""
+        while (byte := self._read_byte()) != b"#":
+            data += byte
+        checksum = int(self._read_byte() + self._read_byte(), 16)
+        if sum(data) & 0xFF != checksum:
+            self.sock.sendall(b"-")
+            return self._read_packet()
+        self.sock.sendall(b"+")
+        return data.decode("ascii")
+
+    def command(self, data, reply=True):
+        payload = data.encode("ascii")
+        packet = b"$" + payload + b"#" + f"{sum(payload) & 0xFF:02x}".encode("ascii")
+        while True:
+            self.sock.sendall(packet)
+            ack = self._read_byte()
+            if ack == b"+":
+                break
+        return self._read_packet() if reply else None
+
+    def halt(self):
+        self.sock.sendall(b"\x03")
+        return self._read_packet()
+
+    def resume(self):
+        self.command("c", reply=False)
+
+    def read(self, address, length):
+        reply = self.command(f"m{address:x},{length:x}")
+        if reply.startswith("E"):
+            raise RuntimeError(f"failed to read {length} bytes at {address:#x}: {reply}")
+        return bytes.fromhex(reply)
+
+    def write(self, address, data):
+        reply = self.command(f"M{address:x},{len(data):x}:{data.hex()}")
+        if reply != "OK":
+            raise RuntimeError(f"failed to write {len(data)} bytes at {address:#x}: {reply}")
+
+
+def find_symbols(elf, nm_prog, *names):
+    output = subprocess.check_output([nm_prog, elf]).decode("utf-8")
+    symbols = {}
+    for line in output.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[2] in names:
+            symbols[parts[2]] = int(parts[0], 16)
+    missing = set(names) - symbols.keys()
+    if missing:
+        raise RuntimeError(
+            f"{', '.join(sorted(missing))} not found in {elf}, was it built with -Disr_timing=true?"
+        )
+    return symbols
+
+
+def simulator_command(simulator, elf, port, frequency):
+    name = pathlib.Path(simulator).name
+    if name.startswith("simulavr"):
+        return [simulator, "-d", "atxmega256a3u", "-F", str(frequency), "-g", "-p", str(port), "-f", str(elf)]
+    return [simulator, "-m", "atxmega256a3u", "-f", str(frequency), "-g", str(port), str(elf)]
+
+
+def run_pattern(gdb, symbols, pattern, duration):
+    # The CPU is halted on entry (simulators wait for the debugger at reset) and on exit
+    gdb.write(symbols["timingInput"], pattern.encode())
+    gdb.write(symbols["isrTimings"], ISR_TIMING.pack(0xFFFF, 0, 0, 0) * len(ISR_NAMES))
+    gdb.resume()
+    time.sleep(duration)
+    gdb.halt()
+    data = gdb.read(symbols["isrTimings"], ISR_TIMING.size * len(ISR_NAMES))
+    return [ISR_TIMING.unpack_from(data, ISR_TIMING.size * i) for i in range(len(ISR_NAMES))]
+
+
+def main():
+    parser = argparse.ArgumentParser("isr_cycles.py")
+    parser.add_argument("elf_file", type=pathlib.Path)
+    parser.add_argument("--simulator", type=pathlib.Path, default="simavr")
+    parser.add_argument("--nm-prog", type=pathlib.Path, default="avr-nm")
+    parser.add_argument("--port", type=int, default=1234)
+    parser.add_argument("--frequency", type=int, default=16000000)
+    parser.add_argument("--duration", type=float, default=5.0, help="wall-clock seconds to run each pattern for")
+
+    args = parser.parse_args()
+    symbols = find_symbols(args.elf_file, args.nm_prog, "isrTimings", "timingInput", "copyTimings")
+
+    simulator = subprocess.Popen(
+        simulator_command(args.simulator, args.elf_file, args.port, args.frequency),
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+    )
+    failed = False
+    try:
+        gdb = GDBRemote(args.port, timeout=10)
+        # Let the firmware get through start-up and settle with an idle matrix
+        run_pattern(gdb, symbols, PATTERNS[0], args.duration)
+
+        data = gdb.read(symbols["copyTimings"], COPY_TIMING.size * len(COPY_SIZES))
+        print(f"{'bytes':<8}{'copy':>10}{'fill':>10}{'DMA copy':>10}")
+        for index, size in enumerate(COPY_SIZES):
+            copy, fill, dma_copy = COPY_TIMING.unpack_from(data, COPY_TIMING.size * index)
+            print(f"{size:<8}{copy:>10}{fill:>10}{dma_copy:>10}")
+        print()
+
+        print(f"{'pattern':<22}{'ISR':<18}{'calls':>8}{'min':>8}{'avg':>10}{'max':>8}")
+        for pattern in PATTERNS:
+            for name, (minimum, maximum, total, count) in zip(ISR_NAMES, run_pattern(gdb, symbols, pattern, args.duration)):
+                if not count:
+                    print(f"{pattern.name:<22}{name:<18}{0:>8}{'-':>8}{'-':>10}{'-':>8}")
+                    failed = True
+                    continue
+                print(f"{pattern.name:<22}{name:<18}{count:>8}{minimum:>8}{total / count:>10.1f}{maximum:>8}")
+        gdb.close()
+    finally:
+        simulator.terminate()
+        simulator.wait()
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())